@@ -0,0 +1,430 @@
+/*!
+ * \file bookshelf_scanner.cpp
+ * \brief Hand-written scanners implementation file.
+ */
+
+#include "bookshelf_scanner.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace thueda {
+
+    namespace {
+
+        //! The same character class as boost::spirit::ascii::space.
+        inline bool is_space(char c)
+        {
+            return c == ' ' || (c >= '\t' && c <= '\r');
+        }
+
+        inline bool is_digit(char c)
+        {
+            return static_cast<unsigned char>(c - '0') < 10;
+        }
+
+#if defined(__AVX2__)
+        //! Bit i is set if p[i] is a space, for the 32 bytes starting at p.
+        inline uint32_t space_mask(const char *p)
+        {
+            const __m256i v  = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            const __m256i sp = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+            const __m256i ge = _mm256_cmpgt_epi8(v, _mm256_set1_epi8('\t' - 1));
+            const __m256i le = _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), v);
+            return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(sp, _mm256_and_si256(ge, le))));
+        }
+        const size_t SIMD_WIDTH = 32;
+#elif defined(__SSE2__)
+        //! Bit i is set if p[i] is a space, for the 16 bytes starting at p.
+        inline uint32_t space_mask(const char *p)
+        {
+            const __m128i v  = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            const __m128i sp = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+            const __m128i ge = _mm_cmpgt_epi8(v, _mm_set1_epi8('\t' - 1));
+            const __m128i le = _mm_cmplt_epi8(v, _mm_set1_epi8('\r' + 1));
+            return static_cast<uint32_t>(_mm_movemask_epi8(_mm_or_si128(sp, _mm_and_si128(ge, le))));
+        }
+        const size_t SIMD_WIDTH = 16;
+#endif
+
+        //! First position in [p, end) which is not a space, or end.
+        inline const char *skip_space(const char *p, const char *end)
+        {
+            //most runs are a single separator, so test a few bytes before going wide
+            if (p == end || !is_space(*p)) return p;
+            if (++p == end || !is_space(*p)) return p;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+            const uint32_t full = static_cast<uint32_t>((uint64_t(1) << SIMD_WIDTH) - 1);
+            while (static_cast<size_t>(end - p) >= SIMD_WIDTH) {
+                uint32_t non_space = ~space_mask(p) & full;
+                if (non_space) return p + __builtin_ctz(non_space);
+                p += SIMD_WIDTH;
+            }
+#endif
+            while (p != end && is_space(*p)) ++p;
+            return p;
+        }
+
+        //! First position in [p, end) which is a space, or end.
+        inline const char *find_space(const char *p, const char *end)
+        {
+#if defined(__AVX2__) || defined(__SSE2__)
+            while (static_cast<size_t>(end - p) >= SIMD_WIDTH) {
+                uint32_t space = space_mask(p);
+                if (space) return p + __builtin_ctz(space);
+                p += SIMD_WIDTH;
+            }
+#endif
+            while (p != end && !is_space(*p)) ++p;
+            return p;
+        }
+
+        //! Exactly representable powers of ten.
+        const double POW10[] = {
+                1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+
+        //! A cursor over a character buffer, with one routine per grammar primitive.
+        /*!
+         * Every routine skips leading spaces first, as the spirit skipper does, and only
+         * advances the cursor on success, so callers can backtrack by saving p.
+         */
+        struct Scanner {
+            const char *p;
+            const char *end;
+
+            Scanner(const char *begin, const char *end) : p(begin), end(end) {}
+
+            bool at_end()
+            {
+                p = skip_space(p, end);
+                return p == end;
+            }
+
+            //! Match a literal prefix, like qi::lit.
+            bool lit(const char *s)
+            {
+                const char *q = skip_space(p, end);
+                size_t n = std::strlen(s);
+                if (static_cast<size_t>(end - q) < n || std::memcmp(q, s, n) != 0) return false;
+                p = q + n;
+                return true;
+            }
+
+            //! Match one character out of chars, like a single character qi::symbols.
+            bool one_of(const char *chars, size_t &which)
+            {
+                const char *q = skip_space(p, end);
+                if (q == end) return false;
+                const char *hit = std::strchr(chars, *q);
+                if (hit == nullptr || *q == '\0') return false;
+                which = hit - chars;
+                p = q + 1;
+                return true;
+            }
+
+            //! Skip "#..." comment lines, like *comment_rule.
+            void comments()
+            {
+                for (;;) {
+                    const char *q = skip_space(p, end);
+                    if (q == end || *q != '#') return;
+                    const char *eol = static_cast<const char*>(std::memchr(q, '\n', end - q));
+                    p = eol ? eol : end;
+                }
+            }
+
+            //! Match +~space, like id_rule.
+            bool id(Id &out)
+            {
+                const char *q = skip_space(p, end);
+                const char *e = find_space(q, end);
+                if (e == q) return false;
+                out.assign(q, e);
+                p = e;
+                return true;
+            }
+
+            //! Match an unsigned integer, like qi::uint_, failing on overflow.
+            bool uint(unsigned int &out)
+            {
+                const char *q = skip_space(p, end);
+                if (q == end || !is_digit(*q)) return false;
+                uint64_t value = 0;
+                while (q != end && is_digit(*q)) {
+                    value = value * 10 + (*q++ - '0');
+                    if (value > 0xFFFFFFFFu) return false;
+                }
+                out = static_cast<unsigned int>(value);
+                p = q;
+                return true;
+            }
+
+            //! Match a real number, like qi::double_.
+            /*!
+             * Mantissas below 2^53 with a decimal exponent within +/-22 are converted with one
+             * exact multiplication or division, which is correctly rounded. Anything else is
+             * handed to strtod.
+             */
+            bool real(double &out)
+            {
+                const char *q = skip_space(p, end);
+                const char *start = q;
+
+                bool negative = false;
+                if (q != end && (*q == '+' || *q == '-')) negative = (*q++ == '-');
+
+                uint64_t mantissa = 0;
+                int exponent = 0;
+                bool digits = false, exact = true;
+
+                for (; q != end && is_digit(*q); ++q, digits = true) {
+                    if (mantissa < (uint64_t(1) << 53) / 10) mantissa = mantissa * 10 + (*q - '0');
+                    else { ++exponent; exact = exact && *q == '0'; }
+                }
+                if (q != end && *q == '.') {
+                    ++q;
+                    for (; q != end && is_digit(*q); ++q, digits = true) {
+                        if (mantissa < (uint64_t(1) << 53) / 10) { mantissa = mantissa * 10 + (*q - '0'); --exponent; }
+                        else exact = exact && *q == '0';
+                    }
+                }
+                if (!digits) return false;
+
+                if (q != end && (*q == 'e' || *q == 'E')) {
+                    const char *e = q + 1;
+                    bool exp_negative = false;
+                    if (e != end && (*e == '+' || *e == '-')) exp_negative = (*e++ == '-');
+                    if (e != end && is_digit(*e)) {
+                        int value = 0;
+                        for (; e != end && is_digit(*e); ++e) {
+                            if (value < 10000) value = value * 10 + (*e - '0');
+                        }
+                        exponent += exp_negative ? -value : value;
+                        q = e;
+                    }
+                }
+
+                if (exact && -22 <= exponent && exponent <= 22) {
+                    double value = static_cast<double>(mantissa);
+                    value = exponent < 0 ? value / POW10[-exponent] : value * POW10[exponent];
+                    out = negative ? -value : value;
+                } else {
+                    std::string text(start, q);
+                    out = std::strtod(text.c_str(), nullptr);
+                }
+
+                p = q;
+                return true;
+            }
+
+            //! Reserve for at most n records of at least record_bytes bytes each.
+            size_t capacity_hint(unsigned int n, size_t record_bytes) const
+            {
+                size_t bound = static_cast<size_t>(end - p) / record_bytes + 1;
+                return n < bound ? n : bound;
+            }
+        };
+
+    }//end anonymous namespace
+
+    bool scan_bookshelf_node(const char *begin, const char *end, BookshelfNodes &nodes)
+    {
+        Scanner s(begin, end);
+
+        if (!s.lit("UCLA") || !s.lit("nodes") || !s.lit("1.0")) return false;
+        s.comments();
+        if (!s.lit("NumNodes")     || !s.lit(":") || !s.uint(nodes.num_nodes))     return false;
+        if (!s.lit("NumTerminals") || !s.lit(":") || !s.uint(nodes.num_terminals)) return false;
+
+        nodes.data.reserve(s.capacity_hint(nodes.num_nodes, 6));
+
+        BookshelfNode node;
+        unsigned int width = 0, height = 0;
+        for (;;) {
+            const char *save = s.p;
+            if (!s.id(node.id) || !s.uint(width) || !s.uint(height)) {
+                s.p = save;
+                break;
+            }
+            node.width  = width;
+            node.height = height;
+            node.fixed  = s.lit("terminal");
+            nodes.data.push_back(node);
+        }
+
+        return s.at_end();
+    }
+
+    bool scan_bookshelf_pl(const char *begin, const char *end, BookshelfPls &pls)
+    {
+        Scanner s(begin, end);
+
+        if (!s.lit("UCLA") || !s.lit("pl") || !s.lit("1.0")) return false;
+        s.comments();
+
+        pls.data.reserve(s.capacity_hint(static_cast<unsigned int>(end - begin), 10));
+
+        BookshelfPl pl;
+        for (;;) {
+            const char *save = s.p;
+            if (!s.id(pl.id) || !s.real(pl.x) || !s.real(pl.y) || !s.lit(":") || !s.lit("N")) {
+                s.p = save;
+                break;
+            }
+            pl.fixed = s.lit("/FIXED");
+            pls.data.push_back(pl);
+        }
+
+        return s.at_end();
+    }
+
+    namespace {
+
+        //! Scan the NumNets/NumPins header of a .nets file, leaving s at the first net.
+        bool scan_net_header(Scanner &s, BookshelfNets &nets)
+        {
+            if (!s.lit("UCLA") || !s.lit("nets") || !s.lit("1.0")) return false;
+            s.comments();
+            if (!s.lit("NumNets") || !s.lit(":") || !s.uint(nets.num_nets)) return false;
+            if (!s.lit("NumPins") || !s.lit(":") || !s.uint(nets.num_pins)) return false;
+            return true;
+        }
+
+        //! Scan net records until s hits something else, like *net_rule.
+        void scan_net_records(Scanner &s, std::vector<BookshelfNet> &data)
+        {
+            static const char IO_CHARS[] = "IOB";
+            static const IOType IO_TYPES[] = { IOType::Input, IOType::Output, IOType::Bidirection };
+
+            BookshelfPin pin;
+            size_t io = 0;
+            for (;;) {
+                const char *save = s.p;
+                data.emplace_back();
+                BookshelfNet &net = data.back();
+                if (!s.lit("NetDegree") || !s.lit(":") || !s.uint(net.degree) || !s.id(net.id)) {
+                    data.pop_back();
+                    s.p = save;
+                    break;
+                }
+
+                net.pins.reserve(s.capacity_hint(net.degree, 8));
+                for (;;) {
+                    const char *pin_save = s.p;
+                    if (!s.id(pin.id) || !s.one_of(IO_CHARS, io) || !s.lit(":") || !s.real(pin.dx) || !s.real(pin.dy)) {
+                        s.p = pin_save;
+                        break;
+                    }
+                    pin.io = IO_TYPES[io];
+                    net.pins.push_back(pin);
+                }
+            }
+        }
+
+        //! First line in [p, end) starting with "NetDegree", or end.
+        const char *next_net_record(const char *p, const char *end)
+        {
+            static const char KEY[] = "NetDegree";
+            const size_t n = sizeof(KEY) - 1;
+
+            while (static_cast<size_t>(end - p) >= n) {
+                const char *eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+                if (eol == nullptr) break;
+                const char *line = skip_space(eol + 1, end);
+                if (static_cast<size_t>(end - line) >= n && std::memcmp(line, KEY, n) == 0) return line;
+                p = line;
+            }
+            return end;
+        }
+
+    }//end anonymous namespace
+
+    bool scan_bookshelf_net(const char *begin, const char *end, BookshelfNets &nets)
+    {
+        Scanner s(begin, end);
+
+        if (!scan_net_header(s, nets)) return false;
+
+        nets.data.reserve(s.capacity_hint(nets.num_nets, 14));
+        scan_net_records(s, nets.data);
+
+        return s.at_end();
+    }
+
+    bool scan_bookshelf_net(const char *begin, const char *end, BookshelfNets &nets, unsigned int num_threads)
+    {
+        //below this many bytes per chunk, threads cost more than they save
+        const size_t MIN_CHUNK_BYTES = 1 << 20;
+
+        Scanner s(begin, end);
+        if (!scan_net_header(s, nets)) return false;
+
+        size_t body_bytes = static_cast<size_t>(end - s.p);
+        size_t num_chunks = num_threads * 4;
+        if (num_chunks > body_bytes / MIN_CHUNK_BYTES) num_chunks = body_bytes / MIN_CHUNK_BYTES;
+        if (num_threads <= 1 || num_chunks <= 1) {
+            nets.data.reserve(s.capacity_hint(nets.num_nets, 14));
+            scan_net_records(s, nets.data);
+            return s.at_end();
+        }
+
+        //cut the body at net record boundaries, the first chunk starts wherever the header ended
+        std::vector<const char*> bounds(1, s.p);
+        for (size_t i=1; i<num_chunks; ++i) {
+            const char *cut = next_net_record(s.p + body_bytes * i / num_chunks, end);
+            if (cut > bounds.back()) bounds.push_back(cut);
+        }
+        bounds.push_back(end);
+        num_chunks = bounds.size() - 1;
+
+        std::vector<std::vector<BookshelfNet>> chunk_data(num_chunks);
+        std::vector<char> chunk_ok(num_chunks, 0);
+        std::atomic<size_t> next_chunk(0);
+
+        auto worker = [&]() {
+            for (size_t i = next_chunk++; i < num_chunks; i = next_chunk++) {
+                Scanner cs(bounds[i], bounds[i+1]);
+                scan_net_records(cs, chunk_data[i]);
+                chunk_ok[i] = cs.at_end();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (unsigned int t=1; t<num_threads && t<num_chunks; ++t) {
+            workers.emplace_back(worker);
+        }
+        worker();
+        for (std::thread &w : workers) w.join();
+
+        size_t total = 0;
+        for (size_t i=0; i<num_chunks; ++i) {
+            if (!chunk_ok[i]) return false;
+            total += chunk_data[i].size();
+        }
+
+        nets.data.reserve(nets.data.size() + total);
+        for (size_t i=0; i<num_chunks; ++i) {
+            std::move(chunk_data[i].begin(), chunk_data[i].end(), std::back_inserter(nets.data));
+            std::vector<BookshelfNet>().swap(chunk_data[i]);
+        }
+
+        return true;
+    }
+
+}//end namespace thueda
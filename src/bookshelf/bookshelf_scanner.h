@@ -0,0 +1,53 @@
+/*!
+ * \file bookshelf_scanner.h
+ * \brief Hand-written scanners for bookshelf .nodes, .pl and .nets files.
+ */
+
+#ifndef BOOKSHELF_SCANNER_H
+#define BOOKSHELF_SCANNER_H
+
+#include "bookshelf_node.h"
+#include "bookshelf_pl.h"
+#include "bookshelf_net.h"
+
+namespace thueda {
+
+    /*!
+     * The scanners accept exactly the grammars documented in bookshelf_node_parser.hpp,
+     * bookshelf_pl_parser.hpp and bookshelf_net_parser.hpp and fill the same data structures,
+     * but work directly on a contiguous character buffer: whitespace runs and identifiers are
+     * delimited 16 (SSE2) or 32 (AVX2) bytes at a time, and numbers are converted in place
+     * without building intermediate strings.
+     */
+
+    /*!
+     * \fn bool scan_bookshelf_node(const char *begin, const char *end, BookshelfNodes &nodes);
+     * \brief Scan a whole .nodes file held in [begin, end).
+     */
+    bool scan_bookshelf_node(const char *begin, const char *end, BookshelfNodes &nodes);
+
+    /*!
+     * \fn bool scan_bookshelf_pl(const char *begin, const char *end, BookshelfPls &pls);
+     * \brief Scan a whole .pl file held in [begin, end).
+     */
+    bool scan_bookshelf_pl(const char *begin, const char *end, BookshelfPls &pls);
+
+    /*!
+     * \fn bool scan_bookshelf_net(const char *begin, const char *end, BookshelfNets &nets);
+     * \brief Scan a whole .nets file held in [begin, end).
+     */
+    bool scan_bookshelf_net(const char *begin, const char *end, BookshelfNets &nets);
+
+    /*!
+     * \fn bool scan_bookshelf_net(const char *begin, const char *end, BookshelfNets &nets, unsigned int num_threads);
+     * \brief Scan a whole .nets file held in [begin, end) with num_threads threads.
+     *
+     * The body after the NumPins header is cut into chunks at lines starting with "NetDegree",
+     * the chunks are scanned concurrently and their nets are concatenated in file order,
+     * so the result is the same as the sequential version's.
+     */
+    bool scan_bookshelf_net(const char *begin, const char *end, BookshelfNets &nets, unsigned int num_threads);
+
+}//end namespace thueda
+
+#endif//BOOKSHELF_SCANNER_H
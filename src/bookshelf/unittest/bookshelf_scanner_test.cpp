@@ -0,0 +1,279 @@
+/*!
+ * \file bookshelf_scanner_test.cpp
+ * \brief bookshelf scanner unittest, checked against the spirit parsers.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <iterator>
+#include <cstdlib>
+#include <fstream>
+#include <chrono>
+
+#include "bookshelf_node_parser.hpp"
+#include "bookshelf_pl_parser.hpp"
+#include "bookshelf_net_parser.hpp"
+#include "bookshelf_scanner.h"
+
+using namespace std;
+using namespace thueda;
+
+static string read_file(const string &path)
+{
+    ifstream in(path, ios_base::in);
+    in.unsetf(ios::skipws);
+
+    string storage;
+    copy(istream_iterator<char>(in),
+         istream_iterator<char>(),
+         back_inserter(storage));
+    return storage;
+}
+
+static double seconds_since(const chrono::steady_clock::time_point &start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static void compare_nodes(const string &benchmark)
+{
+    string storage = read_file(string(getenv("BENCHMARK")) + "/ispd2005/" + benchmark + "/" + benchmark + ".nodes");
+
+    BookshelfNodes expected, actual;
+
+    string::const_iterator iter = storage.begin(), end = storage.end();
+    bool expected_ret = parse_bookshelf_node(iter, end, expected);
+    bool actual_ret = scan_bookshelf_node(storage.data(), storage.data() + storage.size(), actual);
+
+    REQUIRE(expected_ret == true);
+    REQUIRE(actual_ret   == true);
+    REQUIRE(actual.num_nodes     == expected.num_nodes);
+    REQUIRE(actual.num_terminals == expected.num_terminals);
+    REQUIRE(actual.data.size()   == expected.data.size());
+    for (size_t i=0; i<expected.data.size(); ++i) {
+        REQUIRE(actual.data[i].id     == expected.data[i].id);
+        REQUIRE(actual.data[i].width  == expected.data[i].width);
+        REQUIRE(actual.data[i].height == expected.data[i].height);
+        REQUIRE(actual.data[i].fixed  == expected.data[i].fixed);
+    }
+}
+
+static void compare_pls(const string &benchmark)
+{
+    string storage = read_file(string(getenv("BENCHMARK")) + "/ispd2005/" + benchmark + "/" + benchmark + ".pl");
+
+    BookshelfPls expected, actual;
+
+    string::const_iterator iter = storage.begin(), end = storage.end();
+    bool expected_ret = parse_bookshelf_pl(iter, end, expected);
+    bool actual_ret = scan_bookshelf_pl(storage.data(), storage.data() + storage.size(), actual);
+
+    REQUIRE(expected_ret == true);
+    REQUIRE(actual_ret   == true);
+    REQUIRE(actual.data.size() == expected.data.size());
+    for (size_t i=0; i<expected.data.size(); ++i) {
+        REQUIRE(actual.data[i].id    == expected.data[i].id);
+        REQUIRE(actual.data[i].x     == expected.data[i].x);
+        REQUIRE(actual.data[i].y     == expected.data[i].y);
+        REQUIRE(actual.data[i].fixed == expected.data[i].fixed);
+    }
+}
+
+//! Require the nets of actual to be the ones of expected, pin by pin.
+static void require_same_nets(const vector<BookshelfNet> &actual, const vector<BookshelfNet> &expected)
+{
+    REQUIRE(actual.size() == expected.size());
+    for (size_t i=0; i<expected.size(); ++i) {
+        const BookshelfNet &a = actual[i], &e = expected[i];
+        REQUIRE(a.id     == e.id);
+        REQUIRE(a.degree == e.degree);
+        REQUIRE(a.pins.size() == e.pins.size());
+        for (size_t j=0; j<e.pins.size(); ++j) {
+            REQUIRE(a.pins[j].id == e.pins[j].id);
+            REQUIRE(a.pins[j].io == e.pins[j].io);
+            REQUIRE(a.pins[j].dx == e.pins[j].dx);
+            REQUIRE(a.pins[j].dy == e.pins[j].dy);
+        }
+    }
+}
+
+static void compare_nets(const string &benchmark)
+{
+    string storage = read_file(string(getenv("BENCHMARK")) + "/ispd2005/" + benchmark + "/" + benchmark + ".nets");
+
+    BookshelfNets expected, actual, parallel;
+
+    string::const_iterator iter = storage.begin(), end = storage.end();
+    bool expected_ret = parse_bookshelf_net(iter, end, expected);
+    bool actual_ret   = scan_bookshelf_net(storage.data(), storage.data() + storage.size(), actual);
+    bool parallel_ret = scan_bookshelf_net(storage.data(), storage.data() + storage.size(), parallel, 4);
+
+    REQUIRE(expected_ret == true);
+    REQUIRE(actual_ret   == true);
+    REQUIRE(parallel_ret == true);
+    REQUIRE(actual.num_nets    == expected.num_nets);
+    REQUIRE(actual.num_pins    == expected.num_pins);
+    REQUIRE(parallel.num_nets  == expected.num_nets);
+    REQUIRE(parallel.num_pins  == expected.num_pins);
+    require_same_nets(actual.data,   expected.data);
+    require_same_nets(parallel.data, expected.data);
+}
+
+//! Print the time the parsers, the scanners and the 4 thread .nets scanner take on a benchmark.
+static void report_scan_times(const string &benchmark)
+{
+    const string prefix = string(getenv("BENCHMARK")) + "/ispd2005/" + benchmark + "/" + benchmark;
+    string nodes_storage = read_file(prefix + ".nodes");
+    string pls_storage   = read_file(prefix + ".pl");
+    string nets_storage  = read_file(prefix + ".nets");
+
+    BookshelfNodes parsed_nodes, scanned_nodes;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    string::const_iterator iter = nodes_storage.begin(), end = nodes_storage.end();
+    parse_bookshelf_node(iter, end, parsed_nodes);
+    double parse_time = seconds_since(start);
+    start = chrono::steady_clock::now();
+    scan_bookshelf_node(nodes_storage.data(), nodes_storage.data() + nodes_storage.size(), scanned_nodes);
+    cout << benchmark << ".nodes parse " << parse_time << "s, scan " << seconds_since(start) << "s" << endl;
+
+    BookshelfPls parsed_pls, scanned_pls;
+    start = chrono::steady_clock::now();
+    iter = pls_storage.begin(), end = pls_storage.end();
+    parse_bookshelf_pl(iter, end, parsed_pls);
+    parse_time = seconds_since(start);
+    start = chrono::steady_clock::now();
+    scan_bookshelf_pl(pls_storage.data(), pls_storage.data() + pls_storage.size(), scanned_pls);
+    cout << benchmark << ".pl parse " << parse_time << "s, scan " << seconds_since(start) << "s" << endl;
+
+    BookshelfNets parsed_nets, scanned_nets, parallel_nets;
+    start = chrono::steady_clock::now();
+    iter = nets_storage.begin(), end = nets_storage.end();
+    parse_bookshelf_net(iter, end, parsed_nets);
+    parse_time = seconds_since(start);
+    start = chrono::steady_clock::now();
+    scan_bookshelf_net(nets_storage.data(), nets_storage.data() + nets_storage.size(), scanned_nets);
+    double scan_time = seconds_since(start);
+    start = chrono::steady_clock::now();
+    scan_bookshelf_net(nets_storage.data(), nets_storage.data() + nets_storage.size(), parallel_nets, 4);
+    cout << benchmark << ".nets parse " << parse_time << "s, scan " << scan_time << "s"
+         << ", scan with 4 threads " << seconds_since(start) << "s" << endl;
+}
+
+//! A .nets file of num_nets two pin nets, the pin of net bad_net, if any, with an unknown direction.
+static string two_pin_nets(size_t num_nets, size_t bad_net)
+{
+    string storage = "UCLA nets 1.0\nNumNets : " + to_string(num_nets) + "\nNumPins : " + to_string(2 * num_nets) + "\n";
+    for (size_t i=0; i<num_nets; ++i) {
+        storage += "NetDegree : 2 n" + to_string(i) + "\n";
+        storage += " o" + to_string(i) + " I : 0.5 -1.5\n";
+        storage += " o" + to_string(i + 1) + (i == bad_net ? " X" : " O") + " : -2 3\n";
+    }
+    return storage;
+}
+
+SCENARIO("adaptec1", "[adaptec1]") {
+
+    GIVEN("The adaptec1 bookshelf files") {
+
+        WHEN("we scan and parse the .nodes file") {
+            THEN("the scanner gets the same nodes as BookshelfNodeParser") {
+                compare_nodes("adaptec1");
+            }
+        }
+
+        WHEN("we scan and parse the .pl file") {
+            THEN("the scanner gets the same pls as BookshelfPlParser") {
+                compare_pls("adaptec1");
+            }
+        }
+
+        WHEN("we scan and parse the .nets file") {
+            THEN("the scanner gets the same nets as BookshelfNetParser") {
+                compare_nets("adaptec1");
+            }
+        }
+    }//end GIVEN
+
+}//end adaptec1
+
+SCENARIO("bigblue4", "[bigblue4]") {
+
+    GIVEN("The bigblue4 bookshelf files") {
+
+        WHEN("we scan and parse the .nodes file") {
+            THEN("the scanner gets the same nodes as BookshelfNodeParser") {
+                compare_nodes("bigblue4");
+            }
+        }
+
+        WHEN("we scan and parse the .pl file") {
+            THEN("the scanner gets the same pls as BookshelfPlParser") {
+                compare_pls("bigblue4");
+            }
+        }
+
+        WHEN("we scan and parse the .nets file") {
+            THEN("the scanner gets the same nets as BookshelfNetParser") {
+                compare_nets("bigblue4");
+            }
+        }
+    }//end GIVEN
+
+}//end bigblue4
+
+SCENARIO("scan times", "[benchmark][.]") {
+
+    GIVEN("The adaptec1 and bigblue4 bookshelf files") {
+        THEN("we print the time of the parsers and the scanners") {
+            report_scan_times("adaptec1");
+            report_scan_times("bigblue4");
+        }
+    }//end GIVEN
+
+}//end scan times
+
+SCENARIO("malformed input", "[malformed]") {
+
+    GIVEN("A truncated .nets file") {
+        string storage = "UCLA nets 1.0\nNumNets : 1\nNumPins : 2\nNetDegree : 2 n0\n o0 I : 0.5 -1.5\n o1 O :";
+
+        WHEN("we scan and parse it") {
+            BookshelfNets expected, actual;
+            string::const_iterator iter = storage.begin(), end = storage.end();
+            bool expected_ret = parse_bookshelf_net(iter, end, expected);
+            bool actual_ret   = scan_bookshelf_net(storage.data(), storage.data() + storage.size(), actual);
+            BookshelfNets parallel;
+            bool parallel_ret = scan_bookshelf_net(storage.data(), storage.data() + storage.size(), parallel, 4);
+
+            THEN("all of them reject it") {
+                REQUIRE(expected_ret == false);
+                REQUIRE(actual_ret   == false);
+                REQUIRE(parallel_ret == false);
+            }
+        }
+    }//end GIVEN
+
+
+    GIVEN("A .nets file of several chunks, with a bad pin direction in a late chunk") {
+        const size_t num_nets = 100000;
+        string good = two_pin_nets(num_nets, num_nets);
+        string bad  = two_pin_nets(num_nets, num_nets * 7 / 8);
+        REQUIRE(bad.size() > 4 * (1 << 20));
+
+        WHEN("we scan it with 4 threads, and the same file without the error") {
+            BookshelfNets good_nets, bad_nets, serial_nets;
+            bool good_ret   = scan_bookshelf_net(good.data(), good.data() + good.size(), good_nets, 4);
+            bool bad_ret    = scan_bookshelf_net(bad.data(),  bad.data()  + bad.size(),  bad_nets,  4);
+            bool serial_ret = scan_bookshelf_net(bad.data(),  bad.data()  + bad.size(),  serial_nets);
+
+            THEN("only the file without the error is accepted") {
+                REQUIRE(good_ret == true);
+                REQUIRE(good_nets.data.size() == num_nets);
+                REQUIRE(bad_ret    == false);
+                REQUIRE(serial_ret == false);
+            }
+        }
+    }//end GIVEN
+
+}//end malformed input
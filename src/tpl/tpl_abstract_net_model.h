@@ -8,16 +8,48 @@
 #define TPL_ABSTRACT_NET_MODEL_H
 
 #include "tpl_db.h"
-#include <map>
-#include <utility>
+#include <vector>
 
 namespace tpl {
 
+    //! The weighted two pin connections of all the nets in one direction.
     /*!
-     * \typedef std::map<std::pair<TplPin*, TplPin*>, double> NetWeight;
-     * \brief NetWeight type
+     * Connection k joins the pins TplNets::pin(pin1[k]) and TplNets::pin(pin2[k]) with weight[k].
+     * The arrays are only cleared between iterations, so once they reached their size
+     * computing the net weight again allocates nothing.
      */
-    using NetWeight = std::map<std::pair<TplPin*, TplPin*>, double>;
+    struct NetWeight {
+        std::vector<unsigned int> pin1;   //!< Index of every connection's first pin in TplNets.
+        std::vector<unsigned int> pin2;   //!< Index of every connection's second pin in TplNets.
+        std::vector<double>       weight; //!< Every connection's weight.
+
+        //! Number of connections.
+        size_t size() const
+        {
+            return weight.size();
+        }
+        //! Remove all the connections, keeping the capacity.
+        void clear()
+        {
+            pin1.clear();
+            pin2.clear();
+            weight.clear();
+        }
+        //! Make room for n connections.
+        void reserve(size_t n)
+        {
+            pin1.reserve(n);
+            pin2.reserve(n);
+            weight.reserve(n);
+        }
+        //! Append a connection.
+        void push_back(unsigned int p1, unsigned int p2, double w)
+        {
+            pin1.push_back(p1);
+            pin2.push_back(p2);
+            weight.push_back(w);
+        }
+    };
 
     //! Interface definition for tpl net model.
     class TplAbstractNetModel {
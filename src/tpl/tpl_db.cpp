@@ -4,15 +4,25 @@
 #include <sstream>
 #include <fstream>
 #include <ctime>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <algorithm>
+#include <atomic>
 
 #include <boost/filesystem.hpp>
-#include <boost/spirit/include/support_istream_iterator.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 #include "../bookshelf/bookshelf_node_parser.hpp"
 #include "../bookshelf/bookshelf_pl_parser.hpp"
 #include "../bookshelf/bookshelf_net_parser.hpp"
 #include "../bookshelf/bookshelf_pl_generator.hpp"
+#include "../bookshelf/bookshelf_scanner.h"
 
+#include "tpl_db_cache.h"
 #include "debug.h"
 
 
@@ -50,6 +60,38 @@ namespace tpl {
 
         _chip_width  = static_cast<Length>(width);
         _chip_height = static_cast<Length>(height);
+        sync_geometry();
+    }
+
+    TplModules::TplModules(std::vector<TplModule> &&modules, unsigned int num_free) :
+            _num_modules(modules.size()),
+            _num_free(num_free),
+            _chip_width(0),
+            _chip_height(0),
+            _modules(std::move(modules))
+    {
+        double width(0), height(0);
+        for(size_t i=0; i<_modules.size(); ++i) {
+            const TplModule &m = _modules[i];
+            _id_index_map.insert( make_pair(m.id, i) );
+
+            double right_border = m.x + m.width;
+            if(right_border>width) width  = right_border;
+            double top_border = m.y + m.height;
+            if(top_border>height)  height = top_border;
+        }
+
+        _chip_width  = static_cast<Length>(width);
+        _chip_height = static_cast<Length>(height);
+        sync_geometry();
+    }
+
+    TplModules::TplModules() :
+            _num_modules(0),
+            _num_free(0),
+            _chip_width(0),
+            _chip_height(0)
+    {
     }
 
     TplModules::TplModules(BOOST_RV_REF(TplModules) temp) :
@@ -58,7 +100,8 @@ namespace tpl {
             _chip_width(temp._chip_width),
             _chip_height(temp._chip_height),
             _modules(std::move(temp._modules)),
-            _id_index_map(std::move(temp._id_index_map))
+            _id_index_map(std::move(temp._id_index_map)),
+            _geometry(std::move(temp._geometry))
     {
     }
 
@@ -73,6 +116,8 @@ namespace tpl {
         _modules      = std::move(temp._modules);
         _id_index_map = std::move(temp._id_index_map);
 
+        _geometry     = std::move(temp._geometry);
+
         return *this;
     }
 
@@ -86,13 +131,28 @@ namespace tpl {
 
         _modules.clear();
         _id_index_map.clear();
+        sync_geometry();
     }
 
-    TplModule& TplModules::module(const std::string &id)
+    void TplModules::sync_geometry()
     {
-        assert(_id_index_map.count(id) != 0);
-
-        return _modules[_id_index_map[id]];
+        const size_t n = _modules.size();
+        _geometry.x.resize(n);
+        _geometry.y.resize(n);
+        _geometry.width.resize(n);
+        _geometry.height.resize(n);
+        _geometry.power_density.resize(n);
+        _geometry.fixed.resize(n);
+
+        for (size_t i=0; i<n; ++i) {
+            const TplModule &m = _modules[i];
+            _geometry.x[i]      = m.x;
+            _geometry.y[i]      = m.y;
+            _geometry.width[i]  = m.width;
+            _geometry.height[i] = m.height;
+            _geometry.power_density[i] = m.power_density;
+            _geometry.fixed[i]  = m.fixed;
+        }
     }
 
     const TplModule& TplModules::module(const std::string &id) const
@@ -121,15 +181,17 @@ namespace tpl {
             _modules[i].x += chip_width() / 2.0;
             _modules[i].y += chip_height() / 2.0;
         }
+        sync_geometry();
     }
 
     void TplModules::set_random_position() {
         srand(time(NULL));
-        for (iterator mit = _modules.begin();
+        for (vector<TplModule>::iterator mit = _modules.begin();
                 mit != _modules.end(); ++mit) {
             mit->x = _chip_width / 4 + rand() % (_chip_width / 2 - mit->width);
             mit->y = _chip_height / 4 + rand() % (_chip_height / 2 - mit->height);
         }
+        sync_geometry();
     }
 
     double TplModules::set_free_module_coordinates(const std::vector<double> &xs, const std::vector<double> &ys)
@@ -137,19 +199,44 @@ namespace tpl {
         assert( xs.size() == _num_free );
         assert( ys.size() == _num_free );
 
+        const TplModuleGeometry &g = _geometry;
+        double *gx = _geometry.x.data();
+        double *gy = _geometry.y.data();
+
         double moveDis = 0.0;
 
         for(size_t i=0; i<_num_free; ++i) {
             //module x and y denotes lower left corner
-            double x_new = xs[i] - _modules[i].width / 2.0;
-            double y_new = ys[i] - _modules[i].height / 2.0;
-            moveDis += pow(x_new - _modules[i].x, 2) + pow(y_new - _modules[i].y, 2);
-            _modules[i].x = x_new;
-            _modules[i].y = y_new;
+            double x_new = xs[i] - g.width[i] / 2.0;
+            double y_new = ys[i] - g.height[i] / 2.0;
+            moveDis += (x_new - gx[i]) * (x_new - gx[i]) + (y_new - gy[i]) * (y_new - gy[i]);
+            gx[i] = x_new;
+            gy[i] = y_new;
+        }
+
+        for(size_t i=0; i<_num_free; ++i) {
+            _modules[i].x = gx[i];
+            _modules[i].y = gy[i];
         }
         return sqrt(moveDis);
     }
 
+    void TplModules::move_free_modules(const double *delta_x, const double *delta_y)
+    {
+        double *gx = _geometry.x.data();
+        double *gy = _geometry.y.data();
+
+        for(size_t i=0; i<_num_free; ++i) {
+            gx[i] += delta_x[i];
+            gy[i] += delta_y[i];
+        }
+
+        for(size_t i=0; i<_num_free; ++i) {
+            _modules[i].x = gx[i];
+            _modules[i].y = gy[i];
+        }
+    }
+
     void TplModules::get_bookshelf_pls(thueda::BookshelfPls &bpls) const
     {
         bpls.data.clear();
@@ -161,8 +248,8 @@ namespace tpl {
     }
 
     void TplModules::add_shredded_cells(map<Id, vector<TplModule> > macro_cells) {
-        TplModules::iterator iterBegin = _modules.begin() + _num_free;
-        TplModules::iterator iterEnd = _modules.begin() + _num_modules;
+        vector<TplModule>::iterator iterBegin = _modules.begin() + _num_free;
+        vector<TplModule>::iterator iterEnd = _modules.begin() + _num_modules;
 
         // back up macros
         _macros.clear();
@@ -172,34 +259,38 @@ namespace tpl {
         _modules.erase(iterBegin, iterEnd);
 
         // delete from id_index_map and add new cells
+        _shredded_cells.clear();
         for (map<Id, vector<TplModule>>::iterator iter = macro_cells.begin();
                 iter != macro_cells.end(); iter++) {
             _id_index_map.erase(iter->first);
-            vector<TplModule> cells = iter->second;
+            const vector<TplModule> &cells = iter->second;
+            size_t first = _modules.size();
             _modules.insert(_modules.end(), cells.begin(), cells.end());
             for (size_t i = 0; i < cells.size(); ++i) {
-                _id_index_map.insert(make_pair(cells[i].id, _modules.size() - 1));
+                _id_index_map.insert(make_pair(cells[i].id, first + i));
             }
+            _shredded_cells[iter->first] = make_pair(first, _modules.size());
         }
 
         // update modules number
         _num_modules = _modules.size();
+        sync_geometry();
     }
 
 	void TplModules::aggregate_cells() {
 		// for each macro, calculate mean and variance of shredded cells
 		for (vector<TplModule>::iterator macro_iter = _macros.begin();
 				macro_iter != _macros.end(); macro_iter++) {
-			vector<TplModule> cells = _shredded_cells[macro_iter->id];
-			int n = cells.size();
+			const pair<size_t, size_t> &cells = _shredded_cells[macro_iter->id];
+			int n = cells.second - cells.first;
+			if (n == 0) continue;
 			double x_mean = 0.0, y_mean = 0.0, x_var = 0.0, y_var = 0.0;
 			// calculate mean and variance
-			for (vector<TplModule>::iterator it = cells.begin();
-					it != cells.end(); it++) {
-				x_mean += it->x;
-				y_mean += it->y;
-				x_var += it->x * it->x;
-				y_var += it->y * it->y;
+			for (size_t i = cells.first; i < cells.second; i++) {
+				x_mean += _modules[i].x;
+				y_mean += _modules[i].y;
+				x_var += _modules[i].x * _modules[i].x;
+				y_var += _modules[i].y * _modules[i].y;
 			}
 			x_mean /= n;
 			y_mean /= n;
@@ -214,13 +305,12 @@ namespace tpl {
 			}
 		}
 
-		// delete cells from _modules
+		// delete cells from _id_index_map and _modules
+		for (size_t i = _num_free; i < _modules.size(); i++) {
+			_id_index_map.erase(_modules[i].id);
+		}
 		_modules.erase(_modules.begin() + _num_free, _modules.end());
-		// find begin position of shredded cells in _id_index_map
-		// and delete all cells from that position to end
-		map<Id, size_t>::iterator iter = _id_index_map.begin();
-        advance(iter, _num_free);
-		_id_index_map.erase(iter, _id_index_map.end());
+		_shredded_cells.clear();
 
 		// add macros back to _modules
 		_modules.insert(_modules.end(), _macros.begin(), _macros.end());
@@ -231,57 +321,123 @@ namespace tpl {
 		for (size_t i = _num_free; i < _num_modules; i++) {
 			_id_index_map[_modules[i].id] = i;
 		}
+		sync_geometry();
 	}
 
 
-    TplNets::TplNets(const BookshelfNets &bnets)
+    namespace {
+        std::atomic<std::uint64_t> next_net_revision(1);
+    }
+
+    void TplNets::touch()
     {
-        _num_nets = bnets.num_nets;
-        _num_pins = bnets.num_pins;
+        _revision = next_net_revision++;
+    }
 
-        copy(bnets.data.begin(), bnets.data.end(), back_inserter(_netlist));
+    TplNets::TplNets(const BookshelfNets &bnets, const TplModules &modules) :
+            _num_shred_nets(0), _revision(next_net_revision++)
+    {
+        _netlist.ids.reserve(bnets.data.size());
+        _netlist.degrees.reserve(bnets.data.size());
+        _netlist.pin_offsets.reserve(bnets.data.size()+1);
+        _netlist.pins.reserve(bnets.num_pins);
+
+        _netlist.pin_offsets.push_back(0);
+        for (vector<BookshelfNet>::const_iterator bit=bnets.data.begin(); bit!=bnets.data.end(); ++bit) {
+            _netlist.ids.push_back(bit->id);
+            _netlist.degrees.push_back(bit->degree);
+            for (vector<BookshelfPin>::const_iterator pit=bit->pins.begin(); pit!=bit->pins.end(); ++pit) {
+                TplPin pin;
+                pin.module_index = modules.module_index(pit->id);
+                pin.io = pit->io;
+                pin.dx = pit->dx;
+                pin.dy = pit->dy;
+                _netlist.pins.push_back(pin);
+            }
+            _netlist.pin_offsets.push_back(_netlist.pins.size());
+        }
+    }
+
+    TplNets::TplNets(std::vector<Id> &&ids, std::vector<unsigned int> &&degrees,
+                     std::vector<unsigned int> &&pin_offsets, std::vector<TplPin> &&pins) :
+            _num_shred_nets(0), _revision(next_net_revision++)
+    {
+        assert(degrees.size() == ids.size());
+        assert(pin_offsets.size() == ids.size()+1);
+        assert(pin_offsets.back() == pins.size());
+
+        _netlist.ids         = std::move(ids);
+        _netlist.degrees     = std::move(degrees);
+        _netlist.pin_offsets = std::move(pin_offsets);
+        _netlist.pins        = std::move(pins);
+    }
+
+    TplNets::TplNets() :
+            _num_shred_nets(0), _revision(next_net_revision++)
+    {
+        _netlist.pin_offsets.push_back(0);
     }
 
     TplNets::TplNets(BOOST_RV_REF(TplNets) temp) :
-            _num_nets(temp._num_nets),
-            _num_pins(temp._num_pins),
-            _netlist(std::move(temp._netlist))
+            _num_shred_nets(temp._num_shred_nets),
+            _revision(next_net_revision++),
+            _netlist(std::move(temp._netlist)),
+            _netlist_backup(std::move(temp._netlist_backup))
     {
+        temp.touch();
     }
 
     TplNets& TplNets::operator=(BOOST_RV_REF(TplNets) temp)
     {
-        _num_nets = temp._num_nets;
-        _num_pins = temp._num_pins;
-        _netlist  = std::move(temp._netlist);
+        _num_shred_nets = temp._num_shred_nets;
+        _netlist        = std::move(temp._netlist);
+        _netlist_backup = std::move(temp._netlist_backup);
+        touch();
+        temp.touch();
 
         return *this;
     }
 
     void TplNets::clear()
     {
-        _num_nets = 0;
-        _num_pins = 0;
+        _num_shred_nets = 0;
 
-        _netlist.clear();
+        _netlist = Netlist();
+        _netlist.pin_offsets.push_back(0);
+        touch();
     }
 
-	void TplNets::add_net(list<TplNet> newNets) {
+    void TplNets::append(const std::vector<TplNet> &nets)
+    {
+        for (vector<TplNet>::const_iterator nit=nets.begin(); nit!=nets.end(); ++nit) {
+            _netlist.ids.push_back(nit->id);
+            _netlist.degrees.push_back(nit->degree);
+            _netlist.pins.insert(_netlist.pins.end(), nit->pins.begin(), nit->pins.end());
+            _netlist.pin_offsets.push_back(_netlist.pins.size());
+        }
+        touch();
+    }
+
+    void TplNets::assign(const std::vector<TplNet> &netlist)
+    {
+        clear();
+        append(netlist);
+    }
+
+	void TplNets::add_net(const vector<TplNet> &newNets) {
         _num_shred_nets = newNets.size();
-		_num_nets += _num_shred_nets;
-		_netlist.insert(_netlist.end(), newNets.begin(), newNets.end());
+		append(newNets);
 	}
 
 	void TplNets::backup_net() {
-        _netlist_backup.clear();
 		_netlist_backup = _netlist;
 	}
 
 	void TplNets::delete_net() {
-		_num_nets -= _num_shred_nets;
 		_num_shred_nets = 0;
-		_netlist = _netlist_backup;
-		_netlist_backup.clear();
+		_netlist = std::move(_netlist_backup);
+		_netlist_backup = Netlist();
+		touch();
 	}
 
 
@@ -292,37 +448,132 @@ namespace tpl {
     }
 
 
+    namespace {
+        //! Serializes the load reports of the module and the net loading threads.
+        mutex report_mutex;
+
+        //! Print the wall clock time since start, like Timer::timeit does with cpu time.
+        void report_time(const TplLoadOptions &options, const std::string &task,
+                         const chrono::steady_clock::time_point &start)
+        {
+            if (!options.report) return;
+
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            lock_guard<mutex> lock(report_mutex);
+            cout << task << " finished, took " << setprecision(4) << seconds << " seconds." << endl;
+        }
+
+        //! Bring a whole benchmark file into memory and run parse on its [begin, end) bytes.
+        /*!
+         * In LoadMode::Mmap the file is mapped read-only and parsed in place, so no copy
+         * of the file ever exists in the heap. LoadMode::Copy keeps the historical
+         * istream copy for comparison. Throws if the file can not be read or parsed.
+         */
+        template<typename Parse>
+        void parse_file(const std::string &file, const TplLoadOptions &options, Parse parse)
+        {
+            namespace bip = boost::interprocess;
+
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+            uintmax_t bytes = boost::filesystem::file_size(file);
+            bool ret = false;
+
+            if (options.mode == LoadMode::Mmap && bytes != 0) {
+                bip::file_mapping  mapping(file.c_str(), bip::read_only);
+                bip::mapped_region region(mapping, bip::read_only);
+                region.advise(bip::mapped_region::advice_sequential);
+
+                const char *begin = static_cast<const char*>(region.get_address());
+                const char *end   = begin + region.get_size();
+                ret = parse(begin, end);
+            } else {
+                ifstream in(file);
+                in.unsetf(ios::skipws);
+
+                string storage;
+                storage.reserve(bytes);
+                copy(istream_iterator<char>(in),
+                     istream_iterator<char>(),
+                     back_inserter(storage));
+
+                const char *begin = storage.data();
+                const char *end   = begin + storage.size();
+                ret = parse(begin, end);
+            }
+
+            if (!ret) {
+                throw runtime_error("failed to parse " + file);
+            }
+
+            if (options.report) {
+                lock_guard<mutex> lock(report_mutex);
+                double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                cout << boost::filesystem::path(file).filename().string() << " : "
+                     << bytes << " bytes, "
+                     << setprecision(4) << seconds << " seconds, "
+                     << setprecision(4) << (seconds > 0 ? bytes / seconds / 1e6 : 0) << " MB/s" << endl;
+            }
+        }
+    }//end anonymous namespace
+
     //////////////////////////////////Helper Functions///////////////////////////////////
-    bool TplDB::load_circuit(const std::string &path)
+    bool TplDB::load_circuit(const std::string &path, const TplLoadOptions &options)
     {
         try {
             boost::filesystem::path   benchmark_path(path);
             _benchmark_name = benchmark_path.filename().string();
+            _load_options   = options;
 
-            ///////////////////////////////////////////////////////////////////
-            Timer t;
-            t.timeit();
-            //load modules
             boost::filesystem::path node_file_path(benchmark_path);
             node_file_path /= _benchmark_name + string(".nodes");
             boost::filesystem::path pl_file_path(benchmark_path);
             pl_file_path /= _benchmark_name + string(".pl");
+            boost::filesystem::path net_file_path(benchmark_path);
+            net_file_path /= _benchmark_name + string(".nets");
+            boost::filesystem::path cache_file_path(benchmark_path);
+            cache_file_path /= _benchmark_name + string(".tplcache");
+
+            vector<string> sources = { node_file_path.string(), pl_file_path.string(), net_file_path.string() };
+
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
 
-            initialize_modules(node_file_path.string(), pl_file_path.string());
-            t.timeit("load module");
+            ///////////////////////////////////////////////////////////////////
+            //a snapshot of the same files makes the parsing unnecessary
+            if (options.use_cache && read_circuit_cache(cache_file_path.string(), sources, modules, nets)) {
+                report_time(_load_options, "load circuit cache", start);
+                return true;
+            }
             ///////////////////////////////////////////////////////////////////
 
             ///////////////////////////////////////////////////////////////////
-            t.timeit();
-            //load nets
-            boost::filesystem::path net_file_path(benchmark_path);
-            net_file_path /= _benchmark_name + string(".nets");
+            //modules and nets do not depend on each other, so load the nets
+            //on another thread while this one loads the modules
+            BookshelfNets bnets;
+            future<void> nets_loaded = async(launch::async, [this, &net_file_path, &bnets, start]() {
+                initialize_nets(net_file_path.string(), bnets);
+                report_time(_load_options, "load net", start);
+            });
 
-            initialize_nets(net_file_path.string());
-            t.timeit("load net");
+            initialize_modules(node_file_path.string(), pl_file_path.string());
+            report_time(_load_options, "load module", start);
+
+            nets_loaded.get();
+
+            //pins refer to their modules by index, so build the nets once both are there
+            nets = std::move( TplNets(bnets, modules) );
+            report_time(_load_options, "load circuit", start);
             ///////////////////////////////////////////////////////////////////
 
+            if (options.use_cache && !write_circuit_cache(cache_file_path.string(), sources, modules, nets)) {
+                cerr << "can not write circuit cache " << cache_file_path.string() << endl;
+            }
+
             return true;
+        } catch(const std::exception &e) {
+            cerr << "load circuit " << path << " failed : " << e.what() << endl;
+            return false;
         } catch(...) {
             return false;
         }
@@ -352,71 +603,41 @@ namespace tpl {
         modules.clear();
 
         //process .nodes file
-        ifstream node_stream(node_file);
-        node_stream.unsetf(ios::skipws);
-
-        ///////////////////////////////////////////////////////////////
-        //quick but memory eager version
-        string storage;
-        copy(istream_iterator<char>(node_stream),
-             istream_iterator<char>(),
-             back_inserter(storage));
-        string::const_iterator node_begin = storage.begin();
-        string::const_iterator node_end   = storage.end();
-        //slow but memory efficient version
-        //boost::spirit::istream_iterator node_begin(node_stream), node_end;
-        ///////////////////////////////////////////////////////////////
-
         BookshelfNodes bnodes;
-        parse_bookshelf_node(node_begin, node_end, bnodes);
+        parse_file(node_file, _load_options, [&](const char *&begin, const char *&end) {
+            return _load_options.parser == ParserKind::Scanner ?
+                   scan_bookshelf_node(begin, end, bnodes) : parse_bookshelf_node(begin, end, bnodes);
+        });
 
         //process .pl file
-        ifstream pl_stream(pl_file);
-        pl_stream.unsetf(ios::skipws);
-
-        ///////////////////////////////////////////////////////////////
-        //quick but memory eager version
-        storage.clear();
-        copy(istream_iterator<char>(pl_stream),
-             istream_iterator<char>(),
-             back_inserter(storage));
-        string::const_iterator pl_begin = storage.begin();
-        string::const_iterator pl_end   = storage.end();
-        //slow but memory efficient version
-        //boost::spirit::istream_iterator pl_begin(pl_stream), pl_end;
-        ///////////////////////////////////////////////////////////////
-
         BookshelfPls bpls;
-        parse_bookshelf_pl(pl_begin, pl_end, bpls);
+        parse_file(pl_file, _load_options, [&](const char *&begin, const char *&end) {
+            return _load_options.parser == ParserKind::Scanner ?
+                   scan_bookshelf_pl(begin, end, bpls) : parse_bookshelf_pl(begin, end, bpls);
+        });
 
         modules = std::move( TplModules(bnodes, bpls) );
     }
 
-    void TplDB::initialize_nets(const std::string &net_file)
+    void TplDB::initialize_nets(const std::string &net_file, BookshelfNets &bnets)
     {
-        nets.clear();
-
         //process .nets file
-        ifstream net_stream(net_file);
-        net_stream.unsetf(ios::skipws);
-
-        ///////////////////////////////////////////////////////////////
-        //quick but memory eager version
-        string storage;
-        copy(istream_iterator<char>(net_stream),
-             istream_iterator<char>(),
-             back_inserter(storage));
-        string::const_iterator net_begin = storage.begin();
-        string::const_iterator net_end   = storage.end();
-        //slow but memory efficient version
-        //boost::spirit::istream_iterator net_begin(net_stream), net_end;
-        ///////////////////////////////////////////////////////////////
-
-        BookshelfNets bnets;
-        parse_bookshelf_net(net_begin, net_end, bnets);
-
-        nets = std::move( TplNets( std::move(bnets) ) );
+        unsigned int num_threads = _load_options.num_threads;
+        if (num_threads == 0) num_threads = std::max(1u, thread::hardware_concurrency());
+
+        parse_file(net_file, _load_options, [&](const char *&begin, const char *&end) {
+            return _load_options.parser == ParserKind::Scanner ?
+                   scan_bookshelf_net(begin, end, bnets, num_threads) : parse_bookshelf_net(begin, end, bnets);
+        });
+
+        //a file truncated at a net boundary still parses, so check it against its own header
+        unsigned int num_pins = 0;
+        for (const BookshelfNet &bnet : bnets.data) num_pins += bnet.pins.size();
+        if (bnets.data.size() != bnets.num_nets || num_pins != bnets.num_pins) {
+            throw runtime_error(net_file + " declares " + to_string(bnets.num_nets) + " nets and " +
+                                to_string(bnets.num_pins) + " pins, but contains " + to_string(bnets.data.size()) +
+                                " nets and " + to_string(num_pins) + " pins");
+        }
     }
 
 }//end namespace tpl
-
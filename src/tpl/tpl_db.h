@@ -7,6 +7,7 @@
 #ifndef TPL_DB_H
 #define TPL_DB_H
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <list>
@@ -15,11 +16,15 @@
 
 #include <boost/move/utility_core.hpp>
 #include <boost/core/noncopyable.hpp>
+#include <boost/iterator/iterator_facade.hpp>
+#include <boost/range/iterator_range.hpp>
 
 #include "../bookshelf/bookshelf_node.h"
 #include "../bookshelf/bookshelf_pl.h"
 #include "../bookshelf/bookshelf_net.h"
 
+#include "utils.h"
+
 namespace tpl {
     using namespace thueda;
 
@@ -43,15 +48,33 @@ namespace tpl {
                            bool fixed, double power_density);
     };
 
+    //! Structure of arrays view of all the modules' geometry.
+    /*!
+     * Every array is 64 bytes aligned and indexed like TplModules, so kernels looping over
+     * the modules read only the fields they need and can be vectorized.
+     * Widths and heights are stored as double to keep the arithmetic in one type.
+     */
+    struct TplModuleGeometry {
+        AlignedVector<double>        x; //!< Modules' x coordinates, lower left corner.
+        AlignedVector<double>        y; //!< Modules' y coordinates, lower left corner.
+        AlignedVector<double>    width; //!< Modules' widths.
+        AlignedVector<double>   height; //!< Modules' heights.
+        AlignedVector<double> power_density; //!< Modules' power densities.
+        AlignedVector<unsigned char> fixed; //!< Modules' fixed flags.
+    };
+
     //! class storing all the modules' positions and sizes information.
+    /*!
+     * The modules are stored as an array of TplModule, and mirrored by a TplModuleGeometry.
+     * Modules are only handed out as const references, every change goes through the
+     * modifiers below, and each of them keeps both up to date.
+     */
     class TplModules {
     private:
         BOOST_MOVABLE_BUT_NOT_COPYABLE(TplModules)
 
     public:
         ///////////////////////// Member Type //////////////////////////////////////////
-        //! \typedef std::vector<TplModule>::iterator iterator;
-        typedef std::vector<TplModule>::iterator iterator;
         //! \typedef std::vector<TplModule>::const_iterator const_iterator;
         typedef std::vector<TplModule>::const_iterator const_iterator;
         ///////////////////////// Member Type //////////////////////////////////////////
@@ -59,8 +82,10 @@ namespace tpl {
         ///////////////////////// Constructors /////////////////////////////////////////
         //! Constructor using bookshelf data structures.
         explicit TplModules(const BookshelfNodes &bnodes, const BookshelfPls &bpls);
+        //! Constructor taking over ready made modules, the free ones first.
+        explicit TplModules(std::vector<TplModule> &&modules, unsigned int num_free);
         //! Default constructor.
-        TplModules() = default;
+        TplModules();
         //! Default destructor.
         ~TplModules() = default;
         //! Move constructor.
@@ -70,16 +95,6 @@ namespace tpl {
         ///////////////////////// Constructors /////////////////////////////////////////
 
         ////////////////////////// Member Access ///////////////////////////////////////
-        //! Access TplModule using index, return reference with bound checking.
-        TplModule&       at(const size_t &pos)
-        {
-            try {
-                return _modules.at(pos);
-            }
-            catch(std::out_of_range e) {
-                throw e;
-            }
-        }
         //! Access TplModule using index, return const reference with bound checking.
         const TplModule& at(const size_t &pos) const
         {
@@ -90,21 +105,21 @@ namespace tpl {
                 throw e;
             }
         }
-        //! Access TplModule using index, return reference without bound checking.
-        TplModule&       operator[](const size_t &pos)
-        {
-            return _modules[pos];
-        }
         //! Access TplModule using index, return const reference without bound checking.
         const TplModule& operator[](const size_t &pos) const
         {
             return _modules[pos];
         }
+        //! The modules' geometry as a structure of arrays, always up to date.
+        const TplModuleGeometry &geometry() const
+        {
+            return _geometry;
+        }
         ////////////////////////// Member Access ///////////////////////////////////////
 
         ///////////////////////// Iterators   //////////////////////////////////////////
         //! Iterator indicating the first TplModule.
-        iterator begin()
+        const_iterator begin() const
         {
             return _modules.begin();
         }
@@ -114,7 +129,7 @@ namespace tpl {
             return _modules.begin();
         }
         //! Iterator indicating the past-the-last TplModule.
-        iterator end()
+        const_iterator end() const
         {
             return _modules.end();
         }
@@ -160,6 +175,31 @@ namespace tpl {
          */
         double set_free_module_coordinates(const std::vector<double> &xs, const std::vector<double> &ys);
 
+        //! Move module pos to (x, y), its lower left corner.
+        void set_position(size_t pos, Coordinate x, Coordinate y)
+        {
+            _modules.at(pos).x = x;
+            _modules[pos].y    = y;
+            _geometry.x[pos]   = x;
+            _geometry.y[pos]   = y;
+        }
+
+        //! Resize module pos to width x height, keeping its lower left corner.
+        void set_size(size_t pos, Length width, Length height)
+        {
+            _modules.at(pos).width = width;
+            _modules[pos].height   = height;
+            _geometry.width[pos]   = width;
+            _geometry.height[pos]  = height;
+        }
+
+        //! Move the free modules by the given displacements.
+        /*!
+         * \param delta_x The free modules' x displacements, num_free() values.
+         * \param delta_y The free modules' y displacements, num_free() values.
+         */
+        void move_free_modules(const double *delta_x, const double *delta_y);
+
         //! add shredded cells from macros to modules
         /*!
          * \param map map of original macro id and new celsl
@@ -172,8 +212,6 @@ namespace tpl {
         ///////////////////////// Modifiers   //////////////////////////////////////////
 
         ///////////////////////// Id based Member Access ///////////////////////////////
-        //! Get a TplModule reference with a Id id.
-        TplModule&       module(const std::string &id);
         //! Get a const TplModule reference with a Id id.
         const TplModule& module(const std::string &id) const;
         //! Get a module's index, with a Id id.
@@ -210,28 +248,119 @@ namespace tpl {
         Length _chip_height; //!< Chip height.
 
         std::vector<TplModule> _modules;                //!< vector of TplModule.
-        std::map<std::string, size_t> _id_index_map;    //!< A ID index map for all the modules
+        std::unordered_map<std::string, size_t> _id_index_map; //!< A ID index map for all the modules
 
         std::vector<TplModule> _macros;
-        std::unordered_map<Id, std::vector<TplModule>> _shredded_cells;
+        std::unordered_map<Id, std::pair<size_t, size_t>> _shredded_cells; //!< [first, last) index range of each macro's cells
+
+        //! Rebuild _geometry from _modules, after a modifier changed many of them.
+        void sync_geometry();
+
+        TplModuleGeometry _geometry; //!< Structure of arrays mirror of _modules.
+    };
+
+    //! struct storing one pin's IO, offsets and the module it is attached to.
+    /*!
+     * The pin's module is known by its index in TplModules only, its id is modules[module_index].id.
+     */
+    struct TplPin {
+        unsigned int module_index; //!< Index of the pin's module in TplModules
+        IOType             io; //!< A pin's IO type
+        Distance           dx; //!< A pin's x offset from the center of its module
+        Distance           dy; //!< A pin's y offset from the center of its module
+    };
+
+    //! struct storing one net's degree and its associated pins, used to build a TplNets.
+    struct TplNet {
+        Id                      id; //!< A net's id
+        unsigned int        degree; //!< A net's degree, i.e. number of pins attached on this net
+        std::vector<TplPin>   pins; //!< A net's attached pins
     };
 
-    //! \typedef BookshelfPin TplPin;
-    typedef BookshelfPin TplPin;
-    //! \typedef BookshelfNet TplNet;
-    typedef BookshelfNet TplNet;
+    //! A net stored in TplNets, whose pins are a slice of TplNets' contiguous pin array.
+    template<typename Pin>
+    struct TplNetRef {
+        const Id                       &id; //!< A net's id
+        unsigned int                degree; //!< A net's degree, i.e. number of pins attached on this net
+        boost::iterator_range<Pin*>   pins; //!< A net's attached pins
+    };
+
+    //! Random access iterator over the nets of a TplNets, dereferencing to a TplNetRef.
+    /*!
+     * As the TplNetRef is made on the fly, std::advance only sees an input iterator,
+     * use operator+= to skip nets in constant time.
+     */
+    template<typename Nets, typename Pin>
+    class TplNetIterator : public boost::iterator_facade<TplNetIterator<Nets, Pin>, TplNetRef<Pin>,
+                                                         boost::random_access_traversal_tag, TplNetRef<Pin> > {
+    public:
+        //! Default constructor.
+        TplNetIterator() : _nets(nullptr), _index(0) {}
+        //! Constructor pointing at the index-th net of nets.
+        TplNetIterator(Nets *nets, size_t index) : _nets(nets), _index(index) {}
+        //! Conversion from the mutable iterator to the const one.
+        template<typename OtherNets, typename OtherPin>
+        TplNetIterator(const TplNetIterator<OtherNets, OtherPin> &other) : _nets(other.nets()), _index(other.index()) {}
+
+        //! Index of the pointed net.
+        size_t index() const
+        {
+            return _index;
+        }
+        //! The TplNets iterated over.
+        Nets *nets() const
+        {
+            return _nets;
+        }
+
+    private:
+        friend class boost::iterator_core_access;
+
+        TplNetRef<Pin> dereference() const
+        {
+            return _nets->net(_index);
+        }
+        bool equal(const TplNetIterator &other) const
+        {
+            return _index == other._index;
+        }
+        void increment()
+        {
+            ++_index;
+        }
+        void decrement()
+        {
+            --_index;
+        }
+        void advance(std::ptrdiff_t n)
+        {
+            _index += n;
+        }
+        std::ptrdiff_t distance_to(const TplNetIterator &other) const
+        {
+            return static_cast<std::ptrdiff_t>(other._index) - static_cast<std::ptrdiff_t>(_index);
+        }
+
+        Nets  *_nets;  //!< The TplNets iterated over.
+        size_t _index; //!< Index of the pointed net.
+    };
 
     //! class storing all the nets and pins.
+    /*!
+     * The netlist is kept in compressed sparse row form: the pins of all the nets lie in one
+     * contiguous array, and the pins of net i are [pin_offsets[i], pin_offsets[i+1]) of it.
+     * Traversing the netlist is a linear scan of a few arrays.
+     */
     class TplNets {
     private:
         BOOST_MOVABLE_BUT_NOT_COPYABLE(TplNets)
 
     public:
         ///////////////////////// Member Type //////////////////////////////////////////
-        //! \typedef std::list<TplNet>::iterator net_iterator;
-        typedef std::list<TplNet>::iterator net_iterator;
-        //! \typedef std::list<TplNet>::const_iterator const_net_iterator;
-        typedef std::list<TplNet>::const_iterator const_net_iterator;
+        //! \typedef TplNetIterator<TplNets, TplPin> net_iterator;
+        typedef TplNetIterator<TplNets, TplPin> net_iterator;
+        //! \typedef TplNetIterator<const TplNets, const TplPin> const_net_iterator;
+        typedef TplNetIterator<const TplNets, const TplPin> const_net_iterator;
         //! \typedef std::vector<TplPin>::iterator pin_iterator;
         typedef std::vector<TplPin>::iterator pin_iterator;
         //! \typedef std::vector<TplPin>::iterator iterator;
@@ -239,10 +368,19 @@ namespace tpl {
         ///////////////////////// Member Type //////////////////////////////////////////
 
         ///////////////////////// Constructors /////////////////////////////////////////
-        //! Constructor using bookshelf data structures, copy version.
-        explicit TplNets(const BookshelfNets &bnets);
+        //! Constructor using bookshelf data structures, pins are resolved against modules.
+        explicit TplNets(const BookshelfNets &bnets, const TplModules &modules);
+        //! Constructor taking over a ready made netlist in compressed sparse row form.
+        /*!
+         * \param ids The nets' ids.
+         * \param degrees The nets' degrees.
+         * \param pin_offsets ids.size()+1 offsets into pins, the first being 0 and the last pins.size().
+         * \param pins The pins of all the nets, net by net.
+         */
+        explicit TplNets(std::vector<Id> &&ids, std::vector<unsigned int> &&degrees,
+                         std::vector<unsigned int> &&pin_offsets, std::vector<TplPin> &&pins);
         //! Default constructor.
-        TplNets()  = default;
+        TplNets();
         //! Default destructor.
         ~TplNets() = default;
         //! Move constructor.
@@ -252,25 +390,56 @@ namespace tpl {
         ///////////////////////// Constructors /////////////////////////////////////////
 
         ////////////////////////// Member Access ///////////////////////////////////////
+        //! Access the pos-th TplNet.
+        TplNetRef<TplPin> net(const size_t &pos)
+        {
+            TplPin *pins = _netlist.pins.data();
+            return TplNetRef<TplPin>{ _netlist.ids[pos], _netlist.degrees[pos],
+                                      boost::make_iterator_range(pins + _netlist.pin_offsets[pos],
+                                                                 pins + _netlist.pin_offsets[pos+1]) };
+        }
+        //! Access the pos-th TplNet, const version.
+        TplNetRef<const TplPin> net(const size_t &pos) const
+        {
+            const TplPin *pins = _netlist.pins.data();
+            return TplNetRef<const TplPin>{ _netlist.ids[pos], _netlist.degrees[pos],
+                                            boost::make_iterator_range(pins + _netlist.pin_offsets[pos],
+                                                                       pins + _netlist.pin_offsets[pos+1]) };
+        }
+        //! Access the pos-th pin of the whole netlist.
+        TplPin &pin(const size_t &pos)
+        {
+            return _netlist.pins[pos];
+        }
+        //! Access the pos-th pin of the whole netlist, const version.
+        const TplPin &pin(const size_t &pos) const
+        {
+            return _netlist.pins[pos];
+        }
+        //! Index of a pin in the whole netlist.
+        size_t pin_index(const const_pin_iterator &pit) const
+        {
+            return pit - _netlist.pins.begin();
+        }
         //! Access first TplNet.
-        TplNet &front()
+        TplNetRef<TplPin> front()
         {
-            return _netlist.front();
+            return net(0);
         }
         //! Access first TplNet, const version.
-        const TplNet &front() const
+        TplNetRef<const TplPin> front() const
         {
-            return _netlist.front();
+            return net(0);
         }
         //! Access last TplNet.
-        TplNet &back()
+        TplNetRef<TplPin> back()
         {
-            return _netlist.back();
+            return net(num_nets()-1);
         }
         //! Access last TplNet, const version.
-        const TplNet &back() const
+        TplNetRef<const TplPin> back() const
         {
-            return _netlist.back();
+            return net(num_nets()-1);
         }
         ////////////////////////// Member Access ///////////////////////////////////////
 
@@ -278,42 +447,42 @@ namespace tpl {
         //! Iterator indicating the first TplNet.
         net_iterator net_begin()
         {
-            return _netlist.begin();
+            return net_iterator(this, 0);
         }
         //! Iterator indicating the first TplNet, const version.
         const_net_iterator cnet_begin() const
         {
-            return _netlist.begin();
+            return const_net_iterator(this, 0);
         }
         //! Iterator indicating the past-the-last TplNet.
         net_iterator net_end()
         {
-            return _netlist.end();
+            return net_iterator(this, num_nets());
         }
         //! Iterator indicating the past-the-last TplNet, const version.
         const_net_iterator cnet_end() const
         {
-            return _netlist.end();
+            return const_net_iterator(this, num_nets());
         }
         //! Iterator indicating the first TplPin.
         pin_iterator pin_begin(const net_iterator &nit)
         {
-            return nit->pins.begin();
+            return _netlist.pins.begin() + _netlist.pin_offsets[nit.index()];
         }
         //! Iterator indicating the first TplPin, const version.
-        const_pin_iterator cpin_begin(const net_iterator &nit) const
+        const_pin_iterator cpin_begin(const const_net_iterator &nit) const
         {
-            return nit->pins.begin();
+            return _netlist.pins.begin() + _netlist.pin_offsets[nit.index()];
         }
         //! Iterator indicating the past-the-last TplPin.
         pin_iterator pin_end(const net_iterator &nit)
         {
-            return nit->pins.end();
+            return _netlist.pins.begin() + _netlist.pin_offsets[nit.index()+1];
         }
         //! Iterator indicating the past-the-last TplPin, const version.
-        const_pin_iterator cpin_end(const net_iterator &nit) const
+        const_pin_iterator cpin_end(const const_net_iterator &nit) const
         {
-            return nit->pins.end();
+            return _netlist.pins.begin() + _netlist.pin_offsets[nit.index()+1];
         }
         ///////////////////////// Iterators   //////////////////////////////////////////
 
@@ -321,29 +490,44 @@ namespace tpl {
         //! Number of nets.
         unsigned int num_nets() const
         {
-            return _num_nets;
+            return _netlist.ids.size();
         }
         //! Number of pins.
         unsigned int num_pins() const
         {
-            return _num_pins;
+            return _netlist.pins.size();
         }
 
 		//! Number of nets before shred
 		unsigned int num_origin_nets() const {
-			return _num_nets - _num_shred_nets;
+			return num_nets() - _num_shred_nets;
 		}
+
+        //! Version of the nets' structure, changed by every modifier and never shared by two netlists.
+        /*!
+         * What depends on the nets' degrees only, like a partition of the nets into chunks, can be
+         * kept as long as the revision stays the same.
+         */
+        std::uint64_t revision() const
+        {
+            return _revision;
+        }
         ///////////////////////// Capacity    //////////////////////////////////////////
 
         ///////////////////////// Modifiers   //////////////////////////////////////////
         //! Clear the netlist.
         void clear();
 
+        //! Replace the netlist, the backup made by backup_net is kept.
+        /*!
+         * \param netlist The new nets.
+         */
+        void assign(const std::vector<TplNet> &netlist);
 		//! add nets of shredded cells
 		/*!
 		 * \param newNets nets of shredded  cells
 		 */
-		void add_net(std::list<TplNet> newNets);
+		void add_net(const std::vector<TplNet> &newNets);
         //! back up original nets before shred macros
         void backup_net();
         //! delete nets of shredder cells
@@ -353,12 +537,56 @@ namespace tpl {
         void delete_net();
         ///////////////////////// Modifiers   //////////////////////////////////////////
     private:
-        unsigned int _num_nets;           //!< Number of nets.
-        unsigned int _num_pins;           //!< Number of pins.
+        //! The netlist arrays in compressed sparse row form.
+        struct Netlist {
+            std::vector<Id>           ids;         //!< Every net's id.
+            std::vector<unsigned int> degrees;     //!< Every net's degree.
+            std::vector<unsigned int> pin_offsets; //!< Net i's pins are pins[pin_offsets[i], pin_offsets[i+1]).
+            std::vector<TplPin>       pins;        //!< All the pins, net by net.
+        };
+
+        //! Append nets to the end of the netlist.
+        void append(const std::vector<TplNet> &nets);
+
+        //! Give the netlist a new revision.
+        void touch();
+
 		unsigned int _num_shred_nets;     //!< Number of shredded cells nets
+        std::uint64_t _revision;          //!< See revision().
+
+        Netlist _netlist;        //!< The netlist.
+        Netlist _netlist_backup; //!< original netlist before shred macros
+    };
+
+    //! How a benchmark file's bytes are brought into memory before parsing.
+    enum class LoadMode {
+        Copy, //!< Copy the file through an istream into a std::string, then parse the copy.
+        Mmap  //!< Memory map the file read-only and parse the mapped bytes in place.
+    };
 
-        std::list<TplNet> _netlist; //!< A sequential container representing the netlist.
-        std::list<TplNet> _netlist_backup; //!< original netlist before shred macros
+    //! Which implementation turns a benchmark file's bytes into bookshelf data structures.
+    enum class ParserKind {
+        Spirit, //!< The Boost.Spirit grammars of bookshelf_*_parser.hpp.
+        Scanner //!< The hand-written scanners of bookshelf_scanner.h.
+    };
+
+    //! Options controlling how TplDB::load_circuit reads a benchmark.
+    struct TplLoadOptions {
+        LoadMode   mode   = LoadMode::Mmap;      //!< File access strategy.
+        ParserKind parser = ParserKind::Scanner; //!< Parsing implementation.
+        bool       report = true;                //!< Print per file size, time and throughput.
+        //! Reuse or create a binary snapshot of the loaded circuit next to the benchmark.
+        /*!
+         * The snapshot is only used while the .nodes, .pl and .nets files keep the size and
+         * modification time they had when it was written, and the content for a file modified
+         * right before, see tpl_db_cache.h.
+         */
+        bool       use_cache = true;
+        //! Number of threads scanning the .nets file, 0 for one per hardware thread.
+        /*!
+         * Only ParserKind::Scanner parses in parallel, the spirit grammars stay sequential.
+         */
+        unsigned int num_threads = 0;
     };
 
     //! The main class for data savings and manipulations.
@@ -370,9 +598,10 @@ namespace tpl {
         //! Load benchmark circuit into in-memory data structures.
         /*!
          * \param path The benchmark file's directory path.
+         * \param options File access and reporting options.
          * \return A boolean variable indicating wether the operation is success.
          */
-        bool load_circuit(const std::string &path);
+        bool load_circuit(const std::string &path, const TplLoadOptions &options = TplLoadOptions());
 
         //! Take a snapshot of the current placement.
         void generate_placement_snapshot() const;
@@ -383,10 +612,11 @@ namespace tpl {
     private:
         //! Private helper routine initialize the modules member variable.
         void initialize_modules(const std::string &node_file, const std::string &pl_file);
-        //! Private helper routine initialize the nets member variable.
-        void initialize_nets   (const std::string &net_file);
+        //! Private helper routine parsing the .nets file, nets are built from it once the modules are known.
+        void initialize_nets   (const std::string &net_file, BookshelfNets &bnets);
 
-        std::string _benchmark_name; //!< The current loading circuit's name.
+        std::string    _benchmark_name; //!< The current loading circuit's name.
+        TplLoadOptions _load_options;   //!< Options of the current loading circuit.
     };
 
 }//end namespace tpl
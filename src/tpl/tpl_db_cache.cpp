@@ -0,0 +1,336 @@
+/*!
+ * \file tpl_db_cache.cpp
+ * \brief Binary circuit snapshot implementation file.
+ */
+
+#include "tpl_db_cache.h"
+
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+namespace tpl {
+    using namespace std;
+
+    namespace {
+
+        const char     CACHE_MAGIC[8] = {'T', 'P', 'L', 'C', 'A', 'C', 'H', 'E'};
+        const uint32_t CACHE_VERSION  = 3;
+        const size_t   MAX_SOURCES    = 4;
+        const int64_t  MTIME_RESOLUTION = 2; //!< Seconds a file system may round a modification time by.
+
+        //! The fixed size part at the beginning of a snapshot file.
+        struct CacheHeader {
+            char     magic[8];
+            uint32_t version;
+            uint32_t num_sources;
+            uint64_t source_size [MAX_SOURCES]; //!< Size of every source file in bytes.
+            int64_t  source_mtime[MAX_SOURCES]; //!< Last write time of every source file.
+            uint64_t source_hash [MAX_SOURCES]; //!< Hash of every source file's content.
+            int64_t  stamp_time;                //!< When the source files were stamped.
+            uint32_t num_modules;
+            uint32_t num_free;
+            uint32_t num_nets;
+            uint32_t num_pins;
+            uint64_t string_bytes;              //!< Size of the id string table.
+        };
+
+        //! Bytes taken by n elements of T, rounded up so that every array stays 8 bytes aligned.
+        template<typename T>
+        size_t section_bytes(size_t n)
+        {
+            return (n * sizeof(T) + 7) & ~size_t(7);
+        }
+
+        //! 64 bit FNV-1a style hash of a file's content, taken 8 bytes at a time.
+        uint64_t hash_file(const string &file)
+        {
+            namespace bip = boost::interprocess;
+
+            uint64_t hash = 14695981039346656037ull;
+            const size_t size = boost::filesystem::file_size(file);
+            if (size == 0) return hash;
+
+            bip::file_mapping  mapping(file.c_str(), bip::read_only);
+            bip::mapped_region region(mapping, bip::read_only);
+            const char *data = static_cast<const char*>(region.get_address());
+
+            size_t i = 0;
+            for (; i+8<=size; i+=8) {
+                uint64_t word;
+                memcpy(&word, data + i, sizeof(word));
+                hash = (hash ^ word) * 1099511628211ull;
+            }
+            for (; i<size; ++i) {
+                hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+            }
+            return hash ^ size;
+        }
+
+        //! Fill in the magic, version, the stamp time and the source files' size and modification time of a header.
+        void stamp_header(const vector<string> &sources, CacheHeader &header)
+        {
+            if (sources.size() > MAX_SOURCES) throw runtime_error("too many cache sources");
+
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+            header.version     = CACHE_VERSION;
+            header.num_sources = sources.size();
+            header.stamp_time  = time(nullptr);
+            for (size_t i=0; i<sources.size(); ++i) {
+                header.source_size [i] = boost::filesystem::file_size(sources[i]);
+                header.source_mtime[i] = boost::filesystem::last_write_time(sources[i]);
+            }
+        }
+
+        //! Fill in the content hash of the source files of a header.
+        void hash_sources(const vector<string> &sources, CacheHeader &header)
+        {
+            for (size_t i=0; i<sources.size(); ++i) {
+                header.source_hash[i] = hash_file(sources[i]);
+            }
+        }
+
+        //! Appends 8 bytes aligned arrays to a snapshot file.
+        class SectionWriter {
+        public:
+            explicit SectionWriter(ofstream &out) : _out(out) {}
+
+            template<typename T>
+            void write(const T *data, size_t n)
+            {
+                static const char zeros[8] = {0};
+                _out.write(reinterpret_cast<const char*>(data), n * sizeof(T));
+                _out.write(zeros, section_bytes<T>(n) - n * sizeof(T));
+            }
+
+            template<typename T>
+            void write(const vector<T> &v)
+            {
+                write(v.data(), v.size());
+            }
+
+        private:
+            ofstream &_out;
+        };
+
+        //! Hands out the 8 bytes aligned arrays of a mapped snapshot file, with bound checking.
+        class SectionReader {
+        public:
+            SectionReader(const char *begin, const char *end) : _p(begin), _end(end) {}
+
+            template<typename T>
+            const T *take(size_t n)
+            {
+                size_t bytes = section_bytes<T>(n);
+                if (static_cast<size_t>(_end - _p) < bytes) throw runtime_error("truncated cache");
+                const T *data = reinterpret_cast<const T*>(_p);
+                _p += bytes;
+                return data;
+            }
+
+        private:
+            const char *_p;
+            const char *_end;
+        };
+
+    }//end anonymous namespace
+
+    bool write_circuit_cache(const std::string &cache_file, const std::vector<std::string> &sources,
+                             const TplModules &modules, const TplNets &nets)
+    {
+        try {
+            CacheHeader header;
+            stamp_header(sources, header);
+            hash_sources(sources, header);
+
+            //modules, column by column
+            const size_t num_modules = modules.size();
+            vector<double>   module_x, module_y, module_power;
+            vector<int32_t>  module_width, module_height;
+            vector<uint8_t>  module_fixed;
+            vector<uint32_t> module_id(1, 0);
+            string strings;
+
+            for (TplModules::const_iterator it=modules.cbegin(); it!=modules.cend(); ++it) {
+                module_x.push_back(it->x);
+                module_y.push_back(it->y);
+                module_power.push_back(it->power_density);
+                module_width.push_back(it->width);
+                module_height.push_back(it->height);
+                module_fixed.push_back(it->fixed);
+                strings += it->id;
+                module_id.push_back(strings.size());
+            }
+
+            //nets in compressed row form, pins refer to modules by index
+            vector<uint32_t> net_id(1, strings.size()), net_degree, pin_offset(1, 0);
+            vector<uint32_t> pin_module;
+            vector<uint8_t>  pin_io;
+            vector<double>   pin_dx, pin_dy;
+
+            for (TplNets::const_net_iterator nit=nets.cnet_begin(); nit!=nets.cnet_end(); ++nit) {
+                strings += nit->id;
+                net_id.push_back(strings.size());
+                net_degree.push_back(nit->degree);
+
+                for (TplNets::const_pin_iterator pit=nets.cpin_begin(nit); pit!=nets.cpin_end(nit); ++pit) {
+                    pin_module.push_back(pit->module_index);
+                    pin_io.push_back(static_cast<uint8_t>(pit->io));
+                    pin_dx.push_back(pit->dx);
+                    pin_dy.push_back(pit->dy);
+                }
+                pin_offset.push_back(pin_module.size());
+            }
+
+            header.num_modules  = num_modules;
+            header.num_free     = modules.num_free();
+            header.num_nets     = net_degree.size();
+            header.num_pins     = pin_module.size();
+            header.string_bytes = strings.size();
+
+            //write to a temporary file of this run first, so that neither a crash nor another
+            //run writing the same snapshot ever leaves a damaged one in place
+            boost::filesystem::path temp_file = boost::filesystem::unique_path(cache_file + ".%%%%-%%%%-%%%%-%%%%.tmp");
+            {
+                ofstream out(temp_file.string(), ios_base::out | ios_base::binary | ios_base::trunc);
+                if (!out) return false;
+
+                SectionWriter writer(out);
+                writer.write(&header, 1);
+                writer.write(module_x);
+                writer.write(module_y);
+                writer.write(module_power);
+                writer.write(module_width);
+                writer.write(module_height);
+                writer.write(module_fixed);
+                writer.write(module_id);
+                writer.write(net_id);
+                writer.write(net_degree);
+                writer.write(pin_offset);
+                writer.write(pin_module);
+                writer.write(pin_io);
+                writer.write(pin_dx);
+                writer.write(pin_dy);
+                writer.write(strings.data(), strings.size());
+
+                if (!out) {
+                    out.close();
+                    boost::filesystem::remove(temp_file);
+                    return false;
+                }
+            }
+            boost::filesystem::rename(temp_file, cache_file);
+
+            return true;
+        } catch(...) {
+            return false;
+        }
+    }
+
+    bool read_circuit_cache(const std::string &cache_file, const std::vector<std::string> &sources,
+                            TplModules &modules, TplNets &nets)
+    {
+        namespace bip = boost::interprocess;
+
+        try {
+            if (!boost::filesystem::exists(cache_file)) return false;
+
+            bip::file_mapping  mapping(cache_file.c_str(), bip::read_only);
+            bip::mapped_region region(mapping, bip::read_only);
+            const char *begin = static_cast<const char*>(region.get_address());
+            SectionReader reader(begin, begin + region.get_size());
+
+            //check the header against the source files
+            CacheHeader expected;
+            stamp_header(sources, expected);
+            const CacheHeader &header = *reader.take<CacheHeader>(1);
+            if (memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+                header.version     != expected.version ||
+                header.num_sources != expected.num_sources ||
+                memcmp(header.source_size,  expected.source_size,  sizeof(header.source_size))  != 0 ||
+                memcmp(header.source_mtime, expected.source_mtime, sizeof(header.source_mtime)) != 0 ||
+                header.num_free > header.num_modules) {
+                return false;
+            }
+
+            //an edit right after the snapshot was taken may keep the modification time, which is
+            //rounded, the content hash tells for the files modified that close to the stamp
+            for (size_t i=0; i<sources.size(); ++i) {
+                if (header.source_mtime[i] + MTIME_RESOLUTION < header.stamp_time) continue;
+                if (hash_file(sources[i]) != header.source_hash[i]) return false;
+            }
+
+            const size_t num_modules = header.num_modules;
+            const size_t num_nets    = header.num_nets;
+            const size_t num_pins    = header.num_pins;
+
+            const double   *module_x      = reader.take<double>  (num_modules);
+            const double   *module_y      = reader.take<double>  (num_modules);
+            const double   *module_power  = reader.take<double>  (num_modules);
+            const int32_t  *module_width  = reader.take<int32_t> (num_modules);
+            const int32_t  *module_height = reader.take<int32_t> (num_modules);
+            const uint8_t  *module_fixed  = reader.take<uint8_t> (num_modules);
+            const uint32_t *module_id     = reader.take<uint32_t>(num_modules + 1);
+            const uint32_t *net_id        = reader.take<uint32_t>(num_nets + 1);
+            const uint32_t *net_degree    = reader.take<uint32_t>(num_nets);
+            const uint32_t *pin_offset    = reader.take<uint32_t>(num_nets + 1);
+            const uint32_t *pin_module    = reader.take<uint32_t>(num_pins);
+            const uint8_t  *pin_io        = reader.take<uint8_t> (num_pins);
+            const double   *pin_dx        = reader.take<double>  (num_pins);
+            const double   *pin_dy        = reader.take<double>  (num_pins);
+            const char     *strings       = reader.take<char>    (header.string_bytes);
+
+            //every offset must stay in its table, and every pin must name a module
+            if (module_id[0] != 0 || module_id[num_modules] != net_id[0] || net_id[num_nets] != header.string_bytes ||
+                pin_offset[0] != 0 || pin_offset[num_nets] != num_pins) {
+                return false;
+            }
+            for (size_t i=0; i<num_modules; ++i) {
+                if (module_id[i] > module_id[i+1]) return false;
+            }
+            for (size_t i=0; i<num_nets; ++i) {
+                if (net_id[i] > net_id[i+1] || pin_offset[i] > pin_offset[i+1]) return false;
+            }
+            for (size_t i=0; i<num_pins; ++i) {
+                if (pin_module[i] >= num_modules || pin_io[i] > static_cast<uint8_t>(IOType::Bidirection)) return false;
+            }
+
+            vector<TplModule> module_data;
+            module_data.reserve(num_modules);
+            for (size_t i=0; i<num_modules; ++i) {
+                module_data.emplace_back(Id(strings + module_id[i], strings + module_id[i+1]),
+                                         module_x[i], module_y[i], module_width[i], module_height[i],
+                                         module_fixed[i] != 0, module_power[i]);
+            }
+
+            vector<Id>           ids(num_nets);
+            vector<unsigned int> degrees(net_degree, net_degree + num_nets);
+            vector<unsigned int> offsets(pin_offset, pin_offset + num_nets + 1);
+            vector<TplPin>       pins(num_pins);
+            for (size_t i=0; i<num_nets; ++i) {
+                ids[i].assign(strings + net_id[i], strings + net_id[i+1]);
+            }
+            for (size_t i=0; i<num_pins; ++i) {
+                TplPin &pin = pins[i];
+                pin.module_index = pin_module[i];
+                pin.io = static_cast<IOType>(pin_io[i]);
+                pin.dx = pin_dx[i];
+                pin.dy = pin_dy[i];
+            }
+
+            modules = std::move( TplModules(std::move(module_data), header.num_free) );
+            nets    = std::move( TplNets(std::move(ids), std::move(degrees), std::move(offsets), std::move(pins)) );
+
+            return true;
+        } catch(...) {
+            return false;
+        }
+    }
+
+}//end namespace tpl
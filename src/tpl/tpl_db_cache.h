@@ -0,0 +1,57 @@
+/*!
+ * \file tpl_db_cache.h
+ * \brief Binary snapshot of a loaded circuit, so repeated runs skip the bookshelf parsing.
+ */
+
+#ifndef TPL_DB_CACHE_H
+#define TPL_DB_CACHE_H
+
+#include <string>
+#include <vector>
+
+#include "tpl_db.h"
+
+namespace tpl {
+
+    /*!
+     * The snapshot is one file of flat arrays: a header, the modules' geometry column by column,
+     * the nets and their pins in compressed row form, with pins referring to modules by index,
+     * and a string table holding every module and net id. It is read back through a read-only
+     * memory map.
+     *
+     * The header is stamped with the size, the modification time and a hash of the content of
+     * every source file. A snapshot whose stamps do not match the source files any more is
+     * ignored, and so is one written by another snapshot format version. Size and time are
+     * trusted for a file modified well before the snapshot was taken. The content of a file
+     * modified within two seconds of it is hashed again, as an edit right after the snapshot
+     * may have kept the rounded modification time.
+     *
+     * The snapshot is written to a temporary file with a unique name and renamed over the old
+     * one, so concurrent runs on the same circuit never read a half written snapshot.
+     */
+
+    //! Write modules and nets to cache_file, stamped with the current state of the source files.
+    /*!
+     * \param cache_file The snapshot file to be written.
+     * \param sources The bookshelf files the modules and nets were loaded from.
+     * \param modules The modules to be saved.
+     * \param nets The nets to be saved, every pin must name one of the modules.
+     * \return A boolean variable indicating wether the operation is success.
+     */
+    bool write_circuit_cache(const std::string &cache_file, const std::vector<std::string> &sources,
+                             const TplModules &modules, const TplNets &nets);
+
+    //! Read modules and nets back from cache_file, if it matches the current state of the source files.
+    /*!
+     * \param cache_file The snapshot file to be read.
+     * \param sources The bookshelf files the snapshot must have been taken from.
+     * \param modules Receives the saved modules.
+     * \param nets Receives the saved nets.
+     * \return false if the snapshot is missing, stale or damaged, and modules and nets are untouched then.
+     */
+    bool read_circuit_cache(const std::string &cache_file, const std::vector<std::string> &sources,
+                            TplModules &modules, TplNets &nets);
+
+}//end namespace tpl
+
+#endif//TPL_DB_CACHE_H
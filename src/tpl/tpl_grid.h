@@ -0,0 +1,106 @@
+/*!
+ * \file tpl_grid.h
+ * \brief Contiguous 2 dimensional grid of doubles with an optional halo.
+ */
+
+#ifndef TPL_GRID_H
+#define TPL_GRID_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+
+#include "utils.h"
+
+namespace tpl {
+
+    //! Contiguous 2 dimensional grid of doubles, indexed (i,j) with i in x and j in y.
+    /*!
+     * The points i in [0, width) and j in [0, height) are surrounded by a halo of halo_x
+     * points in x and halo_y points in y, so (i,j) is valid for i in [-halo_x, width+halo_x)
+     * and j in [-halo_y, height+halo_y).
+     *
+     * All the points live in one 64 bytes aligned buffer, row major in x. Every row's stride
+     * is a multiple of 8 doubles and the point (i,0) of every row is 64 bytes aligned, so a
+     * loop along j walks aligned, contiguous memory.
+     */
+    class Grid2D {
+    public:
+        //! Default constructor, an empty grid.
+        Grid2D() = default;
+
+        //! Constructor, every point set to zero.
+        Grid2D(int width, int height, int halo_x = 0, int halo_y = 0)
+        {
+            resize(width, height, halo_x, halo_y);
+        }
+
+        //! Change the size of the grid, every point set to zero.
+        void resize(int width, int height, int halo_x = 0, int halo_y = 0)
+        {
+            assert(width >= 0 && height >= 0 && halo_x >= 0 && halo_y >= 0);
+
+            _width  = width;
+            _height = height;
+            _halo_x = halo_x;
+            _halo_y = halo_y;
+            _lead   = round_up(halo_y);
+            _stride = round_up(_lead + height + halo_y);
+            _data.assign(static_cast<std::size_t>(width + 2*halo_x) * _stride, 0);
+        }
+
+        //! Set every point, the halo included, to value.
+        void fill(double value)
+        {
+            std::fill(_data.begin(), _data.end(), value);
+        }
+
+        //! Point (i,j).
+        double &operator()(int i, int j)
+        {
+            return row(i)[j];
+        }
+        //! Point (i,j).
+        const double &operator()(int i, int j) const
+        {
+            return row(i)[j];
+        }
+
+        //! Pointer to point (i,0), row(i)[j] is point (i,j).
+        double *row(int i)
+        {
+            assert(-_halo_x <= i && i < _width + _halo_x);
+            return _data.data() + static_cast<std::size_t>(i + _halo_x) * _stride + _lead;
+        }
+        //! Pointer to point (i,0), row(i)[j] is point (i,j).
+        const double *row(int i) const
+        {
+            assert(-_halo_x <= i && i < _width + _halo_x);
+            return _data.data() + static_cast<std::size_t>(i + _halo_x) * _stride + _lead;
+        }
+
+        int width()  const { return _width; }  //!< Number of points in x, the halo excluded.
+        int height() const { return _height; } //!< Number of points in y, the halo excluded.
+        int halo_x() const { return _halo_x; } //!< Halo size in x.
+        int halo_y() const { return _halo_y; } //!< Halo size in y.
+        int stride() const { return _stride; } //!< Distance between two rows, in doubles.
+
+    private:
+        //! n rounded up to a multiple of 8 doubles, 64 bytes.
+        static int round_up(int n)
+        {
+            return (n + 7) / 8 * 8;
+        }
+
+        int _width  = 0;
+        int _height = 0;
+        int _halo_x = 0;
+        int _halo_y = 0;
+        int _lead   = 0; //!< Offset of point (i,0) from the start of row i.
+        int _stride = 0;
+        AlignedVector<double> _data;
+    };
+
+}//end namespace tpl
+
+#endif //TPL_GRID_H
@@ -0,0 +1,354 @@
+/*!
+ * \file tpl_linear_solver.cpp
+ * \brief Preconditioned conjugate gradient solver implementation file.
+ */
+
+#include "tpl_linear_solver.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <thread>
+
+#include <boost/property_tree/json_parser.hpp>
+
+namespace tpl {
+    using namespace std;
+
+    bool TplSolverSettings::load()
+    {
+        try {
+            namespace pt = boost::property_tree;
+            const char *config = getenv("TPLCONFIG");
+            if (config == nullptr) return false;
+
+            pt::ptree tree;
+            pt::read_json(config, tree);
+
+            string name = tree.get<string>("solver_preconditioner", "diagonal");
+            if      (name == "diagonal")            preconditioner = Preconditioner::Diagonal;
+            else if (name == "incomplete_cholesky") preconditioner = Preconditioner::IncompleteCholesky;
+            else return false;
+
+            tolerance      = tree.get<double>("solver_tolerance",      tolerance);
+            max_iterations = tree.get<int>   ("solver_max_iterations", max_iterations);
+            warm_start     = tree.get<bool>  ("solver_warm_start",     warm_start);
+            report         = tree.get<bool>  ("solver_report",         report);
+            symmetric      = tree.get<bool>  ("solver_symmetric",      symmetric);
+            num_threads    = tree.get<unsigned int>("num_threads",     num_threads);
+
+            return true;
+        } catch(...) {
+            return false;
+        }
+    }
+
+    TplSolverSettings TplSolverSettings::shared(unsigned int n) const
+    {
+        TplSolverSettings share = *this;
+        const unsigned int total = num_threads > 0 ? num_threads : std::max(1u, std::thread::hardware_concurrency());
+        share.num_threads = std::max(1u, total / std::max(1u, n));
+        return share;
+    }
+
+    void TplSymmetricMatrix::assign(const SpMat &A)
+    {
+        assert(A.rows() == A.cols());
+
+        if (same_pattern(A)) {
+            const double *values = A.valuePtr();
+            for (size_t k=0; k<_values.size(); ++k) {
+                _values[k] = values[_value_source[k]];
+            }
+            for (int i=0; i<_diagonal.size(); ++i) {
+                _diagonal(i) = _diagonal_source[i] < 0 ? 0 : values[_diagonal_source[i]];
+            }
+            return;
+        }
+
+        //column j of the column major A holds the entries (i, j), and (i, j) with i < j is (j, i) of the lower triangle
+        const int n = A.rows();
+        _diagonal.setZero(n);
+        _diagonal_source.assign(n, -1);
+        _row_offsets.assign(1, 0);
+        _row_offsets.reserve(n + 1);
+        _cols.clear();
+        _values.clear();
+        _value_source.clear();
+        _cols.reserve(A.nonZeros() / 2);
+        _values.reserve(A.nonZeros() / 2);
+        _value_source.reserve(A.nonZeros() / 2);
+
+        for (int j=0; j<n; ++j) {
+            for (SpMat::InnerIterator it(A, j); it; ++it) {
+                if (it.row() < j) {
+                    _cols.push_back(it.row());
+                    _values.push_back(it.value());
+                    _value_source.push_back(&it.value() - A.valuePtr());
+                } else if (it.row() == j) {
+                    _diagonal(j) = it.value();
+                    _diagonal_source[j] = &it.value() - A.valuePtr();
+                }
+            }
+            _row_offsets.push_back(_cols.size());
+        }
+
+        if (A.isCompressed()) {
+            _pattern_outer.assign(A.outerIndexPtr(), A.outerIndexPtr() + n + 1);
+            _pattern_inner.assign(A.innerIndexPtr(), A.innerIndexPtr() + A.nonZeros());
+        } else {
+            _pattern_outer.clear();
+            _pattern_inner.clear();
+        }
+
+        partition_rows();
+    }
+
+    bool TplSymmetricMatrix::same_pattern(const SpMat &A) const
+    {
+        if (!A.isCompressed() || _pattern_outer.empty()) return false;
+        if (_pattern_outer.size() != size_t(A.cols()) + 1 || _pattern_inner.size() != size_t(A.nonZeros())) return false;
+        return equal(_pattern_outer.begin(), _pattern_outer.end(), A.outerIndexPtr()) &&
+               equal(_pattern_inner.begin(), _pattern_inner.end(), A.innerIndexPtr());
+    }
+
+    size_t TplSymmetricMatrix::bytes() const
+    {
+        return _values.size() * (sizeof(double) + sizeof(int)) + _row_offsets.size() * sizeof(int) +
+               _diagonal.size() * sizeof(double);
+    }
+
+    void TplSymmetricMatrix::set_num_threads(unsigned int num_threads)
+    {
+        if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+        _num_threads = num_threads;
+        partition_rows();
+    }
+
+    void TplSymmetricMatrix::partition_rows()
+    {
+        const size_t n = rows();
+        const size_t total = num_stored();
+
+        //a thread is not worth starting for less than MIN_RANGE_ENTRIES entries
+        const size_t num_ranges = std::max<size_t>(1, std::min<size_t>(_num_threads, total / MIN_RANGE_ENTRIES));
+
+        _range_first.assign(1, 0);
+        for (size_t i=0, t=1; i<n && t<num_ranges; ++i) {
+            //entries of the rows [0, i], the diagonal included
+            size_t entries = _row_offsets[i+1] + i + 1;
+            if (entries * num_ranges >= total * t) {
+                _range_first.push_back(i + 1);
+                ++t;
+            }
+        }
+        if (_range_first.back() != n) _range_first.push_back(n);
+    }
+
+    void TplSymmetricMatrix::multiply_rows(size_t first, size_t last, const double *x, double *y, double *partial) const
+    {
+        const int    *cols   = _cols.data();
+        const double *values = _values.data();
+
+        for (size_t i=first; i<last; ++i) {
+            const int begin = _row_offsets[i];
+            const int end   = _row_offsets[i+1];
+            const double xi = x[i];
+
+            //columns are sorted, those below first belong to earlier ranges
+            int split = begin;
+            if (first > 0) split = lower_bound(cols + begin, cols + end, static_cast<int>(first)) - cols;
+
+            double sum = _diagonal(i) * xi;
+            for (int k=begin; k<split; ++k) {
+                sum += values[k] * x[cols[k]];
+                partial[cols[k]] += values[k] * xi;
+            }
+            for (int k=split; k<end; ++k) {
+                sum += values[k] * x[cols[k]];
+                y[cols[k]] += values[k] * xi;
+            }
+            y[i] = sum;
+        }
+    }
+
+    void TplSymmetricMatrix::multiply(const VectorXd &x, VectorXd &y) const
+    {
+        assert(x.size() == rows());
+
+        y.resize(rows());
+        const size_t num_ranges = _range_first.size() - 1;
+        if (num_ranges <= 1) {
+            multiply_rows(0, rows(), x.data(), y.data(), nullptr);
+            return;
+        }
+
+        if (!_workers) _workers.reset(new TplWorkers());
+        _partial.resize(num_ranges);
+        _workers->run(num_ranges, [&](size_t t) {
+            _partial[t].setZero(_range_first[t]);
+            multiply_rows(_range_first[t], _range_first[t+1], x.data(), y.data(), _partial[t].data());
+        });
+
+        //every range adds the contributions the later ranges made to its rows
+        _workers->run(num_ranges, [&](size_t t) {
+            const size_t first = _range_first[t];
+            const size_t size  = _range_first[t+1] - first;
+            for (size_t u=t+1; u<num_ranges; ++u) {
+                y.segment(first, size) += _partial[u].segment(first, size);
+            }
+        });
+    }
+
+    TplLinearSolver::TplLinearSolver(const std::string &name, const TplSolverSettings &settings) : _name(name)
+    {
+        set_settings(settings);
+    }
+
+    void TplLinearSolver::set_settings(const TplSolverSettings &settings)
+    {
+        _settings = settings;
+        _analyzed = false;
+
+        //a negative limit restores Eigen's default of twice the number of unknowns
+        int max_iterations = _settings.max_iterations > 0 ? _settings.max_iterations : -1;
+        _diagonal_cg.setTolerance(_settings.tolerance);
+        _diagonal_cg.setMaxIterations(max_iterations);
+        _cholesky_cg.setTolerance(_settings.tolerance);
+        _cholesky_cg.setMaxIterations(max_iterations);
+        _symmetric.set_num_threads(_settings.num_threads);
+    }
+
+    bool TplLinearSolver::pattern_changed(const SpMat &A)
+    {
+        assert(A.isCompressed());
+
+        const int *outer = A.outerIndexPtr();
+        const int *inner = A.innerIndexPtr();
+        const size_t num_outer = A.outerSize() + 1;
+        const size_t num_inner = A.nonZeros();
+
+        if (_analyzed && _outer.size() == num_outer && _inner.size() == num_inner &&
+            equal(_outer.begin(), _outer.end(), outer) && equal(_inner.begin(), _inner.end(), inner)) {
+            return false;
+        }
+
+        _outer.assign(outer, outer + num_outer);
+        _inner.assign(inner, inner + num_inner);
+        return true;
+    }
+
+    template<typename Solver>
+    bool TplLinearSolver::run(Solver &solver, const VectorXd &b, VectorXd &x)
+    {
+        if (_settings.warm_start && x.size() == b.size()) {
+            x = solver.solveWithGuess(b, x);
+        } else {
+            x = solver.solve(b);
+        }
+
+        _iterations = solver.iterations();
+        _error      = solver.error();
+        report();
+
+        return solver.info() == Eigen::Success;
+    }
+
+    bool TplLinearSolver::run_symmetric(const SpMat &A, const VectorXd &b, VectorXd &x)
+    {
+        _symmetric.assign(A);
+        const TplSymmetricMatrix &M = _symmetric;
+        const int n = M.rows();
+        const int max_iterations = _settings.max_iterations > 0 ? _settings.max_iterations : 2*n;
+
+        if (!_settings.warm_start || x.size() != b.size()) x.setZero(n);
+
+        //Jacobi preconditioner, a zero diagonal entry is left unscaled like Eigen's DiagonalPreconditioner does
+        _inverse_diagonal.resize(n);
+        for (int i=0; i<n; ++i) {
+            _inverse_diagonal(i) = M.diagonal()(i) != 0 ? 1 / M.diagonal()(i) : 1;
+        }
+
+        const double rhs_norm2 = b.squaredNorm();
+        if (rhs_norm2 == 0) {
+            x.setZero();
+            _iterations = 0;
+            _error      = 0;
+            report();
+            return true;
+        }
+        const double threshold = _settings.tolerance * _settings.tolerance * rhs_norm2;
+
+        M.multiply(x, _q);
+        _r = b - _q;
+        double residual_norm2 = _r.squaredNorm();
+
+        int i = 0;
+        if (residual_norm2 > threshold) {
+            _z = _inverse_diagonal.cwiseProduct(_r);
+            _p = _z;
+            double rz = _r.dot(_z);
+
+            while (i < max_iterations) {
+                M.multiply(_p, _q);
+                const double alpha = rz / _p.dot(_q);
+                x  += alpha * _p;
+                _r -= alpha * _q;
+                residual_norm2 = _r.squaredNorm();
+                ++i;
+                if (residual_norm2 < threshold) break;
+
+                _z = _inverse_diagonal.cwiseProduct(_r);
+                const double rz_new = _r.dot(_z);
+                _p = _z + (rz_new / rz) * _p;
+                rz = rz_new;
+            }
+        }
+
+        _iterations = i;
+        _error      = sqrt(residual_norm2 / rhs_norm2);
+        report();
+
+        return _error <= _settings.tolerance;
+    }
+
+    void TplLinearSolver::report() const
+    {
+        if (_settings.report) {
+            printf("%s solve: %d iterations, residual %.3e\n", _name.c_str(), _iterations, _error);
+        }
+    }
+
+    void TplLinearSolver::report_failure() const
+    {
+        fprintf(stderr, "%s solve did not converge: %d iterations, residual %.3e\n", _name.c_str(), _iterations, _error);
+    }
+
+    bool TplLinearSolver::solve(const SpMat &A, const VectorXd &b, VectorXd &x)
+    {
+        assert(A.rows() == A.cols());
+        assert(A.rows() == b.rows());
+
+        if (_settings.preconditioner == Preconditioner::IncompleteCholesky) {
+            //the ordering is computed once per pattern, the factorization every solve
+            if (pattern_changed(A)) {
+                _cholesky_cg.analyzePattern(A);
+                _analyzed = true;
+            }
+            _cholesky_cg.factorize(A);
+
+            if (_cholesky_cg.info() == Eigen::Success) return run(_cholesky_cg, b, x);
+
+            //the diagonal shift gave up before the factorization succeeded, hardly ever the case
+            _analyzed = false;
+        }
+
+        if (_settings.symmetric) return run_symmetric(A, b, x);
+
+        _diagonal_cg.compute(A);
+        return run(_diagonal_cg, b, x);
+    }
+
+}//end namespace tpl
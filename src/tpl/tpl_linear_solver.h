@@ -0,0 +1,208 @@
+/*!
+ * \file tpl_linear_solver.h
+ * \brief Preconditioned conjugate gradient solver for the placement systems.
+ */
+
+#ifndef TPL_LINEAR_SOLVER_H
+#define TPL_LINEAR_SOLVER_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Eigen/IterativeLinearSolvers>
+
+#include "utils.h"
+#include "tpl_workers.h"
+
+namespace tpl {
+
+    //! Preconditioner of a TplLinearSolver.
+    enum class Preconditioner {
+        Diagonal,          //!< Jacobi preconditioner, Eigen's default for ConjugateGradient.
+        IncompleteCholesky //!< Eigen's IncompleteCholesky, see TplLinearSolver.
+    };
+
+    //! Settings of a TplLinearSolver, read from the TPLCONFIG json file.
+    struct TplSolverSettings {
+        Preconditioner preconditioner = Preconditioner::Diagonal;
+        double tolerance     = Eigen::NumTraits<double>::epsilon(); //!< Relative residual to stop at.
+        int    max_iterations = 0;    //!< Iteration limit, 0 for twice the number of unknowns.
+        bool   warm_start     = true; //!< Start from the solution vector's content instead of zero.
+        bool   report         = false;//!< Print the iterations and the residual of every solve.
+        bool   symmetric      = true; //!< Solve on the lower triangle only, see TplSymmetricMatrix.
+        unsigned int num_threads = 0; //!< Threads of a symmetric matrix-vector product, 0 for one per hardware thread.
+
+        //! Read the settings from the TPLCONFIG json file, keeping the defaults for missing keys.
+        /*!
+         * The keys are "solver_preconditioner" ("diagonal" or "incomplete_cholesky"), "solver_tolerance",
+         * "solver_max_iterations", "solver_warm_start", "solver_report", "solver_symmetric"
+         * and "num_threads".
+         * \return false if TPLCONFIG is not set or can not be read.
+         */
+        bool load();
+
+        //! Settings of one of n solvers running at the same time, each with its share of the threads.
+        TplSolverSettings shared(unsigned int n) const;
+    };
+
+    //! Symmetric sparse matrix keeping only its lower triangle.
+    /*!
+     * The diagonal is kept apart, and the strictly lower triangle is stored row by row in
+     * compressed form, so a matrix-vector product reads about half the bytes of a matrix
+     * holding both triangles. Each stored entry (i, j) contributes to both y(i) and y(j).
+     *
+     * The product is parallel over contiguous row ranges of about the same number of entries.
+     * A thread writes y(i) of its own rows directly, and the contributions to rows of earlier
+     * ranges (j below its first row) go to a private buffer, added to y in a second pass.
+     * The threads are started by the first parallel product and wait for the next one, so a
+     * CG solve doing a product every iteration does not start threads every iteration. A
+     * matrix of less than MIN_RANGE_ENTRIES entries per thread is multiplied serially.
+     */
+    class TplSymmetricMatrix {
+    public:
+        //! Default constructor, an empty matrix.
+        TplSymmetricMatrix() = default;
+
+        //! Take the lower triangle of A.
+        /*!
+         * A compressed A with the nonzero pattern of the previous call only has its values
+         * copied, through the positions found by that call, so the placement iterations, whose
+         * pattern is the same from one to the next, do not search the triangle again.
+         * \param A Symmetric matrix, with both triangles stored.
+         */
+        void assign(const SpMat &A);
+
+        //! y = A x.
+        void multiply(const VectorXd &x, VectorXd &y) const;
+
+        //! Number of rows.
+        int rows() const { return _diagonal.size(); }
+        //! Number of entries stored, the diagonal included.
+        std::size_t num_stored() const { return _values.size() + _diagonal.size(); }
+        //! Bytes read from the matrix by one product.
+        std::size_t bytes() const;
+        //! The diagonal.
+        const VectorXd &diagonal() const { return _diagonal; }
+
+        //! Number of threads of the product.
+        unsigned int num_threads() const { return _num_threads; }
+        //! Set the number of threads of the product, 0 for one per hardware thread.
+        void set_num_threads(unsigned int num_threads);
+
+    private:
+        //! Whether A is compressed and has the nonzero pattern of the previous assign().
+        bool same_pattern(const SpMat &A) const;
+
+        //! Cut the rows into contiguous ranges of about the same number of entries, one per thread.
+        void partition_rows();
+
+        //! y(i) for the rows [first, last), transposed contributions below first go to partial.
+        void multiply_rows(std::size_t first, std::size_t last, const double *x, double *y, double *partial) const;
+
+        //! Fewest entries worth a thread of the product.
+        static const std::size_t MIN_RANGE_ENTRIES = 1 << 16;
+
+        VectorXd            _diagonal;
+        std::vector<int>    _row_offsets; //!< Start of every row in _cols and _values, and their size.
+        std::vector<int>    _cols;        //!< Column of every strictly lower entry.
+        std::vector<double> _values;      //!< Value of every strictly lower entry.
+
+        std::vector<int> _pattern_outer;   //!< Column starts of the last assigned matrix, empty if unknown.
+        std::vector<int> _pattern_inner;   //!< Row indices of the last assigned matrix.
+        std::vector<int> _value_source;    //!< Position in the assigned matrix of every entry of _values.
+        std::vector<int> _diagonal_source; //!< Position in the assigned matrix of every diagonal entry, -1 if none.
+
+        unsigned int _num_threads = 1;
+        std::vector<std::size_t> _range_first;     //!< First row of every thread's range, and the number of rows.
+        mutable std::vector<VectorXd> _partial;    //!< Every thread's contributions to the rows of earlier ranges.
+        mutable std::unique_ptr<TplWorkers> _workers; //!< Started by the first parallel product.
+    };
+
+    //! Conjugate gradient solver for symmetric positive definite placement systems.
+    /*!
+     * The global placement solves a system with the same sparsity pattern every iteration,
+     * so the symbolic analysis of the preconditioner is redone only when the pattern of the
+     * matrix changes, and only the numeric factorization runs every solve. With warm_start,
+     * the solve starts from the last solution held by the caller, which is close to the new
+     * one once the placement settles.
+     *
+     * The incomplete Cholesky preconditioner is Eigen's IncompleteCholesky, not a zero fill
+     * IC(0): it reorders the matrix by AMD, keeps some fill-in beyond the pattern of the matrix
+     * (a dual threshold on the size and the count of the entries of every column), and shifts
+     * the diagonal until the factorization succeeds. The fall back to the diagonal
+     * preconditioner on a failed factorization is thus almost never taken.
+     *
+     * With the diagonal preconditioner and the symmetric setting, the solve runs its own
+     * Jacobi preconditioned CG on a TplSymmetricMatrix instead of Eigen's ConjugateGradient,
+     * with the same stopping rule (relative residual below the tolerance).
+     */
+    class TplLinearSolver {
+    public:
+        //! Constructor.
+        /*!
+         * \param name Name of the system, used in the reports.
+         * \param settings Solver settings.
+         */
+        explicit TplLinearSolver(const std::string &name = "", const TplSolverSettings &settings = TplSolverSettings());
+
+        //! Solve A x = b.
+        /*!
+         * \param A Symmetric positive definite matrix, with both triangles stored.
+         * \param b Right hand side.
+         * \param x The initial guess when warm_start is set and x has the right size, receives the solution.
+         * \return A boolean variable indicating wether the solve converged.
+         */
+        bool solve(const SpMat &A, const VectorXd &b, VectorXd &x);
+
+        //! Solver settings.
+        const TplSolverSettings &settings() const { return _settings; }
+        //! Change the solver settings.
+        void set_settings(const TplSolverSettings &settings);
+
+        //! Number of iterations of the last solve.
+        int iterations() const { return _iterations; }
+        //! Relative residual of the last solve.
+        double error() const { return _error; }
+
+        //! Print to stderr that the last solve did not converge, with its statistics.
+        void report_failure() const;
+
+    private:
+        //! Whether A has another pattern than the one the preconditioner was analyzed for, and remember A's pattern.
+        bool pattern_changed(const SpMat &A);
+
+        //! Run a solver whose preconditioner is ready, and record its statistics.
+        template<typename Solver>
+        bool run(Solver &solver, const VectorXd &b, VectorXd &x);
+
+        //! Jacobi preconditioned CG on the lower triangle of A.
+        bool run_symmetric(const SpMat &A, const VectorXd &b, VectorXd &x);
+
+        //! Print the statistics of the last solve when the report is on.
+        void report() const;
+
+        using DiagonalCG = Eigen::ConjugateGradient<SpMat, Eigen::Lower|Eigen::Upper, Eigen::DiagonalPreconditioner<double> >;
+        using CholeskyCG = Eigen::ConjugateGradient<SpMat, Eigen::Lower|Eigen::Upper, Eigen::IncompleteCholesky<double> >;
+
+        std::string       _name;
+        TplSolverSettings _settings;
+
+        DiagonalCG _diagonal_cg;
+        CholeskyCG _cholesky_cg;
+
+        TplSymmetricMatrix _symmetric;
+        VectorXd _r, _z, _p, _q; //!< Work vectors of run_symmetric.
+        VectorXd _inverse_diagonal; //!< Jacobi preconditioner of run_symmetric.
+
+        std::vector<int> _outer; //!< Outer index array of the analyzed pattern.
+        std::vector<int> _inner; //!< Inner index array of the analyzed pattern.
+        bool _analyzed = false;
+
+        int    _iterations = 0;
+        double _error      = 0;
+    };
+
+}//end namespace tpl
+
+#endif //TPL_LINEAR_SOLVER_H
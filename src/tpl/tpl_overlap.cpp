@@ -0,0 +1,268 @@
+/*!
+ * \file tpl_overlap.cpp
+ * \brief Overlap of the placed modules implementation file.
+ */
+
+#include "tpl_overlap.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <thread>
+
+namespace tpl {
+    using namespace std;
+
+    namespace {
+
+        const int RADIX_BITS   = 11;
+        const int RADIX_PASSES = (64 + RADIX_BITS - 1) / RADIX_BITS;
+        const size_t RADIX_SIZE = size_t(1) << RADIX_BITS;
+
+        //! Unsigned integer ordered like the double x, its bits with the negative numbers reversed.
+        inline uint64_t sort_key(double x)
+        {
+            if (x == 0) x = 0; //-0 and 0 are the same coordinate
+            uint64_t bits;
+            memcpy(&bits, &x, sizeof(bits));
+            return (bits >> 63) ? ~bits : bits | (uint64_t(1) << 63);
+        }
+
+        //! The double of a sort key.
+        inline double key_value(uint64_t key)
+        {
+            uint64_t bits = (key >> 63) ? key & ~(uint64_t(1) << 63) : ~key;
+            double x;
+            memcpy(&x, &bits, sizeof(x));
+            return x;
+        }
+
+        inline uint64_t key_of(uint64_t key) { return key; }
+        template<typename T>
+        inline uint64_t key_of(const T &item) { return item.key; }
+
+        //! Stable sort of items by key, least significant digit first, work is a buffer of the same size.
+        /*!
+         * The digit counts of all the passes are taken in one read, and the passes whose digit is
+         * the same for every key, like the sign and most exponent bits of close coordinates, are skipped.
+         */
+        template<typename T>
+        void radix_sort(vector<T> &items, vector<T> &work, vector<size_t> &histogram)
+        {
+            const size_t n = items.size();
+            work.resize(n);
+            histogram.assign(RADIX_PASSES * RADIX_SIZE, 0);
+
+            for (const T &item : items) {
+                const uint64_t key = key_of(item);
+                for (int pass=0; pass<RADIX_PASSES; ++pass) {
+                    ++histogram[pass * RADIX_SIZE + ((key >> (pass * RADIX_BITS)) & (RADIX_SIZE-1))];
+                }
+            }
+
+            for (int pass=0; pass<RADIX_PASSES; ++pass) {
+                size_t *count = &histogram[pass * RADIX_SIZE];
+                if (n == 0 || count[(key_of(items[0]) >> (pass * RADIX_BITS)) & (RADIX_SIZE-1)] == n) continue;
+
+                size_t offset = 0;
+                for (size_t d=0; d<RADIX_SIZE; ++d) {
+                    const size_t c = count[d];
+                    count[d] = offset;
+                    offset += c;
+                }
+                for (const T &item : items) {
+                    work[count[(key_of(item) >> (pass * RADIX_BITS)) & (RADIX_SIZE-1)]++] = item;
+                }
+                items.swap(work);
+            }
+        }
+
+        //! Length of [low, high] inside [first, first + size].
+        inline double overlap(double low, double high, double first, double size)
+        {
+            return max(0.0, min(high, first + size) - max(low, first));
+        }
+
+    }//end anonymous namespace
+
+    void TplOverlapEngine::set_num_threads(unsigned int num_threads)
+    {
+        if (num_threads == 0) num_threads = max(1u, std::thread::hardware_concurrency());
+        _num_threads = num_threads;
+    }
+
+    double TplOverlapEngine::exact_overlap(const TplModuleGeometry &g, size_t n)
+    {
+        const size_t num_strips = max<size_t>(1, min<size_t>(_num_threads, n / MIN_STRIP_MODULES));
+        return exact_overlap(g, n, num_strips);
+    }
+
+    double TplOverlapEngine::exact_overlap(const TplModuleGeometry &g, size_t n, unsigned int num_strips)
+    {
+        assert(num_strips > 0);
+        const double infinity = numeric_limits<double>::infinity();
+
+        _total_area = 0;
+        for (size_t i=0; i<n; ++i) {
+            _total_area += g.width[i] * g.height[i];
+        }
+
+        //strip bounds at the quantiles of a sample of the module centers, the outer bounds open
+        _bounds.assign(1, -infinity);
+        if (num_strips > 1) {
+            const size_t step = max<size_t>(1, n / 4096);
+            _samples.clear();
+            for (size_t i=0; i<n; i+=step) {
+                _samples.push_back(g.y[i] + g.height[i] / 2);
+            }
+            sort(_samples.begin(), _samples.end());
+            for (unsigned int s=1; s<num_strips && !_samples.empty(); ++s) {
+                _bounds.push_back(_samples[s * _samples.size() / num_strips]);
+            }
+        }
+        _bounds.push_back(infinity);
+
+        const size_t strips = _bounds.size() - 1;
+        _sweeps.resize(max(_sweeps.size(), strips));
+        _strip_area.assign(strips, 0);
+        _workers.run(strips, [&](size_t s) {
+            _strip_area[s] = _sweeps[s].union_area(g, n, _bounds[s], _bounds[s+1]);
+        });
+
+        _union_area = 0;
+        for (double area : _strip_area) {
+            _union_area += area;
+        }
+
+        return _total_area > 0 ? 1 - _union_area / _total_area : 0;
+    }
+
+    double TplOverlapEngine::Sweep::union_area(const TplModuleGeometry &g, size_t n, double low, double high)
+    {
+        //distinct x coordinates of the modules crossing the strip
+        _xs.clear();
+        _members.clear();
+        for (size_t i=0; i<n; ++i) {
+            if (g.y[i] >= high || g.y[i] + g.height[i] <= low) continue;
+            _members.push_back(i);
+            _xs.push_back(sort_key(g.x[i]));
+            _xs.push_back(sort_key(g.x[i] + g.width[i]));
+        }
+        radix_sort(_xs, _xs_work, _histogram);
+        _xs.erase(unique(_xs.begin(), _xs.end()), _xs.end());
+
+        //bottom and top edges of the modules, clipped to the strip
+        _events.clear();
+        for (size_t i : _members) {
+            const double bottom = max(g.y[i], low);
+            const double top    = min(g.y[i] + g.height[i], high);
+
+            const int first = lower_bound(_xs.begin(), _xs.end(), sort_key(g.x[i])) - _xs.begin();
+            const int last  = lower_bound(_xs.begin(), _xs.end(), sort_key(g.x[i] + g.width[i])) - _xs.begin();
+            if (first == last) continue;
+            _events.push_back(Event{sort_key(bottom), first, last, 1});
+            _events.push_back(Event{sort_key(top), first, last, -1});
+        }
+        radix_sort(_events, _events_work, _histogram);
+
+        //sweep the events, the covered length holds up to the next event
+        build_tree();
+        double area = 0;
+        for (size_t i=0; i+1<_events.size(); ++i) {
+            const Event &e = _events[i];
+            cover(e.first, e.last, e.change);
+            area += _covered[1] * (key_value(_events[i+1].key) - key_value(e.key));
+        }
+        return area;
+    }
+
+    void TplOverlapEngine::Sweep::build_tree()
+    {
+        const int intervals = max<int>(1, int(_xs.size()) - 1);
+        _leaves = 1;
+        while (_leaves < intervals) _leaves *= 2;
+
+        _length.assign(2*_leaves, 0);
+        _covered.assign(2*_leaves, 0);
+        _cover.assign(2*_leaves, 0);
+        for (size_t i=0; i+1<_xs.size(); ++i) {
+            _length[_leaves + i] = key_value(_xs[i+1]) - key_value(_xs[i]);
+        }
+        for (int i=_leaves-1; i>0; --i) {
+            _length[i] = _length[2*i] + _length[2*i+1];
+        }
+    }
+
+    void TplOverlapEngine::Sweep::cover(int first, int last, int change)
+    {
+        assert(0 <= first && first < last && last <= _leaves);
+
+        //the nodes spanning [first, last), bottom up, then every ancestor of the two ends
+        const int first_leaf = first + _leaves;
+        const int last_leaf  = last - 1 + _leaves;
+        for (int lo = first_leaf, hi = last_leaf + 1; lo < hi; lo /= 2, hi /= 2) {
+            if (lo & 1) {
+                _cover[lo] += change;
+                pull(lo++);
+            }
+            if (hi & 1) {
+                _cover[--hi] += change;
+                pull(hi);
+            }
+        }
+        for (int i=first_leaf/2; i>0; i/=2) pull(i);
+        for (int i=last_leaf/2;  i>0; i/=2) pull(i);
+    }
+
+    double TplOverlapEngine::estimated_overlap(const TplModuleGeometry &g, size_t n, double chip_width, double chip_height)
+    {
+        assert(chip_width > 0 && chip_height > 0);
+
+        //about one bin per module
+        const double side = sqrt(chip_width * chip_height / max<size_t>(n, 1));
+        const int nx = min(2048, max(1, int(ceil(chip_width  / side))));
+        const int ny = min(2048, max(1, int(ceil(chip_height / side))));
+        const double bin_width  = chip_width  / nx;
+        const double bin_height = chip_height / ny;
+        _occupied.assign(size_t(nx) * ny, 0);
+
+        //module area inside every bin, the parts outside the chip counted whole
+        _total_area = 0;
+        double outside = 0;
+        for (size_t k=0; k<n; ++k) {
+            const double left = g.x[k], right = g.x[k] + g.width[k];
+            const double bottom = g.y[k], top = g.y[k] + g.height[k];
+            const double area = g.width[k] * g.height[k];
+            _total_area += area;
+
+            const double inside = overlap(left, right, 0, chip_width) * overlap(bottom, top, 0, chip_height);
+            outside += area - inside;
+            if (inside <= 0) continue;
+
+            const int i0 = max(0, int(floor(left / bin_width)));
+            const int i1 = min(nx-1, int(floor(right / bin_width)));
+            const int j0 = max(0, int(floor(bottom / bin_height)));
+            const int j1 = min(ny-1, int(floor(top / bin_height)));
+            for (int i=i0; i<=i1; ++i) {
+                const double w = overlap(left, right, i * bin_width, bin_width);
+                if (w <= 0) continue;
+                double *column = &_occupied[size_t(i) * ny];
+                for (int j=j0; j<=j1; ++j) {
+                    column[j] += w * overlap(bottom, top, j * bin_height, bin_height);
+                }
+            }
+        }
+
+        //a bin holds at most its own area of the union
+        const double bin_area = bin_width * bin_height;
+        _estimated_union_area = outside;
+        for (double occupied : _occupied) {
+            _estimated_union_area += min(occupied, bin_area);
+        }
+
+        return _total_area > 0 ? 1 - _estimated_union_area / _total_area : 0;
+    }
+
+}//end namespace tpl
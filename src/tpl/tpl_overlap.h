@@ -0,0 +1,126 @@
+/*!
+ * \file tpl_overlap.h
+ * \brief Overlap of the placed modules, exact and estimated.
+ */
+
+#ifndef TPL_OVERLAP_H
+#define TPL_OVERLAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "tpl_db.h"
+#include "tpl_workers.h"
+
+namespace tpl {
+
+    //! Overlap ratio of the modules, 1 - union area / total area, kept busy every global placement iteration.
+    /*!
+     * The exact overlap sweeps a line over y through the modules' bottom and top edges, and
+     * a segment tree over the distinct x coordinates keeps the length of x covered by the
+     * modules the line crosses. The coordinates and the events are sorted by LSD radix sort
+     * on the bits of the doubles, the segment tree is updated bottom up without recursion,
+     * and every buffer is kept from one call to the next.
+     *
+     * With several threads, the plane is cut into horizontal strips of about the same number
+     * of modules, every module is clipped to the strips it crosses, and every strip is swept
+     * on its own thread with its own buffers. The union area is the sum of the strips'.
+     *
+     * The estimated overlap spreads the modules' area over a grid of about one bin per module
+     * and caps every bin at its own area. A bin can not hold more union area than that, so the
+     * estimate never exceeds the exact overlap, at a fraction of its cost.
+     */
+    class TplOverlapEngine {
+    public:
+        //! Default constructor.
+        TplOverlapEngine() = default;
+
+        //! Exact overlap ratio of the modules [0, n).
+        /*!
+         * Swept in one strip per thread, up to one per MIN_STRIP_MODULES modules.
+         */
+        double exact_overlap(const TplModuleGeometry &g, std::size_t n);
+
+        //! Exact overlap ratio of the modules [0, n), swept in num_strips strips, each on its own thread.
+        double exact_overlap(const TplModuleGeometry &g, std::size_t n, unsigned int num_strips);
+
+        //! Estimated overlap ratio of the modules [0, n), at most the exact one.
+        /*!
+         * \param chip_width Width of the chip, the grid covers [0, chip_width] x [0, chip_height].
+         * \param chip_height Height of the chip.
+         */
+        double estimated_overlap(const TplModuleGeometry &g, std::size_t n, double chip_width, double chip_height);
+
+        //! Union area of the modules, from the last exact_overlap().
+        double union_area() const { return _union_area; }
+        //! Upper bound of the union area of the modules, from the last estimated_overlap().
+        double estimated_union_area() const { return _estimated_union_area; }
+        //! Total area of the modules, from the last call.
+        double total_area() const { return _total_area; }
+
+        //! Number of threads of the exact overlap.
+        unsigned int num_threads() const { return _num_threads; }
+        //! Set the number of threads of the exact overlap, 0 for one per hardware thread.
+        void set_num_threads(unsigned int num_threads);
+
+    private:
+        //! Sweep line over one horizontal strip, with its buffers.
+        class Sweep {
+        public:
+            //! Union area of the modules [0, n) clipped to the strip [low, high) in y.
+            double union_area(const TplModuleGeometry &g, std::size_t n, double low, double high);
+
+        private:
+            //! A module's bottom (change +1) or top (change -1) edge, over the elementary x intervals [first, last).
+            struct Event {
+                std::uint64_t key; //!< Sort key of the edge's y.
+                int first, last;
+                int change;
+            };
+
+            //! Build an empty segment tree over the elementary intervals of _xs.
+            void build_tree();
+
+            //! Add change to the cover count of the elementary intervals [first, last).
+            void cover(int first, int last, int change);
+
+            //! Recompute the covered length of node i from its cover count and its children.
+            void pull(int i)
+            {
+                _covered[i] = _cover[i] > 0 ? _length[i] : (i >= _leaves ? 0 : _covered[2*i] + _covered[2*i+1]);
+            }
+
+            std::vector<std::size_t>   _members;  //!< Modules crossing the strip.
+            std::vector<std::uint64_t> _xs;       //!< Sort keys of the distinct x coordinates.
+            std::vector<std::uint64_t> _xs_work;  //!< Radix sort buffer of _xs.
+            std::vector<Event>         _events;
+            std::vector<Event>         _events_work; //!< Radix sort buffer of _events.
+            std::vector<std::size_t>   _histogram;   //!< Radix sort digit counts.
+
+            int _leaves = 0;              //!< Leaves of the segment tree, a power of 2.
+            std::vector<double> _length;  //!< Length of x spanned by every node.
+            std::vector<double> _covered; //!< Length of x covered below every node.
+            std::vector<int>    _cover;   //!< Number of modules covering every node's whole span.
+        };
+
+        //! Fewest modules worth a strip of their own.
+        static const std::size_t MIN_STRIP_MODULES = 1 << 16;
+
+        std::vector<Sweep>  _sweeps;     //!< One per strip.
+        std::vector<double> _bounds;     //!< Bottom of every strip, and the top of the last one.
+        std::vector<double> _strip_area; //!< Union area of every strip.
+        std::vector<double> _samples;    //!< Module centers the strip bounds are chosen from.
+        unsigned int _num_threads = 1;
+        TplWorkers   _workers;           //!< Threads sweeping the strips, kept from one call to the next.
+
+        std::vector<double> _occupied; //!< Module area in every bin of the estimate.
+
+        double _union_area = 0;
+        double _estimated_union_area = 0;
+        double _total_area = 0;
+    };
+
+}//end namespace tpl
+
+#endif //TPL_OVERLAP_H
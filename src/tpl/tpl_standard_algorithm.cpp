@@ -10,15 +10,18 @@
 #include <unistd.h>
 
 #include "debug.h"
+#include "tpl_trace.h"
 
 #include <boost/filesystem.hpp>
+#include <boost/property_tree/json_parser.hpp>
 
 
 
 namespace tpl {
     using namespace std;
 
-    TplStandardAlgorithm::TplStandardAlgorithm()
+    TplStandardAlgorithm::TplStandardAlgorithm() : _x_solver("global x"), _y_solver("global y"), _overlap_estimate(true),
+        _stop_criterion(StopCriterion::Overlap), _target_density(1.0), _overflow_stop(0.1)
     {
        initialize_models();
 
@@ -32,6 +35,28 @@ namespace tpl {
 
         HFx.resize(msize);
         HFy.resize(msize);
+
+        TplSolverSettings settings;
+        settings.load();
+        //the x and y systems are solved at the same time, each on half of the threads
+        _x_solver.set_settings(settings.shared(2));
+        _y_solver.set_settings(settings.shared(2));
+        _overlap.set_num_threads(settings.num_threads);
+
+        try {
+            namespace pt = boost::property_tree;
+            pt::ptree tree;
+            pt::read_json(getenv("TPLCONFIG"), tree);
+            _overlap_estimate = tree.get<bool>("overlap_estimate", _overlap_estimate);
+            _target_density   = tree.get<double>("target_density", _target_density);
+            _overflow_stop    = tree.get<double>("overflow_stop",  _overflow_stop);
+
+            string criterion = tree.get<string>("stop_criterion", "overlap");
+            if      (criterion == "overlap")  _stop_criterion = StopCriterion::Overlap;
+            else if (criterion == "overflow") _stop_criterion = StopCriterion::Overflow;
+            else cout << "unknown stop criterion " << criterion << ", stopping on overlap" << endl;
+        } catch(...) {
+        }
     }
 
 	void TplStandardAlgorithm::initialize_models()
@@ -111,98 +136,50 @@ namespace tpl {
         initialize_move_force_matrix();//compute Cx0 and Cy0
         VectorXd dx(msize), dy(msize);
         VectorXd rhsx(msize), rhsy(msize);
+        _delta_x = VectorXd::Zero(msize);
+        _delta_y = VectorXd::Zero(msize);
 
-        int i = 0;
+        int iteration = 0;
         while (!should_stop_global_placement()) {
             _net_model->compute_net_weight(NWx, NWy);
             _net_force_model->compute_net_force_matrix(NWx, NWy, Cx, Cy, dx, dy);//compute Cx and Cy
             _thermal_force_model->compute_heat_flux_vector(HFx, HFy);//Compute HFx and HFy
 
-            map<int, map<int, double> > m;
-            for (int j = 0; j < Cx.outerSize(); ++j) {
-                for (SpMat::InnerIterator iter(Cx, j); iter; ++iter) {
-                    int i = iter.row(), j = iter.col();
-                    if (m.find(i) != m.end()) {
-                        m[i].insert(make_pair(j, iter.value()));
-                    }
-                    else {
-                        map<int, double> rowmap;
-                        rowmap.insert(make_pair(j, iter.value()));
-                        m.insert(make_pair(i, rowmap));
-                    }
-                }
-            }
-            string fn;
-            FILE *fout;
-            fn = "/home/gaoy/testtpl/Cx" + to_string(i) + ".txt";
-            fout = fopen(fn.c_str(), "w");
-            for (map<int, map<int, double> >::iterator it = m.begin();
-                 it != m.end(); ++it) {
-                for (map<int, double>::iterator iter = it->second.begin();
-                     iter != it->second.end(); ++iter) {
-                    fprintf(fout, "%d, %d = %lf\n", it->first, iter->first, iter->second);
-                }
-            }
-            fclose(fout);
-
-            m.clear();
-            for (int j = 0; j < Cx0.outerSize(); ++j) {
-                for (SpMat::InnerIterator iter(Cx0, j); iter; ++iter) {
-                    int i = iter.row(), j = iter.col();
-                    if (m.find(i) != m.end()) {
-                        m[i].insert(make_pair(j, iter.value()));
-                    }
-                    else {
-                        map<int, double> rowmap;
-                        rowmap.insert(make_pair(j, iter.value()));
-                        m.insert(make_pair(i, rowmap));
-                    }
-                }
-            }
-
-            fn = "/home/gaoy/testtpl/cx0" + to_string(i) + ".txt";
-            fout = fopen(fn.c_str(), "w");
-            for (map<int, map<int, double> >::iterator it = m.begin();
-                 it != m.end(); ++it) {
-                for (map<int, double>::iterator iter = it->second.begin();
-                     iter != it->second.end(); ++iter) {
-                    fprintf(fout, "%d, %d = %lf\n", it->first, iter->first, iter->second);
+            //the x and y systems are independent, the y system is built and solved on another thread
+            bool x_ok = false, y_ok = false;
+            _solve_workers.run(2, [&](size_t t) {
+                if (t == 0) {
+                    rhsx = Cx0*HFx*-1;
+                    x_ok = _x_solver.solve(Cx+Cx0, rhsx, _delta_x);//warm started from the last displacement
+                } else {
+                    rhsy = Cy0*HFy*-1;
+                    y_ok = _y_solver.solve(Cy+Cy0, rhsy, _delta_y);
                 }
+            });
+
+            //an unconverged displacement still lowers the residual, a broken one must not move the modules
+            if (!x_ok) _x_solver.report_failure();
+            if (!y_ok) _y_solver.report_failure();
+            if (!_delta_x.allFinite() || !_delta_y.allFinite()) {
+                _delta_x.setZero();
+                _delta_y.setZero();
             }
-            fclose(fout);
-
-            fn = "/home/gaoy/testtpl/rhsx" + to_string(i) + ".txt";
-            fout = fopen(fn.c_str(), "w");
-            for (int i = 0; i < rhsx.rows(); ++i) {
-                fprintf(fout, "rhsx(%d) = %lf\n", i, rhsx(i));
-            }
-            fclose(fout);
-
-
-            //LLTSolver llt;
-            ConjugateGradient<SpMat, Lower|Upper> solver;
-
-            rhsx = Cx0*HFx*-1;
-            rhsy = Cy0*HFy*-1;
-            VectorXd delta_x = solver.compute(Cx+Cx0).solve(rhsx);
-            VectorXd delta_y = solver.compute(Cy+Cy0).solve(rhsy);
 
-            //!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-            //the following code breaks the incapsulation, but more quickly, please note!!!
-            for (unsigned i=0; i<msize; ++i) {
-                TplDB::db().modules[i].x += delta_x(i);
-                TplDB::db().modules[i].y += delta_y(i);
+            TplDB::db().modules.move_free_modules(_delta_x.data(), _delta_y.data());
+
+            TplTrace &trace = TplTrace::trace();
+            if (trace.sampled(iteration)) {
+                const TplModuleGeometry &g = TplDB::db().modules.geometry();
+                const size_t n = TplDB::db().modules.size();
+                trace.record("Cx", iteration, Cx);
+                trace.record("Cx0", iteration, Cx0);
+                trace.record("rhsx", iteration, rhsx);
+                trace.record("x", iteration, g.x.data(), n);
+                trace.record("y", iteration, g.y.data(), n);
             }
+            ++iteration;
 
-            fn = "/home/gaoy/testtpl/gp" + to_string(i++) + ".txt";
-            fout = fopen(fn.c_str(), "w");
-            for (int i = 0; i < TplDB::db().modules.size(); ++i) {
-                TplModule module = TplDB::db().modules[i];
-                fprintf(fout, "modules[%d] = (%lf, %lf)", i, module.x, module.y);
-            }
-            fclose(fout);
-
-            update_move_force_matrix(delta_x, delta_y, _thermal_force_model->get_mu());//udpate Cx0 and Cy0
+            update_move_force_matrix(_delta_x, _delta_y, _thermal_force_model->get_mu());//udpate Cx0 and Cy0
         }
     }
 
@@ -211,7 +188,7 @@ namespace tpl {
 		string fn = path + "/gp.pl";
 		ofstream fout(fn);
 		fout << "TPL GP 1.0\n";
-		for (TplModules::iterator mit = TplDB::db().modules.begin();
+		for (TplModules::const_iterator mit = TplDB::db().modules.begin();
 			 mit != TplDB::db().modules.end(); mit++) {
 			fout << mit->id << "\t" << mit->x << "\t" << mit->y << endl;
 		}
@@ -237,7 +214,7 @@ namespace tpl {
 
         double avg_power = 0;
         double power;
-        for(TplModules::iterator it=TplDB::db().modules.begin(); it!=TplDB::db().modules.end(); ++it) {
+        for(TplModules::const_iterator it=TplDB::db().modules.begin(); it!=TplDB::db().modules.end(); ++it) {
             power = it->width * it->height * it->power_density;
             avg_power +=  power;
 
@@ -287,117 +264,53 @@ namespace tpl {
 
     bool TplStandardAlgorithm::should_stop_global_placement() const
     {
-       SegmentTree segtree;
-        vector<SegmentEvent> events;
-
-        vector<double> xpos;
-        double x1, x2, y1, y2;
-
-        double total_area = 0;
-
-        for (TplModules::iterator it=TplDB::db().modules.begin(); it!=TplDB::db().modules.end(); ++it) {
-            x1 = it->x;
-            x2 = it->x + it->width;
-            y1 = it->y;
-            y2 = it->y + it->height;
-
-            events.emplace_back(x1, x2, y1, 1);
-            events.emplace_back(x1, x2, y2, -1);
-
-            xpos.push_back(x1);
-            xpos.push_back(x2);
-
-            total_area += it->width * it->height;
-        }
-
-        //set up tree and events
-        segtree.build(xpos);
-        sort(events.begin(), events.end());
-
-        //feed event to the segtree, and get the total unioned area
-        double unioned_area = 0;
-        for (size_t i = 0 ; i < events.size()-1 ; ++i) {
-            segtree.update(events[i]);
-            unioned_area += segtree.get_sum() * (events[i+1].y - events[i].y);
+        if (_stop_criterion == StopCriterion::Overflow) {
+            double overflow = _thermal_force_model->density_overflow(_target_density);
+            cout << "density overflow = " << setprecision(8) << overflow;
+            cout << ", target density = " << _target_density << endl;
+            return overflow < _overflow_stop;
         }
 
-        cout << "unioned area = " << setprecision(8) << unioned_area;
-        cout << ", total area = "    << setprecision(8) << total_area;
-		cout << ", ratio = " << (1-unioned_area/total_area) << endl;
-
         const double STOP = 0.2;
 
-
-        return ( (1- unioned_area/total_area) < STOP );
-    }
-
-	void SegmentTree::build (const vector<double> &xpos) {
-        pos = xpos;
-        sort(pos.begin() , pos.end());
-        pos.erase(unique(pos.begin(), pos.end()), pos.end());
-
-        sum.resize((pos.size() << 2) + 10);
-        cov.resize((pos.size() << 2) + 10);
-    }
-
-	void SegmentTree::push_up(int rt,int l,int r) {
-		if (cov[rt]) {
-			sum[rt] = pos[r+1] - pos[l];
-		} else if (l == r) {
-			sum[rt] = 0;
-		} else {
-			sum[rt] = sum[rt<<1] + sum[rt<<1|1];
-		}
-	}
-
-    void SegmentTree::update(const SegmentEvent &e) {
-
-        int l = search(e.x1);
-        int r = search(e.x2)-1;
-        if (l <= r) {
-            update(l, r, e.f, 1, 0, pos.size()-1);
+        const TplModuleGeometry &g = TplDB::db().modules.geometry();
+        const size_t num_modules = TplDB::db().modules.size();
+
+        if (_overlap_estimate) {
+            double estimate = _overlap.estimated_overlap(g, num_modules, TplDB::db().modules.chip_width(),
+                                                         TplDB::db().modules.chip_height());
+            if (estimate >= STOP) {
+                cout << "estimated unioned area <= " << setprecision(8) << _overlap.estimated_union_area();
+                cout << ", total area = "    << setprecision(8) << _overlap.total_area();
+                cout << ", ratio >= " << estimate << endl;
+                return false;
+            }
         }
-    }
 
-    void SegmentTree::update(int L,int R,int c, int rt, int l,int r) {
-        //l and r for the segtree, and L and R for the event.
-        if (L <= l && r <= R) {
-            cov[rt] += c;
-            push_up(rt , l , r);
-            return ;
-        }
+        double ratio = _overlap.exact_overlap(g, num_modules);
 
-        int m = (l + r) >> 1;
-        if (L <= m)  {
-            update(L , R , c , rt<<1, l, m);
-        }
-        if (m < R) {
-            update(L , R , c , rt<<1|1, m+1, r);
-        }
-        push_up(rt , l , r);
-    }
+        cout << "unioned area = " << setprecision(8) << _overlap.union_area();
+        cout << ", total area = "    << setprecision(8) << _overlap.total_area();
+        cout << ", ratio = " << ratio << endl;
 
-    int SegmentTree::search(double key) {
-        int l = 0 , r = pos.size()-1;
-        while (l <= r) {
-            int m = (l + r) >> 1;
-            if (pos[m] == key) return m;
-            if (pos[m] < key) l = m + 1;
-            else r = m - 1;
-        }
-        return -1;
+        return ratio < STOP;
     }
 
 	void TplStandardAlgorithm::shred() {
-		// list<TplNet> shreddedNets;
 		// find shredded cells of a module through the module id
 		map<Id, vector<TplModule>> macro_cells;
-		list<TplNet> shreddedNets;
+		// ids of all the new cells, pins of shredded nets first refer to cells by their position here
+		vector<Id> cell_ids;
+		vector<TplNet> shreddedNets;
+		// ids of the macros, indexed by module index - num_free
+		vector<Id> macro_ids;
+		const unsigned int num_free = TplDB::db().modules.num_free();
 		unsigned int rowHeight = TplDB::db().modules[0].height;
 		unsigned int colWidth = rowHeight;
 		// iterate over macros
-		for (TplModules::iterator macro_iter = TplDB::db().modules.begin() + TplDB::db().modules.num_free();
+		for (TplModules::const_iterator macro_iter = TplDB::db().modules.begin() + num_free;
 			 macro_iter != TplDB::db().modules.end(); macro_iter++) {
+			macro_ids.push_back(macro_iter->id);
 			int rowNum = (macro_iter->height - 1) / rowHeight + 1;
 			int colNum = (macro_iter->width - 1) / colWidth + 1;
 			//int colNum = 1;
@@ -415,21 +328,18 @@ namespace tpl {
 					double density = 1.0;
 					TplModule cell(id, x, y, width, height, fixed, density);
 					cells.push_back(cell);
+					cell_ids.push_back(id);
 
 					// add new cells to new nets
 					TplPin pin;
-					pin.id = id;
+					pin.module_index = cell_ids.size() - 1;
 					pin.io = IOType::Input;
 					pin.dx = 0;
 					pin.dy = 0;
 					// new net with under cell
 					if (m != 0) {
-						TplModule underCell = cells[cells.size() - 1 - colNum];
-						TplPin underPin;
-						underPin.id = underCell.id;
-						underPin.io = IOType::Input;
-						underPin.dx = 0;
-						underPin.dy = 0;
+						TplPin underPin = pin;
+						underPin.module_index = cell_ids.size() - 1 - colNum;
 						TplNet net;
 						net.id = macro_iter->id + "_row_" + to_string(m * colNum + n);
 						net.degree = 2;
@@ -440,12 +350,8 @@ namespace tpl {
 
 					// new net with left cell
 					if (n != 0) {
-						TplModule frontCell = cells[cells.size() - 2];
-						TplPin frontPin;
-						frontPin.id = frontCell.id;
-						frontPin.io = IOType::Input;
-						frontPin.dx = 0;
-						frontPin.dy = 0;
+						TplPin frontPin = pin;
+						frontPin.module_index = cell_ids.size() - 2;
 						TplNet net;
 						net.id = macro_iter->id + "_col_" + to_string(m * rowNum + n);
 						net.degree = 2;
@@ -461,45 +367,62 @@ namespace tpl {
 		// back up original nets
 		TplDB::db().nets.backup_net();
 
-		// modify original nets
-		for (list<TplNet>::iterator net_iter = TplDB::db().nets.net_begin();
-			 net_iter != TplDB::db().nets.net_end(); net_iter++) {
-
-			// iterate over original pins, exclude pins of new added cells
-			const int len = net_iter->pins.size();
-			// net_iter->pins[p] is pin on a macro, and i is used to control loop times
-			for (int i = 0, p = 0; i < len; i++) {
-				TplModule module = TplDB::db().modules.module(net_iter->pins[p].id);
-				if (!module.fixed) {
-					p++;
+		// delete macros and add shredded cells
+		TplDB::db().modules.add_shredded_cells(macro_cells);
+
+		// now the new cells' indices are known
+		vector<unsigned int> cell_index(cell_ids.size());
+		for (size_t i = 0; i < cell_ids.size(); i++) {
+			cell_index[i] = TplDB::db().modules.module_index(cell_ids[i]);
+		}
+		for (vector<TplNet>::iterator net_iter = shreddedNets.begin();
+			 net_iter != shreddedNets.end(); net_iter++) {
+			for (vector<TplPin>::iterator pin_iter = net_iter->pins.begin();
+				 pin_iter != net_iter->pins.end(); pin_iter++) {
+				pin_iter->module_index = cell_index[pin_iter->module_index];
+			}
+		}
+
+		// modify original nets, pins on a macro are replaced by pins on all its shredded cells
+		vector<TplNet> nets;
+		nets.reserve(TplDB::db().nets.num_nets());
+		for (TplNets::const_net_iterator net_iter = TplDB::db().nets.cnet_begin();
+			 net_iter != TplDB::db().nets.cnet_end(); net_iter++) {
+			nets.emplace_back();
+			TplNet &net = nets.back();
+			net.id = net_iter->id;
+			net.degree = net_iter->degree;
+
+			vector<TplPin> cell_pins;
+			for (TplNets::const_pin_iterator pin_iter = TplDB::db().nets.cpin_begin(net_iter);
+				 pin_iter != TplDB::db().nets.cpin_end(net_iter); pin_iter++) {
+				if (pin_iter->module_index < num_free) {
+					net.pins.push_back(*pin_iter);
 					continue;
 				}
 
 				// if this net contains a macro, then add new shredded cells to this net
-				vector<TplModule> cells = macro_cells[module.id];
-				for (TplModules::iterator cell_iter = cells.begin();
+				const vector<TplModule> &cells = macro_cells[macro_ids[pin_iter->module_index - num_free]];
+				for (vector<TplModule>::const_iterator cell_iter = cells.begin();
 					 cell_iter != cells.end(); cell_iter++) {
 					TplPin pin;
-					pin.id = cell_iter->id;
+					pin.module_index = TplDB::db().modules.module_index(cell_iter->id);
 					pin.io = IOType::Input;
 					pin.dx = 0;
 					pin.dy = 0;
-					net_iter->pins.push_back(pin);
+					cell_pins.push_back(pin);
 				}
-
-				// delete original macro from this net, since next element become i, need to i--
-				net_iter->pins.erase(net_iter->pins.begin() + p);
 			}
+			net.pins.insert(net.pins.end(), cell_pins.begin(), cell_pins.end());
 		}
-
-		// delete macros and add shredded cells
-		TplDB::db().modules.add_shredded_cells(macro_cells);
+		TplDB::db().nets.assign(nets);
 
 		// add new nets between shredded cells
 		TplDB::db().nets.add_net(shreddedNets);
 	}
 
 	void TplStandardAlgorithm::aggregate() {
+		// macros get back their original indices, so the backed up nets are valid again
 		TplDB::db().modules.aggregate_cells();
 		TplDB::db().nets.delete_net();
 	}
@@ -16,11 +16,19 @@
 #include "tpl_standard_net_model.h"
 #include "tpl_standard_net_force_model.h"
 #include "tpl_standard_thermal_force_model.h"
+#include "tpl_linear_solver.h"
+#include "tpl_overlap.h"
 #include "utils.h"
 
 namespace tpl {
     using std::vector;
 
+    //! What the global placement stops on.
+    enum class StopCriterion {
+        Overlap, //!< The modules' overlap ratio, from their rectangles.
+        Overflow //!< The density overflow, from the thermal force model's power density grid.
+    };
+
     //! Standard implementation for tpl algorithm.
     class TplStandardAlgorithm : public TplAbstractAlgorithm {
     public:
@@ -61,6 +69,20 @@ namespace tpl {
     protected:
         void initialize_move_force_matrix();
         void update_move_force_matrix(const VectorXd &delta_x, const VectorXd &delta_y, double mu);
+        //! Whether the placement is spread enough to stop the global placement.
+        /*!
+         * "stop_criterion" in TPLCONFIG is "overlap" (the default) or "overflow", see StopCriterion.
+         *
+         * By overlap, the placement stops when the modules overlap by less than 0.2. With
+         * "overlap_estimate" set (the default), the estimated overlap, a lower bound of the
+         * exact one, is tried first, and while it is above 0.2 the exact overlap is not needed.
+         *
+         * By overflow, the placement stops when the density overflow over "target_density"
+         * (default 1) is less than "overflow_stop" (default 0.1), see
+         * TplStandardThermalForceModel::density_overflow(). Its power density layers are kept up
+         * to date like the heat flux's, so it costs O(bins) plus the moved modules instead of
+         * O(N log N).
+         */
         bool should_stop_global_placement() const;
 		bool should_stop_initial_placement(double &lmd, double &cmd) const;
 
@@ -72,37 +94,18 @@ namespace tpl {
         SpMat Cx,  Cy;
         VectorXd HFx, HFy;
         SpMat Cx0, Cy0;
-    };
-
-    struct SegmentEvent {
-        double x1 , x2, y;
-        int f;
-
-        SegmentEvent(double a, double b, double c, int d) : x1(a) , x2(b) , y(c) , f(d) {}
-
-        bool operator < (const SegmentEvent &cmp) const {
-            return y < cmp.y;
-        }
-    };
-
-    class SegmentTree {
-    public:
-        void build (const vector<double> &xpos);
-
-        void update(const SegmentEvent &e);
-
-        inline double get_sum() { return sum[1]; }
-
-    private:
-        void update(int L,int R,int c, int rt, int l,int r);
 
-        int search(double key);
+        TplLinearSolver _x_solver;      //!< Solver of the x displacement.
+        TplLinearSolver _y_solver;      //!< Solver of the y displacement.
+        VectorXd _delta_x, _delta_y;    //!< Last displacement, the initial guess of the next solve.
+        TplWorkers _solve_workers;      //!< Thread of the y solve, kept from one iteration to the next.
 
-        void push_up(int rt,int l,int r);
+        mutable TplOverlapEngine _overlap; //!< Overlap of the modules, for the stop criterion.
+        bool _overlap_estimate;            //!< Whether to try the estimated overlap before the exact one.
 
-        vector<double> pos;
-        vector<double> sum;
-        vector<int> cov;
+        StopCriterion _stop_criterion; //!< What the global placement stops on.
+        double _target_density;        //!< Bin density the overflow is measured over.
+        double _overflow_stop;         //!< Overflow the global placement stops below.
     };
 
 }//end namespace tpl
@@ -1,20 +1,48 @@
 #include "tpl_standard_net_force_model.h"
+#include "tpl_trace.h"
 
-#ifndef NDEBUG
-#include <iostream>
-#include <ctime>
-#include <fstream>
-#endif
+#include <algorithm>
 
 
 namespace tpl {
 
     using namespace std;
 
-    TplStandardNetForceModel::TplStandardNetForceModel() : TplAbstractNetForceModel(){
+    TplStandardNetForceModel::TplStandardNetForceModel() : TplAbstractNetForceModel(), _x_solver("target x"), _y_solver("target y") {
         lastNetLength = 0;
+
+        TplSolverSettings settings;
+        settings.load();
+        //the x and y systems are solved at the same time, each on half of the threads
+        _x_solver.set_settings(settings.shared(2));
+        _y_solver.set_settings(settings.shared(2));
     }
 
+    namespace {
+
+        //! Whether two sparse matrices have the same compressed nonzero structure.
+        bool same_structure(const SpMat &a, const SpMat &b)
+        {
+            return a.rows() == b.rows() && a.cols() == b.cols() &&
+                   a.isCompressed() && b.isCompressed() &&
+                   a.nonZeros() == b.nonZeros() &&
+                   std::equal(a.outerIndexPtr(), a.outerIndexPtr() + a.outerSize() + 1, b.outerIndexPtr()) &&
+                   std::equal(a.innerIndexPtr(), a.innerIndexPtr() + a.nonZeros(), b.innerIndexPtr());
+        }
+
+        //! The value slot of entry (row, col) in a compressed column major matrix holding it.
+        int find_slot(const SpMat &C, int row, int col)
+        {
+            const int *begin = C.innerIndexPtr() + C.outerIndexPtr()[col];
+            const int *end   = C.innerIndexPtr() + C.outerIndexPtr()[col+1];
+            const int *it    = std::lower_bound(begin, end, row);
+
+            assert(it != end && *it == row);
+            return static_cast<int>(it - C.innerIndexPtr());
+        }
+
+    }//end anonymous namespace
+
     void TplStandardNetForceModel::compute_net_force_matrix(const NetWeight &NWx, const NetWeight &NWy,
                                                             SpMat &Cx, SpMat &Cy, VectorXd &dx, VectorXd &dy)
     {
@@ -26,165 +54,277 @@ namespace tpl {
         assert(dx.rows() == static_cast<int>(TplDB::db().modules.num_free()));
         assert(dy.rows() == static_cast<int>(TplDB::db().modules.num_free()));
 
-        Cx.setZero();
-        Cy.setZero();
-        dx.setZero();
-        dy.setZero();
-
-        //prepare data
-        TplPin *pin1, *pin2;
-        string id1, id2;
-        size_t idx1, idx2;
-        double weight;
-        map<pair<size_t, size_t>, double> nw;
-        vector<SpElem> coefficients;
-
-        //compute Cx and dx
-        for(NetWeight::const_iterator it=NWx.begin(); it!=NWx.end(); ++it) {
-            pin1 = it->first.first;
-            pin2 = it->first.second;
-            id1 = pin1->id;
-            id2 = pin2->id;
-            idx1    = TplDB::db().modules.module_index(id1);
-            idx2    = TplDB::db().modules.module_index(id2);
-            weight = it->second;
-
-            if(!TplDB::db().modules.is_module_fixed(id1) && !TplDB::db().modules.is_module_fixed(id2)) {
-                nw[make_pair(idx1, idx1)] += weight;
-                nw[make_pair(idx2, idx2)] += weight;
-                nw[make_pair(idx1, idx2)] -= weight;
-                nw[make_pair(idx2, idx1)] -= weight;
-
-                dx(idx1) += weight*(pin1->dx - pin2->dx);
-                dx(idx2) += weight*(pin2->dx - pin1->dx);
-            } else if(!TplDB::db().modules.is_module_fixed(id1) && TplDB::db().modules.is_module_fixed(id2)) {
-                nw[make_pair(idx1, idx1)] += weight;
-                dx(idx1) += weight*(pin1->dx - pin2->dx - TplDB::db().modules[idx2].x);
-            } else if(TplDB::db().modules.is_module_fixed(id1) && !TplDB::db().modules.is_module_fixed(id2)) {
-                nw[make_pair(idx2, idx2)] += weight;
-                dx(idx2) += weight*(pin2->dx - pin1->dx - TplDB::db().modules[idx1].x);
-            } else {
-                continue;
-            }
+        //the pattern only depends on the topology, so it holds until the netlist or the modules change
+        const TplModules &modules = TplDB::db().modules;
+        if (TplDB::db().nets.revision() != _pattern_revision ||
+            modules.size() != _pattern_modules || modules.num_free() != _pattern_free) {
+            build_pattern();
         }
 
-        for(map<pair<size_t, size_t>, double>::iterator it=nw.begin(); it!=nw.end(); ++it) {
-            coefficients.push_back( SpElem(it->first.first, it->first.second, it->second) );
-        }
-        Cx.setFromTriplets(coefficients.begin(), coefficients.end());
-
-        //clear temp container
-        nw.clear();
-        coefficients.clear();
-
-        //compute Cy and dy
-        for(NetWeight::const_iterator it=NWy.begin(); it!=NWy.end(); ++it) {
-            pin1 = it->first.first;
-            pin2 = it->first.second;
-            id1 = pin1->id;
-            id2 = pin2->id;
-            idx1    = TplDB::db().modules.module_index(id1);
-            idx2    = TplDB::db().modules.module_index(id2);
-            weight = it->second;
-
-            if(!TplDB::db().modules.is_module_fixed(id1) && !TplDB::db().modules.is_module_fixed(id2)) {
-                nw[make_pair(idx1, idx1)] += weight;
-                nw[make_pair(idx2, idx2)] += weight;
-                nw[make_pair(idx1, idx2)] -= weight;
-                nw[make_pair(idx2, idx1)] -= weight;
-
-                dy(idx1) += weight*(pin1->dy - pin2->dy);
-                dy(idx2) += weight*(pin2->dy - pin1->dy);
-            } else if(!TplDB::db().modules.is_module_fixed(id1) && TplDB::db().modules.is_module_fixed(id2)) {
-                nw[make_pair(idx1, idx1)] += weight;
-                dy(idx1) += weight*(pin1->dy - pin2->dy - TplDB::db().modules[idx2].y);
-            } else if(TplDB::db().modules.is_module_fixed(id1) && !TplDB::db().modules.is_module_fixed(id2)) {
-                nw[make_pair(idx2, idx2)] += weight;
-                dy(idx2) += weight*(pin2->dy - pin1->dy - TplDB::db().modules[idx1].y);
-            } else {
-                continue;
-            }
-        }
+        accumulate(NWx, true,  _x_assembly, dx);
+        accumulate(NWy, false, _y_assembly, dy);
+        update_pattern();
 
-        for(map<pair<size_t, size_t>, double>::iterator it=nw.begin(); it!=nw.end(); ++it) {
-            coefficients.push_back( SpElem(it->first.first, it->first.second, it->second) );
-        }
-        Cy.setFromTriplets(coefficients.begin(), coefficients.end());
+        //C is reallocated only when the pattern changed
+        if (!same_structure(Cx, _pattern)) Cx = _pattern;
+        if (!same_structure(Cy, _pattern)) Cy = _pattern;
+        write_values(_x_assembly, Cx);
+        write_values(_y_assembly, Cy);
     }
 
-
-    void TplStandardNetForceModel::compute_net_force_target(const NetWeight &NWx, const NetWeight &NWy,
-                                                            std::vector<double> &x_target, std::vector<double> &y_target)
+    void TplStandardNetForceModel::build_pattern()
     {
-        //preconditions
-//        x_target.clear();
-//        y_target.clear();
-        unsigned int num_free = TplDB::db().modules.num_free();
-        x_target.resize(num_free, 0);
-        y_target.resize(num_free, 0);
+        const TplModules        &modules  = TplDB::db().modules;
+        const TplNets           &nets     = TplDB::db().nets;
+        const TplModuleGeometry &geometry = modules.geometry();
+        const int num_free = modules.num_free();
+
+        vector<SpElem> entries;
+        entries.reserve(num_free + 2*nets.num_pins());
+        for (int i=0; i<num_free; ++i) {
+            entries.push_back( SpElem(i, i, 0) );
+        }
 
-        SpMat Cx(num_free, num_free), Cy(num_free, num_free);
-        Cx.setZero();
-        Cy.setZero();
+        _pin_net.resize(nets.num_pins());
+        _pin_local.resize(nets.num_pins());
+        _net_free_pins.assign(nets.num_nets(), 0);
+        _net_block.assign(nets.num_nets(), -1);
+
+        //the free modules of every net, in the order of its free pins
+        vector<int> free_modules, free_offsets(1, 0);
+        int num_block_slots = 0;
+        size_t n = 0, p = 0;
+        for (TplNets::const_net_iterator nit=nets.cnet_begin(); nit!=nets.cnet_end(); ++nit, ++n) {
+            const size_t first = free_modules.size();
+            for (TplNets::const_pin_iterator pit=nets.cpin_begin(nit); pit!=nets.cpin_end(nit); ++pit, ++p) {
+                _pin_net[p]   = n;
+                _pin_local[p] = -1;
+                if (!geometry.fixed[pit->module_index]) {
+                    _pin_local[p] = free_modules.size() - first;
+                    free_modules.push_back(pit->module_index);
+                }
+            }
+            free_offsets.push_back(free_modules.size());
 
-        VectorXd dx(num_free), dy(num_free);
-        dx.setZero();
-        dy.setZero();
+            const int f = free_modules.size() - first;
+            _net_free_pins[n] = f;
 
-        compute_net_force_matrix(NWx, NWy, Cx, Cy, dx, dy);
+            //shred() replaces a macro's pin by pins on all its cells and keeps the degree, count the pins
+            if (nit->pins.size() > PATTERN_CLIQUE_DEGREE) continue;
+
+            _net_block[n] = num_block_slots;
+            num_block_slots += f * f;
+            for (size_t i=first; i<free_modules.size(); ++i) {
+                for (size_t j=i+1; j<free_modules.size(); ++j) {
+                    entries.push_back( SpElem(free_modules[i], free_modules[j], 0) );
+                    entries.push_back( SpElem(free_modules[j], free_modules[i], 0) );
+                }
+            }
+        }
 
+        //setFromTriplets merges duplicates and keeps the explicit zeros, in compressed form
+        _clique_pattern = SpMat(num_free, num_free);
+        _clique_pattern.setFromTriplets(entries.begin(), entries.end());
 
-        map<int, map<int, double> > m;
-        for (int j = 0; j < Cx.outerSize(); ++j) {
-            for (SpMat::InnerIterator iter(Cx, j); iter; ++iter) {
-                int i = iter.row(), j = iter.col();
-                if (m.find(i) != m.end()) {
-                    m[i].insert(make_pair(j, iter.value()));
+        _diagonal_slot.resize(num_free);
+        for (int i=0; i<num_free; ++i) {
+            _diagonal_slot[i] = find_slot(_clique_pattern, i, i);
+        }
+
+        //two pins of a net on the same module tie it to itself, on its diagonal
+        _block_slot.resize(num_block_slots);
+        for (n=0; n<_net_block.size(); ++n) {
+            if (_net_block[n] < 0) continue;
+
+            const int *fm = free_modules.data() + free_offsets[n];
+            const int f = _net_free_pins[n];
+            for (int a=0; a<f; ++a) {
+                for (int b=0; b<f; ++b) {
+                    _block_slot[_net_block[n] + a*f + b] = fm[a] == fm[b] ? _diagonal_slot[fm[a]]
+                                                                          : find_slot(_clique_pattern, fm[a], fm[b]);
                 }
-                else {
-                    map<int, double> rowmap;
-                    rowmap.insert(make_pair(j, iter.value()));
-                    m.insert(make_pair(i, rowmap));
+            }
+        }
+
+        _pattern = _clique_pattern;
+        _slot.resize(_clique_pattern.nonZeros());
+        for (size_t s=0; s<_slot.size(); ++s) _slot[s] = s;
+        _large_edges.clear();
+        _large_slot.clear();
+
+        _pattern_revision = nets.revision();
+        _pattern_modules  = modules.size();
+        _pattern_free     = modules.num_free();
+    }
+
+    void TplStandardNetForceModel::accumulate(const NetWeight &NW, bool horizontal, Assembly &assembly, VectorXd &d)
+    {
+        const TplNets           &nets     = TplDB::db().nets;
+        const TplModuleGeometry &geometry = TplDB::db().modules.geometry();
+        const double *position = horizontal ? geometry.x.data() : geometry.y.data();
+
+        VectorXd &values = assembly.clique_values;
+        values.setZero(_clique_pattern.nonZeros());
+        assembly.large.clear();
+        d.setZero();
+
+        for (size_t k=0; k<NW.size(); ++k) {
+            const TplPin &pin1 = nets.pin(NW.pin1[k]);
+            const TplPin &pin2 = nets.pin(NW.pin2[k]);
+            const int idx1     = pin1.module_index;
+            const int idx2     = pin2.module_index;
+            const bool fixed1  = geometry.fixed[idx1];
+            const bool fixed2  = geometry.fixed[idx2];
+            const double weight = NW.weight[k];
+            const double offset = horizontal ? pin1.dx - pin2.dx : pin1.dy - pin2.dy;
+            assert(fixed1 || idx1 < _clique_pattern.rows());
+            assert(fixed2 || idx2 < _clique_pattern.rows());
+
+            if(!fixed1 && !fixed2) {
+                values(_diagonal_slot[idx1]) += weight;
+                values(_diagonal_slot[idx2]) += weight;
+
+                const int net   = _pin_net[NW.pin1[k]];
+                const int block = _net_block[net];
+                if (block >= 0) {
+                    const int f = _net_free_pins[net];
+                    const int a = _pin_local[NW.pin1[k]];
+                    const int b = _pin_local[NW.pin2[k]];
+                    values(_block_slot[block + a*f + b]) -= weight;
+                    values(_block_slot[block + b*f + a]) -= weight;
+                } else if (idx1 != idx2) {
+                    assembly.large.push_back({idx2, idx1, -weight});
+                    assembly.large.push_back({idx1, idx2, -weight});
+                } else {
+                    values(_diagonal_slot[idx1]) -= 2*weight;
                 }
+
+                d(idx1) += weight*offset;
+                d(idx2) -= weight*offset;
+            } else if(!fixed1 && fixed2) {
+                values(_diagonal_slot[idx1]) += weight;
+                d(idx1) += weight*(offset - position[idx2]);
+            } else if(fixed1 && !fixed2) {
+                values(_diagonal_slot[idx2]) += weight;
+                d(idx2) += weight*(-offset - position[idx1]);
             }
         }
 
+        std::sort(assembly.large.begin(), assembly.large.end(), [](const LargeEntry &a, const LargeEntry &b) {
+            return a.col < b.col || (a.col == b.col && a.row < b.row);
+        });
+    }
 
-        ofstream fout;
-        fout.open("/home/gaoy/testtpl/Cx_row.txt", ofstream::out);
-        for (map<int, map<int, double> >::iterator it = m.begin();
-                it != m.end(); ++it) {
-            for (map<int, double>::iterator iter = it->second.begin();
-                    iter != it->second.end(); ++iter) {
-                fout << it->first << ", " << iter->first << " = " << iter->second << endl;
+    void TplStandardNetForceModel::update_pattern()
+    {
+        _next_edges.clear();
+        for (const Assembly *assembly : {&_x_assembly, &_y_assembly}) {
+            for (const LargeEntry &entry : assembly->large) _next_edges.emplace_back(entry.col, entry.row);
+        }
+        std::sort(_next_edges.begin(), _next_edges.end());
+        _next_edges.erase(std::unique(_next_edges.begin(), _next_edges.end()), _next_edges.end());
+
+        if (_next_edges == _large_edges) return;
+        _large_edges.swap(_next_edges);
+
+        //merge the large net entries into the clique pattern column by column, an entry of both taking one slot
+        const int num_cols = _clique_pattern.cols();
+        const int *clique_outer = _clique_pattern.outerIndexPtr();
+        const int *clique_inner = _clique_pattern.innerIndexPtr();
+
+        _pattern = SpMat(num_cols, num_cols);
+        _pattern.resizeNonZeros(_clique_pattern.nonZeros() + _large_edges.size());
+        int *outer = _pattern.outerIndexPtr();
+        int *inner = _pattern.innerIndexPtr();
+        _large_slot.resize(_large_edges.size());
+
+        int nnz = 0;
+        size_t e = 0;
+        for (int col=0; col<num_cols; ++col) {
+            outer[col] = nnz;
+            int s = clique_outer[col];
+            for (;;) {
+                const bool clique = s < clique_outer[col+1];
+                const bool large  = e < _large_edges.size() && _large_edges[e].first == col;
+                if (!clique && !large) break;
+
+                const int row = !large ? clique_inner[s] :
+                                !clique ? _large_edges[e].second : std::min(clique_inner[s], _large_edges[e].second);
+                if (clique && clique_inner[s] == row)        _slot[s++] = nnz;
+                if (large  && _large_edges[e].second == row) _large_slot[e++] = nnz;
+                inner[nnz++] = row;
             }
         }
-        fout.close();
+        outer[num_cols] = nnz;
+        _pattern.resizeNonZeros(nnz);
+        std::fill(_pattern.valuePtr(), _pattern.valuePtr() + nnz, 0.0);
+    }
 
-        fout.open("/home/gaoy/testtpl/d.txt", ofstream::out);
-        for (int i = 0; i < dx.rows(); ++i) {
-            fout << i << " = " << dx(i) << endl;
+    void TplStandardNetForceModel::write_values(const Assembly &assembly, SpMat &C) const
+    {
+        double *values = C.valuePtr();
+        for (int slot : _large_slot) values[slot] = 0;
+        for (size_t s=0; s<_slot.size(); ++s) values[_slot[s]] = assembly.clique_values(s);
+
+        //both are sorted, and the pattern holds every large net entry of the assembly
+        size_t e = 0;
+        for (const LargeEntry &entry : assembly.large) {
+            while (_large_edges[e] != std::make_pair(entry.col, entry.row)) ++e;
+            values[_large_slot[e]] += entry.weight;
         }
-        fout.close();
+    }
 
 
+    void TplStandardNetForceModel::compute_net_force_target(const NetWeight &NWx, const NetWeight &NWy,
+                                                            std::vector<double> &x_target, std::vector<double> &y_target)
+    {
+        //preconditions
+//        x_target.clear();
+//        y_target.clear();
+        unsigned int num_free = TplDB::db().modules.num_free();
+        x_target.resize(num_free, 0);
+        y_target.resize(num_free, 0);
 
-        //LLTSolver solver;
-		Eigen::ConjugateGradient<SpMat, Eigen::Lower|Eigen::Upper> solver;
+        //the matrices are kept from one call to the next, so their pattern is reused
+        SpMat &Cx = _target_Cx, &Cy = _target_Cy;
+        VectorXd &dx = _target_dx, &dy = _target_dy;
+        if (Cx.rows() != static_cast<int>(num_free)) {
+            Cx = SpMat(num_free, num_free);
+            Cy = SpMat(num_free, num_free);
+        }
+        dx.resize(num_free);
+        dy.resize(num_free);
 
+        compute_net_force_matrix(NWx, NWy, Cx, Cy, dx, dy);
 
-        VectorXd x_eigen_target = solver.compute(Cx).solve(dx*-1);
-		VectorXd y_eigen_target = solver.compute(Cy).solve(dy*-1);
 
-        fout.open("/home/gaoy/testtpl/target_nz.txt", ofstream::out);
-        for (int i = 0; i < x_eigen_target.size(); ++i) {
-            if (fabs(x_eigen_target(i)) > 0.001) {
-                fout << i << " = " << x_eigen_target(i) << endl;
-            }
+        //start from the current positions of the free modules
+        const TplModuleGeometry &geometry = TplDB::db().modules.geometry();
+        VectorXd x_eigen_target = VectorXd::Map(geometry.x.data(), num_free);
+        VectorXd y_eigen_target = VectorXd::Map(geometry.y.data(), num_free);
+
+        //the x and y systems are independent, the y system is solved on another thread
+        bool x_ok = false, y_ok = false;
+        _solve_workers.run(2, [&](size_t t) {
+            if (t == 0) x_ok = _x_solver.solve(Cx, dx*-1, x_eigen_target);
+            else        y_ok = _y_solver.solve(Cy, dy*-1, y_eigen_target);
+        });
+
+        //an unconverged target is still closer to the optimum, a broken one keeps the modules in place
+        if (!x_ok) _x_solver.report_failure();
+        if (!y_ok) _y_solver.report_failure();
+        if (!x_eigen_target.allFinite() || !y_eigen_target.allFinite()) {
+            x_eigen_target = VectorXd::Map(geometry.x.data(), num_free);
+            y_eigen_target = VectorXd::Map(geometry.y.data(), num_free);
         }
-        fout.close();
-
 
+        TplTrace &trace = TplTrace::trace();
+        if (trace.sampled(_target_count)) {
+            trace.record("net Cx", _target_count, Cx);
+            trace.record("net dx", _target_count, dx);
+            trace.record("net x target", _target_count, x_eigen_target);
+        }
+        ++_target_count;
 
         assert(static_cast<long>(x_target.size()) == x_eigen_target.size() );
         assert(static_cast<long>(y_target.size()) == y_eigen_target.size() );
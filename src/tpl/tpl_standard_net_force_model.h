@@ -8,6 +8,11 @@
 #define TPL_STANDARD_NET_FORCE_MODEL_H
 
 #include "tpl_abstract_net_force_model.h"
+#include "tpl_linear_solver.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
 
 namespace tpl {
 
@@ -43,7 +48,85 @@ namespace tpl {
         virtual void compute_net_force_target(const NetWeight &NWx, const NetWeight &NWy,
                                               std::vector<double> &x_target, std::vector<double> &y_target);
 
+        //! The sparsity pattern shared by Cx and Cy, as of the last compute_net_force_matrix().
+        const SpMat &pattern() const { return _pattern; }
+
         double lastNetLength;
+
+    private:
+        //! Entry of a large net's connection, found in the net weights of one direction.
+        struct LargeEntry {
+            int col;       //!< Column of the entry.
+            int row;       //!< Row of the entry.
+            double weight; //!< Value added to the entry.
+        };
+
+        //! One direction's values, summed up before they are written on the pattern.
+        struct Assembly {
+            VectorXd clique_values;         //!< Values of the clique pattern's entries.
+            std::vector<LargeEntry> large;  //!< Off diagonal entries of the large nets.
+        };
+
+        //! Build the clique pattern and its slot tables from the netlist topology.
+        /*!
+         * Every free module gets a diagonal entry, and every pair of free modules sharing a net
+         * of at most PATTERN_CLIQUE_DEGREE pins gets its two off diagonal entries. The slot of
+         * every pair of free pins of such a net is looked up once here, so the assembly adds
+         * to the values without searching them.
+         */
+        void build_pattern();
+
+        //! Sum up one direction's net weights into assembly and d.
+        /*!
+         * \param NW Net weight in the direction.
+         * \param horizontal true for the x direction, false for the y direction.
+         * \param assembly The direction's clique values and large net entries.
+         * \param d  VectorXd storing the net force vector.
+         */
+        void accumulate(const NetWeight &NW, bool horizontal, Assembly &assembly, VectorXd &d);
+
+        //! Make the pattern the clique pattern plus the large net entries of both directions.
+        /*!
+         * The large nets' connections follow their boundary pins, so their entries are taken
+         * from the current net weights only. The pattern is rebuilt when they change, and never
+         * keeps the entries of earlier placements.
+         */
+        void update_pattern();
+
+        //! Write one direction's assembly on the pattern's values of C.
+        void write_values(const Assembly &assembly, SpMat &C) const;
+
+        //! Nets with more pins than this are not expanded into cliques by build_pattern().
+        static const unsigned int PATTERN_CLIQUE_DEGREE = 16;
+
+        SpMat _pattern;                       //!< Column major sparsity pattern shared by Cx and Cy, with zero values.
+        SpMat _clique_pattern;                //!< The diagonal and the small nets' cliques.
+        std::uint64_t _pattern_revision = 0;  //!< Netlist revision the clique pattern was built for.
+        unsigned int  _pattern_modules  = 0;  //!< Number of modules the clique pattern was built for.
+        unsigned int  _pattern_free     = 0;  //!< Number of free modules the clique pattern was built for.
+
+        std::vector<int> _pin_net;            //!< Net of every pin.
+        std::vector<int> _pin_local;          //!< Index of every free pin among its net's free pins, -1 for a fixed one.
+        std::vector<int> _net_free_pins;      //!< Number of free pins of every net.
+        std::vector<int> _net_block;          //!< First slot of every small net in _block_slot, -1 for a large net.
+        std::vector<int> _block_slot;         //!< Clique pattern slot of every pair of free pins of a small net, row major.
+        std::vector<int> _diagonal_slot;      //!< Clique pattern slot of every diagonal entry.
+        std::vector<int> _slot;               //!< Pattern slot of every clique pattern slot.
+
+        std::vector<std::pair<int, int>> _large_edges; //!< Column and row of the large net entries in the pattern, sorted.
+        std::vector<int> _large_slot;                  //!< Pattern slot of every large net entry.
+        std::vector<std::pair<int, int>> _next_edges;  //!< Large net entries of the current net weights, sorted.
+
+        Assembly _x_assembly;                 //!< Values of the x direction.
+        Assembly _y_assembly;                 //!< Values of the y direction.
+
+        TplLinearSolver _x_solver;                //!< Solver of the x target positions.
+        TplLinearSolver _y_solver;                //!< Solver of the y target positions.
+        TplWorkers      _solve_workers;           //!< Thread of the y solve, kept from one call to the next.
+        SpMat    _target_Cx, _target_Cy;          //!< Net force matrices of compute_net_force_target().
+        VectorXd _target_dx, _target_dy;          //!< Net force vectors of compute_net_force_target().
+
+        int _target_count = 0;                    //!< Calls of compute_net_force_target(), the trace's iteration.
     };
 
 }//namespace tpl
@@ -1,6 +1,12 @@
 #include "tpl_standard_net_model.h"
 
 #include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <thread>
+#include <atomic>
+
+#include <boost/property_tree/json_parser.hpp>
 
 #include <cassert>
 #ifndef NDEBUG
@@ -11,24 +17,130 @@ namespace tpl {
 
     using std::vector;
 	using std::sort;
-    using std::make_pair;
+
+    TplStandardNetModel::TplStandardNetModel() : TplAbstractNetModel(), _num_threads(1), _partition_revision(0), _partition_chunks(0)
+    {
+        set_num_threads(0);
+        initialize_model();
+    }
+
+    bool TplStandardNetModel::initialize_model()
+    {
+        try {
+            namespace pt = boost::property_tree;
+            const char *config = getenv("TPLCONFIG");
+            if (config == nullptr) return false;
+
+            pt::ptree tree;
+            pt::read_json(config, tree);
+
+            set_num_threads(tree.get<unsigned int>("num_threads", 0));
+
+            return true;
+        } catch(...) {
+            return false;
+        }
+    }
+
+    void TplStandardNetModel::set_num_threads(unsigned int num_threads)
+    {
+        if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+        _num_threads = num_threads;
+    }
+
+    void TplStandardNetModel::partition_nets(size_t num_chunks)
+    {
+        const TplNets &nets = TplDB::db().nets;
+
+        //the cost only depends on the degrees, so a partition holds until the netlist changes
+        if (nets.revision() == _partition_revision && num_chunks == _partition_chunks) return;
+        _partition_revision = nets.revision();
+        _partition_chunks   = num_chunks;
+
+        //sorting a net of degree d costs about d*log2(d), and everything else is linear in d
+        vector<double> cost(nets.num_nets());
+        double total_cost = 0;
+        size_t n = 0;
+        for (TplNets::const_net_iterator nit=nets.cnet_begin(); nit!=nets.cnet_end(); ++nit, ++n) {
+            const double degree = nit->pins.size();
+            cost[n] = degree < 2 ? 1 : degree * (1 + std::log2(degree));
+            total_cost += cost[n];
+        }
+
+        //a net costing more than a chunk, like a clock net, gets a chunk on its own
+        _chunk_first.assign(1, 0);
+        const double chunk_cost = total_cost / num_chunks;
+        double acc = 0;
+        for (size_t i=0; i<cost.size(); ++i) {
+            if (acc > 0 && acc + cost[i] > chunk_cost) {
+                _chunk_first.push_back(i);
+                acc = 0;
+            }
+            acc += cost[i];
+        }
+        _chunk_first.push_back(cost.size());
+
+        const size_t chunks = _chunk_first.size() - 1;
+        _chunk_NWx.resize(chunks);
+        _chunk_NWy.resize(chunks);
+    }
 
     void TplStandardNetModel::compute_net_weight(NetWeight &NWx, NetWeight &NWy)
 	{
+		const TplNets &nets = TplDB::db().nets;
+
 		//preconditions
 		NWx.clear();
 		NWy.clear();
 
-//		vector<TplPin*> xpins;
-//		vector<TplPin*> ypins;
+		//a net of degree d has at most 2*(d-2) connections in each direction
+		NWx.reserve(2*nets.num_pins());
+		NWy.reserve(2*nets.num_pins());
+
+		if (_num_threads <= 1) {
+			vector<PinPos> xpins, ypins;
+			compute_net_weight(0, nets.num_nets(), NWx, NWy, xpins, ypins);
+			return;
+		}
+
+		/////////////////////////////////////////////////////////////////////
+		//several chunks per thread, so that threads finishing early take over the rest
+		partition_nets(4 * _num_threads);
+		const size_t num_chunks = _chunk_first.size() - 1;
+
+		std::atomic<size_t> next_chunk(0);
+		_workers.run(std::min<size_t>(_num_threads, num_chunks), [&](size_t) {
+			vector<PinPos> xpins, ypins;
+			for (size_t c = next_chunk++; c < num_chunks; c = next_chunk++) {
+				_chunk_NWx[c].clear();
+				_chunk_NWy[c].clear();
+				compute_net_weight(_chunk_first[c], _chunk_first[c+1], _chunk_NWx[c], _chunk_NWy[c], xpins, ypins);
+			}
+		});
+		/////////////////////////////////////////////////////////////////////
+
+		//merging in chunk order gives the same result as the sequential pass
+		for (size_t c=0; c<num_chunks; ++c) {
+			NWx.pin1  .insert(NWx.pin1  .end(), _chunk_NWx[c].pin1  .begin(), _chunk_NWx[c].pin1  .end());
+			NWx.pin2  .insert(NWx.pin2  .end(), _chunk_NWx[c].pin2  .begin(), _chunk_NWx[c].pin2  .end());
+			NWx.weight.insert(NWx.weight.end(), _chunk_NWx[c].weight.begin(), _chunk_NWx[c].weight.end());
+			NWy.pin1  .insert(NWy.pin1  .end(), _chunk_NWy[c].pin1  .begin(), _chunk_NWy[c].pin1  .end());
+			NWy.pin2  .insert(NWy.pin2  .end(), _chunk_NWy[c].pin2  .begin(), _chunk_NWy[c].pin2  .end());
+			NWy.weight.insert(NWy.weight.end(), _chunk_NWy[c].weight.begin(), _chunk_NWy[c].weight.end());
+		}
+	}
+
+    void TplStandardNetModel::compute_net_weight(size_t first, size_t last, NetWeight &NWx, NetWeight &NWy,
+                                                 vector<PinPos> &xpins, vector<PinPos> &ypins) const
+	{
+		const TplNets &nets = TplDB::db().nets;
+		const TplModuleGeometry &g = TplDB::db().modules.geometry();
 
-		vector<PinPos> xpins;
-		vector<PinPos> ypins;
 		size_t degree = 0;
 
 		const double DELTA = 0.001;
 
-		for (TplNets::net_iterator nit=TplDB::db().nets.net_begin(); nit!=TplDB::db().nets.net_end(); ++nit) {
+		for (TplNets::const_net_iterator nit=nets.cnet_begin()+first; nit!=nets.cnet_begin()+last; ++nit) {
 			degree = nit->pins.size();
 			if ( degree < 2 ) continue;
 
@@ -37,11 +149,12 @@ namespace tpl {
 
 			/////////////////////////////////////////////////////////////////////
 			//get the current net's pins, and sort them by x and y separately
-			for (TplNets::pin_iterator pit = TplDB::db().nets.pin_begin(nit);
-				 pit != TplDB::db().nets.pin_end(nit); ++pit) {
-				TplModule &module = TplDB::db().modules.module(pit->id);
-				xpins.emplace_back(&(*pit), module.x + module.width /2.0 + pit->dx);
-				ypins.emplace_back(&(*pit), module.y + module.height/2.0 + pit->dy);
+			const unsigned int first_pin = nets.pin_index(nets.cpin_begin(nit));
+			for (unsigned int k=first_pin; k<first_pin+degree; ++k) {
+				const TplPin &pin = nets.pin(k);
+				const unsigned int m = pin.module_index;
+				xpins.emplace_back(k, g.x[m] + g.width [m]/2.0 + pin.dx);
+				ypins.emplace_back(k, g.y[m] + g.height[m]/2.0 + pin.dy);
 			}
 
 			assert(xpins.size() == degree);
@@ -53,37 +166,35 @@ namespace tpl {
 
 			/////////////////////////////////////////////////////////////////////
 			//compute the net weight by B2B net model, ignore the pin on the boundary
-			double x1 = xpins[0].pos;
-			double x2 = xpins[degree-1].pos;
+			const double x1 = xpins[0].pos;
+			const double x2 = xpins[degree-1].pos;
 
-			double y1 = ypins[0].pos;
-			double y2 = ypins[degree-1].pos;
+			const double y1 = ypins[0].pos;
+			const double y2 = ypins[degree-1].pos;
+
+			const double w = 2.0 / (degree - 1);
 
 			for (size_t i=1; i<degree-1; ++i) {
 				//process by x
-				double &x = xpins[i].pos;
+				const double x = xpins[i].pos;
 
 				if (fabs(x-x1) > DELTA) {
-					assert( NWx.count(make_pair(xpins[0].pin, xpins[i].pin)) == 0 );
-					NWx[make_pair(xpins[0].pin, xpins[i].pin)] = 2.0 / (degree - 1) / (fabs(x-x1));
+					NWx.push_back(xpins[0].pin, xpins[i].pin, w / fabs(x-x1));
 				}
 
 				if (fabs(x-x2) > DELTA) {
-					assert( NWx.count(make_pair(xpins[degree-1].pin, xpins[i].pin)) == 0 );
-					NWx[make_pair(xpins[degree-1].pin, xpins[i].pin)] = 2.0 / (degree - 1) / (fabs(x-x2));
+					NWx.push_back(xpins[degree-1].pin, xpins[i].pin, w / fabs(x-x2));
 				}
 
 				//process pins by y
-				double &y = ypins[i].pos;
+				const double y = ypins[i].pos;
 
 				if (fabs(y-y1) > DELTA) {
-					assert( NWy.count(make_pair(ypins[0].pin, ypins[i].pin)) == 0 );
-					NWy[make_pair(ypins[0].pin, ypins[i].pin)] = 2.0 / (degree - 1) / (fabs(y-y1));
+					NWy.push_back(ypins[0].pin, ypins[i].pin, w / fabs(y-y1));
 				}
 
 				if (fabs(y-y2) > DELTA) {
-					assert( NWy.count(make_pair(ypins[degree-1].pin, ypins[i].pin)) == 0 );
-					NWy[make_pair(ypins[degree-1].pin, ypins[i].pin)] = 2.0 / (degree - 1) / (fabs(y-y2));
+					NWy.push_back(ypins[degree-1].pin, ypins[i].pin, w / fabs(y-y2));
 				}
 			}
 
@@ -104,28 +215,27 @@ namespace tpl {
 		}
 //		int i = 0;
 		double DELTA = 0.00001;
-        TplNets::net_iterator net_iter = TplDB::db().nets.net_begin();
-        advance(net_iter, TplDB::db().nets.num_origin_nets());
-        for (; net_iter != TplDB::db().nets.net_end(); net_iter++) {
-			TplPin pin1 = net_iter->pins[0];
-			TplPin pin2 = net_iter->pins[1];
-			TplModule module1 = TplDB::db().modules.module(pin1.id);
-			TplModule module2 = TplDB::db().modules.module(pin2.id);
+		const TplModules &modules = TplDB::db().modules;
+		TplNets &nets = TplDB::db().nets;
+        TplNets::net_iterator net_iter = nets.net_begin();
+        net_iter += nets.num_origin_nets();
+        for (; net_iter != nets.net_end(); net_iter++) {
+			unsigned int pin1 = nets.pin_index(nets.pin_begin(net_iter));
+			unsigned int pin2 = pin1 + 1;
+			const TplModule &module1 = modules[nets.pin(pin1).module_index];
+			const TplModule &module2 = modules[nets.pin(pin2).module_index];
 			if ((module1.x - module2.x) > DELTA) {
-				NWx[make_pair(&pin1, &pin2)] = multiply * 2.0 / (module1.x - module2.x);
+				NWx.push_back(pin1, pin2, multiply * 2.0 / (module1.x - module2.x));
 			}
 			if ((module1.y - module2.y > DELTA)) {
-				NWy[make_pair(&pin1, &pin2)] = multiply * 2.0 / (module1.y - module2.y);
+				NWy.push_back(pin1, pin2, multiply * 2.0 / (module1.y - module2.y));
 			}
 		}
     }
 
 	bool compare_pin(const PinPos &lhs, const PinPos &rhs)
 	{
-		const TplModule & m1 = TplDB::db().modules.module(lhs.pin->id);
-		const TplModule & m2 = TplDB::db().modules.module(rhs.pin->id);
-
-		return ( (m1.x + m1.width/2.0 + lhs.pin->dx) < (m2.x + m2.width/2.0 + rhs.pin->dx) );
+		return lhs.pos < rhs.pos;
 	}
 
 }//namespace tpl
@@ -8,13 +8,25 @@
 #define TPL_STANDARD_NET_MODEL_H
 
 #include "tpl_abstract_net_model.h"
+#include "tpl_workers.h"
+
+#include <vector>
 
 namespace tpl {
 
+    struct PinPos;
+
     class TplStandardNetModel : public TplAbstractNetModel {
     public:
         //! Default constructor.
-        TplStandardNetModel() : TplAbstractNetModel() {}
+        TplStandardNetModel();
+
+        //! Read the algorithm parameters from the TPLCONFIG json file.
+        /*!
+         * "num_threads" is the number of threads computing the net weight, 0 or missing for
+         * one per hardware thread.
+         */
+        bool initialize_model();
 
         //! Virtual destructor.
         virtual ~TplStandardNetModel() {}
@@ -29,12 +41,41 @@ namespace tpl {
 
         //! Standard implementation for update_shred_net_weight
         virtual void update_shred_net_weight(NetWeight &NWx, NetWeight &NWy, int i);
+
+        //! Number of threads computing the net weight.
+        unsigned int num_threads() const
+        {
+            return _num_threads;
+        }
+        //! Set the number of threads computing the net weight, 0 for one per hardware thread.
+        void set_num_threads(unsigned int num_threads);
+
+    private:
+        //! Compute the net weight of the nets [first, last), appending to NWx and NWy.
+        void compute_net_weight(size_t first, size_t last, NetWeight &NWx, NetWeight &NWy,
+                                std::vector<PinPos> &xpins, std::vector<PinPos> &ypins) const;
+
+        //! Cut the nets into num_chunks contiguous chunks of about the same sorting cost.
+        /*!
+         * The partition is kept until the netlist revision or num_chunks changes.
+         */
+        void partition_nets(size_t num_chunks);
+
+        unsigned int _num_threads; //!< Number of threads computing the net weight.
+
+        std::vector<size_t>    _chunk_first; //!< Index of every chunk's first net, and the number of nets.
+        std::vector<NetWeight> _chunk_NWx;   //!< Every chunk's x net weight, merged in chunk order.
+        std::vector<NetWeight> _chunk_NWy;   //!< Every chunk's y net weight, merged in chunk order.
+        std::uint64_t _partition_revision;   //!< Netlist revision the partition was computed for.
+        size_t        _partition_chunks;     //!< Number of chunks the partition was asked for.
+
+        TplWorkers _workers; //!< Threads computing the chunks, kept from one call to the next.
     };
 
     struct PinPos {
-        TplPin *pin;
-        double pos;
-        PinPos(TplPin *p=nullptr, double c=0) : pin(p), pos(c) {}
+        unsigned int pin; //!< Index of the pin in TplNets.
+        double pos;       //!< The pin's coordinate in the direction being sorted.
+        PinPos(unsigned int p=0, double c=0) : pin(p), pos(c) {}
     };
 
     bool compare_pin(const PinPos &lhs, const PinPos &rhs);
@@ -1,7 +1,17 @@
 #include "tpl_standard_thermal_force_model.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
 #include <boost/property_tree/json_parser.hpp>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "debug.h"
 
 namespace tpl {
@@ -10,8 +20,42 @@ namespace tpl {
     using std::vector;
 
 
-    TplStandardThermalForceModel::TplStandardThermalForceModel()
+    namespace {
+
+        //! The smallest n >= m whose only prime factors are 2, 3 and 5, and which is a multiple of multiple.
+        int transform_size(int m, int multiple)
+        {
+            for (int n = std::max(m, 1); ; ++n) {
+                if (n % multiple != 0) continue;
+                int r = n;
+                while (r % 2 == 0) r /= 2;
+                while (r % 3 == 0) r /= 3;
+                while (r % 5 == 0) r /= 5;
+                if (r == 1) return n;
+            }
+        }
+
+        //! Index in [0, n) of grid index i, for a grid of n points mirrored around -1/2 and n-1/2.
+        int mirror_index(int i, int n)
+        {
+            int m = i % (2*n);
+            if (m < 0) m += 2*n;
+            return m < n ? m : 2*n-1-m;
+        }
+
+        const size_t MODULE_GRAIN = 4096; //!< Modules per rasterization chunk.
+        const size_t ROW_GRAIN    = 8;    //!< Grid rows per convolution tile.
+        const int    MACRO_POINTS = 64;   //!< Grid points a module covers beyond which its inner points go to a difference array.
+        const unsigned int REBUILD_PERIOD = 32; //!< Incremental updates of a density layer between two full rasterizations.
+        const double AREA_MOVE_TOLERANCE = 1.0 / 32; //!< Fraction of a bin a module moves by area before it is rasterized again.
+
+    }//end anonymous namespace
+
+    TplStandardThermalForceModel::TplStandardThermalForceModel() :
+        _heat_flux_method(HeatFluxMethod::Auto), _power_density_method(PowerDensityMethod::Point),
+        _fft_width(0), _fft_height(0)
     {
+        set_num_threads(0);
         initialize_model();
 
 
@@ -21,55 +65,16 @@ namespace tpl {
         BIN_WIDTH  = TplDB::db().modules.chip_width()  * 1.0 / _gw_num;
         BIN_HEIGHT = TplDB::db().modules.chip_height() * 1.0 / _gh_num;
 
-#ifndef NDEBUG
-        _power_density.resize(_gw_num+1, vector<double>(_gh_num+1, 0));
-
-        _xhf_grid.resize(_gw_num+1, vector<double>(_gh_num+1, 0));
-
-        _yhf_grid.resize(_gw_num+1, vector<double>(_gh_num+1, 0));
-#else
-        _power_density = (double**)malloc( sizeof(double*) * (_gw_num+1) );
-        assert(_power_density != nullptr);
-        for (int i=0; i<_gw_num+1; ++i) {
-            *(_power_density+i) = (double*)malloc( sizeof(double) * (_gh_num+1) );
-            assert(*(_power_density+i) != nullptr);
-            memset(*(_power_density+i), 0, sizeof(double) * (_gh_num+1) );
-        }
-
-        _xhf_grid = (double**)malloc( sizeof(double*) * (_gw_num+1) );
-        assert(_xhf_grid != nullptr);
-        for (int i=0; i<_gw_num+1; ++i) {
-            *(_xhf_grid+i) = (double*)malloc( sizeof(double) * (_gh_num+1) );
-            assert(*(_xhf_grid+i) != nullptr);
-            memset(*(_xhf_grid+i), 0, sizeof(double) * (_gh_num+1) );
-        }
-
-        _yhf_grid = (double**)malloc( sizeof(double*) * (_gw_num+1) );
-        assert(_yhf_grid != nullptr);
-        for (int i=0; i<_gw_num+1; ++i) {
-            *(_yhf_grid+i) = (double*)malloc( sizeof(double) * (_gh_num+1) );
-            assert(*(_yhf_grid+i) != nullptr);
-            memset(*(_yhf_grid+i), 0, sizeof(double) * (_gh_num+1) );
-        }
-#endif
-
         ////////////////////////////////////////////////////////////////////////////
         //init green function
         gdx = static_cast<int>( ceil(R2 / BIN_WIDTH));
         gdy = static_cast<int>( ceil(R2 / BIN_HEIGHT));
 
-
-#ifndef NDEBUG
-        _green_function.resize(gdx, vector<double>(gdy+1, 0));
-#else
-        _green_function = (double**)malloc( sizeof(double*) * gdx);
-        assert(_green_function != nullptr);
-        for (int i=0; i<gdx; ++i) {
-            *(_green_function+i) = (double*)malloc( sizeof(double) * gdy);
-            assert(*(_green_function+i) != nullptr);
-            memset(*(_green_function+i), 0, sizeof(double) * gdy );
-        }
-#endif
+        //the power density's halo holds the stencil's reach past the chip boundary
+        _power_density.resize(_gw_num+1, _gh_num+1, gdx, gdy);
+        _xhf_grid.resize(_gw_num+1, _gh_num+1);
+        _yhf_grid.resize(_gw_num+1, _gh_num+1);
+        _green_function.resize(gdx, gdy);
 
         double green_func_val = 0;
         double distance_squre = 0;
@@ -88,36 +93,12 @@ namespace tpl {
                     }
                 }
 
-                _green_function[i][j] = green_func_val;
+                _green_function(i,j) = green_func_val;
             }
         }
         ////////////////////////////////////////////////////////////////////////////
-    }
-
-    TplStandardThermalForceModel::~TplStandardThermalForceModel()
-    {
-#ifdef NDEBUG
-
-        for (int i=0; i<_gw_num+1; ++i) {
-            free( *(_power_density+i) );
-        }
-        free(_power_density);
-
-        for (int i=0; i<_gw_num+1; ++i) {
-            free( *(_xhf_grid+i) );
-        }
-        free(_xhf_grid);
-
-        for (int i=0; i<_gw_num+1; ++i) {
-            free( *(_yhf_grid+i) );
-        }
-        free(_yhf_grid);
 
-        for (int i=0; i<gdx; ++i) {
-            free(*(_green_function+i));
-        }
-        free(_green_function);
-#endif
+        initialize_kernels();
     }
 
     bool TplStandardThermalForceModel::initialize_model()
@@ -133,12 +114,36 @@ namespace tpl {
             R2         = tree.get<double>("r2");
             MU         = tree.get<double>("mu");
 
+            set_num_threads(tree.get<unsigned int>("num_threads", 0));
+
+            std::string method = tree.get<std::string>("heat_flux_method", "auto");
+            if      (method == "auto")    _heat_flux_method = HeatFluxMethod::Auto;
+            else if (method == "fft")     _heat_flux_method = HeatFluxMethod::FFT;
+            else if (method == "stencil") _heat_flux_method = HeatFluxMethod::Stencil;
+            else if (method == "direct")  _heat_flux_method = HeatFluxMethod::Direct;
+            else return false;
+
+            std::string rasterization = tree.get<std::string>("power_density_method", "point");
+            if      (rasterization == "area")  _power_density_method = PowerDensityMethod::Area;
+            else if (rasterization == "point") _power_density_method = PowerDensityMethod::Point;
+            else return false;
+
             return true;
         } catch(...) {
             return false;
         }
     }
 
+    void TplStandardThermalForceModel::set_num_threads(unsigned int num_threads)
+    {
+        if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+        _num_threads = num_threads;
+        _fft_workers.resize(num_threads);
+        for (FftWorker &worker : _fft_workers) {
+            worker.fft.SetFlag(Eigen::FFT<double>::HalfSpectrum);
+        }
+    }
+
     void TplStandardThermalForceModel::compute_heat_flux_vector(VectorXd &HFx, VectorXd &HFy) {
         //preconditions
         assert(HFx.rows() == TplDB::db().modules.num_free());
@@ -149,40 +154,12 @@ namespace tpl {
 
             generate_heat_flux_grid();
 
-            ///////////////////////////////////////////////////////////////////////////////////////
             //compute module heat flux using bilinear interpolation method
-            double x = 0, y = 0;//for module's coordinates
-            int idx_x = 0, idx_y = 0;//for (x,y)'s containing grid point index
-            double x1 = 0, x2 = 0, y1 = 0, y2 = 0;//for (x,y)'s containing grid coordinates
-            double xhf = 0, yhf = 0;//for x and y heat flux value
-            for (size_t i = 0; i != TplDB::db().modules.num_free(); ++i) {
-                x = TplDB::db().modules[i].x + TplDB::db().modules[i].width / 2.0;  //module center x
-                y = TplDB::db().modules[i].y + TplDB::db().modules[i].height / 2.0; //module center y
-
-                idx_x = static_cast<int>(floor(x / BIN_WIDTH));
-                idx_y = static_cast<int>(floor(y / BIN_HEIGHT));
-
-                x1 = idx_x * BIN_WIDTH;
-                x2 = x1 + BIN_WIDTH;
-                y1 = idx_y * BIN_HEIGHT;
-                y2 = y1 + BIN_HEIGHT;
-
-                xhf = _xhf_grid[idx_x][idx_y] * (x2 - x) * (y2 - y) +
-                      _xhf_grid[idx_x + 1][idx_y] * (x - x1) * (y2 - y) +
-                      _xhf_grid[idx_x][idx_y + 1] * (x2 - x) * (y - y1) +
-                      _xhf_grid[idx_x + 1][idx_y + 1] * (x - x1) * (y - y1);
-                xhf = xhf / (BIN_WIDTH * BIN_HEIGHT);
-
-                yhf = _yhf_grid[idx_x][idx_y] * (x2 - x) * (y2 - y) +
-                      _yhf_grid[idx_x + 1][idx_y] * (x - x1) * (y2 - y) +
-                      _yhf_grid[idx_x][idx_y + 1] * (x2 - x) * (y - y1) +
-                      _yhf_grid[idx_x + 1][idx_y + 1] * (x - x1) * (y - y1);
-                yhf = yhf / (BIN_WIDTH * BIN_HEIGHT);
-
-                HFx(i) = xhf;
-                HFy(i) = yhf;
-            }
-            ///////////////////////////////////////////////////////////////////////////////////////
+            double *xhf = HFx.data();
+            double *yhf = HFy.data();
+            _workers.parallel_for(TplDB::db().modules.num_free(), MODULE_GRAIN, _num_threads, [&](size_t first, size_t last, unsigned int) {
+                interpolate_heat_flux(first, last, xhf, yhf);
+            });
         } catch(...) {
             std::cout << "compute heat flux exception." << std::endl;
         }
@@ -190,47 +167,384 @@ namespace tpl {
 
 
 
-    void TplStandardThermalForceModel::generate_power_density()
+    double TplStandardThermalForceModel::density_overflow(double target_density)
     {
-        try {
-            // reset _power_density
-#ifndef NDEBUG
-            _power_density.clear();
-            _power_density.resize(_gw_num+1, vector<double>(_gh_num+1, 0));
-#else
-            for (int i=0; i<_gw_num+1; ++i) {
-                memset(*(_power_density+i), 0, sizeof(double) * (_gh_num+1) );
+        //the heat flux layers when they are by area, layers of their own otherwise
+        const bool shared = _power_density_method == PowerDensityMethod::Area;
+        DensityLayer &free_layer  = shared ? _free_layer  : _free_area_layer;
+        DensityLayer &fixed_layer = shared ? _fixed_layer : _fixed_area_layer;
+
+        const TplModules &modules = TplDB::db().modules;
+        update_layer(free_layer,  0, modules.num_free(), PowerDensityMethod::Area);
+        update_layer(fixed_layer, modules.num_free(), modules.size(), PowerDensityMethod::Area);
+
+        //power over area of the modules
+        const TplModuleGeometry &g = TplDB::db().modules.geometry();
+        double power = 0, area = 0;
+        for (size_t k=0; k<TplDB::db().modules.size(); ++k) {
+            power += g.width[k] * g.height[k] * g.power_density[k];
+            area  += g.width[k] * g.height[k];
+        }
+        if (power <= 0) return 0;
+        const double mean_power_density = power / area;
+
+        double overflow = 0, occupied = 0;
+        for (int i=0; i<=_gw_num; ++i) {
+            const double *free  = free_layer.grid.row(i);
+            const double *fixed = fixed_layer.grid.row(i);
+            const double x_inside = (i == 0 || i == _gw_num) ? 0.5 : 1.0;
+            for (int j=0; j<=_gh_num; ++j) {
+                const double inside = x_inside * ((j == 0 || j == _gh_num) ? 0.5 : 1.0);
+                const double fraction = (free[j] + fixed[j]) / mean_power_density;
+                overflow += std::max(0.0, fraction - target_density * inside);
+                occupied += fraction;
+            }
+        }
+        return occupied > 0 ? overflow / occupied : 0;
+    }
+
+    void TplStandardThermalForceModel::interpolate_heat_flux(size_t first, size_t last, double *HFx, double *HFy) const
+    {
+        const TplModuleGeometry &g = TplDB::db().modules.geometry();
+
+        //both grids have the same layout, point (i,j) at offset i*stride + j of row 0
+        const double *xgrid = _xhf_grid.row(0);
+        const double *ygrid = _yhf_grid.row(0);
+        const size_t stride = _xhf_grid.stride();
+        assert(_yhf_grid.stride() == _xhf_grid.stride());
+
+        const double inverse_width  = 1.0 / BIN_WIDTH;
+        const double inverse_height = 1.0 / BIN_HEIGHT;
+
+        size_t k = first;
+#if defined(__SSE2__)
+        const __m128d half        = _mm_set1_pd(0.5);
+        const __m128d zero        = _mm_setzero_pd();
+        const __m128d x_scale     = _mm_set1_pd(inverse_width);
+        const __m128d y_scale     = _mm_set1_pd(inverse_height);
+        const __m128d x_max       = _mm_set1_pd(_gw_num);
+        const __m128d y_max       = _mm_set1_pd(_gh_num);
+        const __m128d x_last_bin  = _mm_set1_pd(_gw_num-1);
+        const __m128d y_last_bin  = _mm_set1_pd(_gh_num-1);
+
+        for (; k+2<=last; k+=2) {
+            //module centers in bins, clamped to the chip
+            __m128d fx = _mm_mul_pd(_mm_add_pd(_mm_loadu_pd(&g.x[k]), _mm_mul_pd(_mm_loadu_pd(&g.width[k]),  half)), x_scale);
+            __m128d fy = _mm_mul_pd(_mm_add_pd(_mm_loadu_pd(&g.y[k]), _mm_mul_pd(_mm_loadu_pd(&g.height[k]), half)), y_scale);
+            fx = _mm_min_pd(_mm_max_pd(fx, zero), x_max);
+            fy = _mm_min_pd(_mm_max_pd(fy, zero), y_max);
+
+            //bin indices, truncation is floor on the clamped centers, a center on the last grid point is in the last bin
+            const __m128i ix = _mm_cvttpd_epi32(_mm_min_pd(fx, x_last_bin));
+            const __m128i iy = _mm_cvttpd_epi32(_mm_min_pd(fy, y_last_bin));
+            const __m128d tx = _mm_sub_pd(fx, _mm_cvtepi32_pd(ix));
+            const __m128d ty = _mm_sub_pd(fy, _mm_cvtepi32_pd(iy));
+
+            const size_t offset[2] = {
+                size_t(_mm_cvtsi128_si32(ix)) * stride + _mm_cvtsi128_si32(iy),
+                size_t(_mm_cvtsi128_si32(_mm_shuffle_epi32(ix, 1))) * stride + _mm_cvtsi128_si32(_mm_shuffle_epi32(iy, 1))
+            };
+            const __m128d wx[2] = {_mm_unpacklo_pd(tx, tx), _mm_unpackhi_pd(tx, tx)};
+            const __m128d wy[2] = {_mm_unpacklo_pd(ty, ty), _mm_unpackhi_pd(ty, ty)};
+
+            __m128d result[2];
+            for (int m=0; m<2; ++m) {
+                //(i,j) and (i,j+1) interpolated with (i+1,j) and (i+1,j+1) along x
+                const double *x0 = xgrid + offset[m];
+                const double *y0 = ygrid + offset[m];
+                __m128d bx = _mm_loadu_pd(x0);
+                __m128d by = _mm_loadu_pd(y0);
+                bx = _mm_add_pd(bx, _mm_mul_pd(wx[m], _mm_sub_pd(_mm_loadu_pd(x0 + stride), bx)));
+                by = _mm_add_pd(by, _mm_mul_pd(wx[m], _mm_sub_pd(_mm_loadu_pd(y0 + stride), by)));
+
+                //then along y, the x heat flux in the low lane and the y heat flux in the high one
+                const __m128d low  = _mm_unpacklo_pd(bx, by);
+                const __m128d high = _mm_unpackhi_pd(bx, by);
+                result[m] = _mm_add_pd(low, _mm_mul_pd(wy[m], _mm_sub_pd(high, low)));
             }
+            _mm_storeu_pd(HFx + k, _mm_unpacklo_pd(result[0], result[1]));
+            _mm_storeu_pd(HFy + k, _mm_unpackhi_pd(result[0], result[1]));
+        }
 #endif
 
-            ///////////////////////////////////////////////////////////////////////////////////
-            //iterate modules to generate the density grid
-            double left, right, bottom, top;
-            unsigned int idx_left, idx_right, idx_bottom, idx_top;
-            for(TplModules::iterator it=TplDB::db().modules.begin(); it!=TplDB::db().modules.end(); ++it) {
-
-                left   = it->x;
-                right  = it->x + it->width;
-                bottom = it->y;
-                top    = it->y + it->height;
-
-                idx_left   = static_cast<unsigned int>( ceil (left   / BIN_WIDTH ) );
-                idx_right  = static_cast<unsigned int>( floor(right  / BIN_WIDTH ) );
-                idx_bottom = static_cast<unsigned int>( ceil (bottom / BIN_HEIGHT) );
-                idx_top    = static_cast<unsigned int>( floor(top    / BIN_HEIGHT) );
-
-                for(unsigned int i=idx_left; i<=idx_right; ++i) {
-                    for(unsigned int j=idx_bottom; j<=idx_top; ++j) {
-                        _power_density[i][j] += it->power_density;
+        for (; k<last; ++k) {
+            const double fx = std::min(std::max((g.x[k] + g.width[k]  * 0.5) * inverse_width,  0.0), double(_gw_num));
+            const double fy = std::min(std::max((g.y[k] + g.height[k] * 0.5) * inverse_height, 0.0), double(_gh_num));
+            const int ix = std::min(static_cast<int>(fx), _gw_num-1);
+            const int iy = std::min(static_cast<int>(fy), _gh_num-1);
+            const double tx = fx - ix;
+            const double ty = fy - iy;
+
+            const double *x0 = xgrid + size_t(ix) * stride + iy;
+            const double *y0 = ygrid + size_t(ix) * stride + iy;
+            const double bx0 = x0[0] + tx * (x0[stride]   - x0[0]);
+            const double bx1 = x0[1] + tx * (x0[stride+1] - x0[1]);
+            const double by0 = y0[0] + tx * (y0[stride]   - y0[0]);
+            const double by1 = y0[1] + tx * (y0[stride+1] - y0[1]);
+            HFx[k] = bx0 + ty * (bx1 - bx0);
+            HFy[k] = by0 + ty * (by1 - by0);
+        }
+    }
+
+    void TplStandardThermalForceModel::generate_power_density()
+    {
+        try {
+            //the free modules come first
+            const TplModules &modules = TplDB::db().modules;
+            update_layer(_free_layer,  0, modules.num_free(), _power_density_method);
+            update_layer(_fixed_layer, modules.num_free(), modules.size(), _power_density_method);
+
+            _workers.parallel_for(_gw_num+1, ROW_GRAIN, _num_threads, [&](size_t first, size_t last, unsigned int) {
+                for (size_t i=first; i<last; ++i) {
+                    const double *free  = _free_layer.grid.row(i);
+                    const double *fixed = _fixed_layer.grid.row(i);
+                    double *density = _power_density.row(i);
+                    for (int j=0; j<=_gh_num; ++j) {
+                        density[j] = free[j] + fixed[j];
                     }
                 }
-            }
-            ///////////////////////////////////////////////////////////////////////////////////
+            });
         } catch(...) {
             std::cout << "update power density exception"  << std::endl;
         }
     }
 
+    void TplStandardThermalForceModel::update_layer(DensityLayer &layer, size_t first, size_t last, PowerDensityMethod method)
+    {
+        const TplModuleGeometry &g = TplDB::db().modules.geometry();
+        const size_t n = last - first;
+
+        bool rebuild = !layer.valid || layer.method != method || layer.first != first || layer.last != last || layer.updates >= REBUILD_PERIOD ||
+                       layer.grid.width() != _gw_num+1 || layer.grid.height() != _gh_num+1;
+
+        vector<size_t> moved;
+        if (!rebuild) {
+            for (size_t k=first; k<last; ++k) {
+                if (footprint_changed(k, layer)) moved.push_back(k);
+            }
+            rebuild = moved.size() * 2 > n;
+        }
+
+        if (rebuild) {
+            layer.grid.resize(_gw_num+1, _gh_num+1);
+            rasterize(n, [&](size_t m) {
+                const size_t k = first + m;
+                return DensityStamp{g.x[k], g.y[k], g.width[k], g.height[k], g.power_density[k]};
+            }, method, layer.grid);
+
+            layer.x.assign(g.x.begin() + first, g.x.begin() + last);
+            layer.y.assign(g.y.begin() + first, g.y.begin() + last);
+            layer.width .assign(g.width .begin() + first, g.width .begin() + last);
+            layer.height.assign(g.height.begin() + first, g.height.begin() + last);
+            layer.value .assign(g.power_density.begin() + first, g.power_density.begin() + last);
+            layer.method  = method;
+            layer.first   = first;
+            layer.last    = last;
+            layer.updates = 0;
+            layer.valid   = true;
+            return;
+        }
+        if (moved.empty()) return;
+
+        //take every moved module out as it was rasterized, and put it back as it is now
+        rasterize(2 * moved.size(), [&](size_t m) {
+            const size_t k = moved[m/2];
+            const size_t l = k - first;
+            if (m % 2 == 0) return DensityStamp{layer.x[l], layer.y[l], layer.width[l], layer.height[l], -layer.value[l]};
+            return DensityStamp{g.x[k], g.y[k], g.width[k], g.height[k], g.power_density[k]};
+        }, method, layer.grid);
+
+        for (size_t k : moved) {
+            const size_t l = k - first;
+            layer.x[l]      = g.x[k];
+            layer.y[l]      = g.y[k];
+            layer.width[l]  = g.width[k];
+            layer.height[l] = g.height[k];
+            layer.value[l]  = g.power_density[k];
+        }
+        ++layer.updates;
+    }
+
+    bool TplStandardThermalForceModel::footprint_changed(size_t k, const DensityLayer &layer) const
+    {
+        const TplModuleGeometry &g = TplDB::db().modules.geometry();
+        const size_t l = k - layer.first;
+        const double x = layer.x[l];
+        const double y = layer.y[l];
+
+        if (g.width[k] != layer.width[l] || g.height[k] != layer.height[l] || g.power_density[k] != layer.value[l]) return true;
+        if (g.x[k] == x && g.y[k] == y) return false;
+
+        //by area any move changes the covered fractions, a module stays where it was rasterized
+        //until it moved by AREA_MOVE_TOLERANCE of a bin, which bounds the error and keeps the power
+        if (layer.method == PowerDensityMethod::Area) {
+            return fabs(g.x[k] - x) >= AREA_MOVE_TOLERANCE * BIN_WIDTH ||
+                   fabs(g.y[k] - y) >= AREA_MOVE_TOLERANCE * BIN_HEIGHT;
+        }
+
+        //by point only the covered grid points matter
+
+        auto first_point = [](double low, double bin)  { return static_cast<int>(ceil (low  / bin)); };
+        auto last_point  = [](double high, double bin) { return static_cast<int>(floor(high / bin)); };
+        return first_point(g.x[k], BIN_WIDTH)  != first_point(x, BIN_WIDTH)  ||
+               last_point (g.x[k] + g.width[k], BIN_WIDTH)   != last_point(x + g.width[k], BIN_WIDTH) ||
+               first_point(g.y[k], BIN_HEIGHT) != first_point(y, BIN_HEIGHT) ||
+               last_point (g.y[k] + g.height[k], BIN_HEIGHT) != last_point(y + g.height[k], BIN_HEIGHT);
+    }
+
+    template<typename Stamps>
+    void TplStandardThermalForceModel::rasterize(size_t n, const Stamps &stamp, PowerDensityMethod method, Grid2D &target)
+    {
+        _partial_difference.resize(_num_threads);
+        _partial_difference_used.assign(_num_threads, 0);
+        for (Grid2D &difference : _partial_difference) {
+            if (difference.width() != _gw_num+1 || difference.height() != _gh_num+1) {
+                difference.resize(_gw_num+1, _gh_num+1);
+            }
+        }
+
+        //rasterize stamps [first, last) into grid, with thread t's difference array
+        auto rasterize_range = [&](size_t first, size_t last, unsigned int t, Grid2D &grid) {
+            for (size_t m=first; m<last; ++m) {
+                if (method == PowerDensityMethod::Point) {
+                    rasterize_points(stamp(m), grid);
+                } else if (rasterize_area(stamp(m), grid, _partial_difference[t])) {
+                    _partial_difference_used[t] = 1;
+                }
+            }
+        };
+
+        if (n <= MODULE_GRAIN || _num_threads == 1) {
+            rasterize_range(0, n, 0, target);
+            if (_partial_difference_used[0]) integrate_difference(_partial_difference[0], target);
+            return;
+        }
+
+        _partial_density.resize(_num_threads);
+        _partial_used.assign(_num_threads, 0);
+
+        _workers.parallel_for(n, MODULE_GRAIN, _num_threads, [&](size_t first, size_t last, unsigned int t) {
+            Grid2D &grid = _partial_density[t];
+            if (!_partial_used[t]) {
+                grid.resize(_gw_num+1, _gh_num+1);
+                _partial_used[t] = 1;
+            }
+            rasterize_range(first, last, t, grid);
+        });
+
+        //every thread integrates its own macros
+        _workers.parallel_for(_num_threads, 1, _num_threads, [&](size_t first, size_t last, unsigned int) {
+            for (size_t t=first; t<last; ++t) {
+                if (_partial_difference_used[t]) integrate_difference(_partial_difference[t], _partial_density[t]);
+            }
+        });
+
+        //sum up the parts row by row
+        _workers.parallel_for(_gw_num+1, ROW_GRAIN, _num_threads, [&](size_t first, size_t last, unsigned int) {
+            for (size_t i=first; i<last; ++i) {
+                double *density = target.row(i);
+                for (unsigned int t=0; t<_partial_density.size(); ++t) {
+                    if (!_partial_used[t]) continue;
+                    const double *column = _partial_density[t].row(i);
+                    for (int j=0; j<=_gh_num; ++j) {
+                        density[j] += column[j];
+                    }
+                }
+            }
+        });
+    }
+
+    void TplStandardThermalForceModel::rasterize_points(const DensityStamp &stamp, Grid2D &grid) const
+    {
+        double left   = stamp.x;
+        double right  = stamp.x + stamp.width;
+        double bottom = stamp.y;
+        double top    = stamp.y + stamp.height;
+
+        //grid points covered by the module, clipped to the chip
+        int idx_left   = std::max(static_cast<int>( ceil (left   / BIN_WIDTH ) ), 0);
+        int idx_right  = std::min(static_cast<int>( floor(right  / BIN_WIDTH ) ), _gw_num);
+        int idx_bottom = std::max(static_cast<int>( ceil (bottom / BIN_HEIGHT) ), 0);
+        int idx_top    = std::min(static_cast<int>( floor(top    / BIN_HEIGHT) ), _gh_num);
+
+        for(int i=idx_left; i<=idx_right; ++i) {
+            double *column = grid.row(i);
+            for(int j=idx_bottom; j<=idx_top; ++j) {
+                column[j] += stamp.value;
+            }
+        }
+    }
+
+    bool TplStandardThermalForceModel::rasterize_area(const DensityStamp &stamp, Grid2D &grid, Grid2D &difference) const
+    {
+        //the module clipped to the chip, in bins, grid point i's bin being [i-1/2, i+1/2]
+        const double left   = std::max(stamp.x / BIN_WIDTH, 0.0);
+        const double right  = std::min((stamp.x + stamp.width) / BIN_WIDTH, double(_gw_num));
+        const double bottom = std::max(stamp.y / BIN_HEIGHT, 0.0);
+        const double top    = std::min((stamp.y + stamp.height) / BIN_HEIGHT, double(_gh_num));
+        if (right <= left || top <= bottom) return false;
+
+        const int i0 = static_cast<int>(floor(left   + 0.5));
+        const int i1 = std::min(static_cast<int>(floor(right + 0.5)), _gw_num);
+        const int j0 = static_cast<int>(floor(bottom + 0.5));
+        const int j1 = std::min(static_cast<int>(floor(top   + 0.5)), _gh_num);
+
+        //covered fraction of the bins of the first and last point, the ones between are fully covered
+        auto overlap = [](int i, double low, double high) {
+            return std::min(high, i + 0.5) - std::max(low, i - 0.5);
+        };
+        const double x_first = overlap(i0, left, right),   x_last = overlap(i1, left, right);
+        const double y_first = overlap(j0, bottom, top),   y_last = overlap(j1, bottom, top);
+        auto x_weight = [&](int i) { return i == i0 ? x_first : (i == i1 ? x_last : 1.0); };
+        auto y_weight = [&](int j) { return j == j0 ? y_first : (j == j1 ? y_last : 1.0); };
+
+        const double value = stamp.value;
+
+        //border rows and columns only when the inner points go to the difference array
+        const bool macro = (i1 - i0 + 1) * (j1 - j0 + 1) > MACRO_POINTS && i1 - i0 >= 2 && j1 - j0 >= 2;
+        for (int i=i0; i<=i1; ++i) {
+            double *column = grid.row(i);
+            const double weight = value * x_weight(i);
+            const bool inner_row = macro && i != i0 && i != i1;
+            if (inner_row) {
+                column[j0] += weight * y_first;
+                column[j1] += weight * y_last;
+            } else {
+                for (int j=j0; j<=j1; ++j) {
+                    column[j] += weight * y_weight(j);
+                }
+            }
+        }
+        if (!macro) return false;
+
+        //inner points [i0+1, i1-1] x [j0+1, j1-1], the difference array ends at index i1 and j1 at the latest
+        difference(i0+1, j0+1) += value;
+        difference(i0+1, j1)   -= value;
+        difference(i1,   j0+1) -= value;
+        difference(i1,   j1)   += value;
+        return true;
+    }
+
+    void TplStandardThermalForceModel::integrate_difference(Grid2D &difference, Grid2D &grid) const
+    {
+        for (int i=0; i<=_gw_num; ++i) {
+            double *row = difference.row(i);
+            const double *previous = i > 0 ? difference.row(i-1) : nullptr;
+            double *column = grid.row(i);
+
+            double sum = 0;
+            for (int j=0; j<=_gh_num; ++j) {
+                sum += row[j];
+                row[j] = sum;
+            }
+            if (previous != nullptr) {
+                for (int j=0; j<=_gh_num; ++j) row[j] += previous[j];
+            }
+            for (int j=0; j<=_gh_num; ++j) column[j] += row[j];
+        }
+        difference.fill(0);
+    }
+
     double TplStandardThermalForceModel::power_density(int i, int j)
     {
         try {
@@ -248,7 +562,7 @@ namespace tpl {
 
             int                                      y_idx = j;
             if     (j < 0       && j >= -_gh_num-1 ) y_idx = -1-j;
-            else if(j > _gw_num && j <= 2*_gh_num+1) y_idx = 2*_gh_num+1-j;
+            else if(j > _gh_num && j <= 2*_gh_num+1) y_idx = 2*_gh_num+1-j;
             else if(j < -_gh_num-1 || j > 2*_gh_num+1) {
                 std::cout << "j index error : " << j << std::endl;
                 exit(-1);
@@ -256,7 +570,7 @@ namespace tpl {
 
             assert(0<= x_idx && x_idx < _gw_num+1);
             assert(0<= y_idx && y_idx < _gh_num+1);
-            return _power_density[x_idx][y_idx];
+            return _power_density(x_idx, y_idx);
 
         } catch(...) {
             std::cout << "access power density exception"  << std::endl;
@@ -267,23 +581,214 @@ namespace tpl {
 
     void TplStandardThermalForceModel::generate_heat_flux_grid()
     {
-        try {
+        HeatFluxMethod method = _heat_flux_method;
+        if (method == HeatFluxMethod::Auto) method = choose_heat_flux_method();
+
+        switch (method) {
+        case HeatFluxMethod::FFT:
+            generate_heat_flux_grid_fft();
+            break;
+        case HeatFluxMethod::Stencil:
+            generate_heat_flux_grid_stencil();
+            break;
+        default:
+            generate_heat_flux_grid_direct();
+            break;
+        }
+    }
+
+    HeatFluxMethod TplStandardThermalForceModel::choose_heat_flux_method() const
+    {
+        //multiply-adds of the stencil, both directions over every table entry, two per SSE2 instruction
+        const double points  = double(_gw_num+1) * (_gh_num+1);
+        const double stencil = points * (2*gdx+1) * (2*gdy+1);
+
+        //one forward and two inverse transforms of the padded grid, about 5 n log2(n) flops each for a complex
+        //transform, halved by the real input, plus building the padded grid
+        const double n   = double(transform_size(_gw_num+1 + 2*gdx, 1)) * transform_size(_gh_num+1 + 2*gdy, 4);
+        const double fft = 3 * 2.5 * n * std::log2(n) + 4 * n;
 
-#ifndef NDEBUG
-            _xhf_grid.clear();
-            _xhf_grid.resize(_gw_num+1, vector<double>(_gh_num+1, 0));
+        return stencil <= fft ? HeatFluxMethod::Stencil : HeatFluxMethod::FFT;
+    }
 
-            _yhf_grid.clear();
-            _yhf_grid.resize(_gw_num+1, vector<double>(_gh_num+1, 0));
-#else
-            for (int i=0; i<_gw_num+1; ++i) {
-                memset(*(_xhf_grid+i), 0, sizeof(double) * (_gh_num+1) );
+    void TplStandardThermalForceModel::initialize_kernels()
+    {
+        //Green function of the offset (a,b), zero outside its window
+        auto green = [this](int a, int b) {
+            a = abs(a);
+            b = abs(b);
+            return (a < gdx && b < gdy) ? _green_function(a, b) : 0.0;
+        };
+
+        _xkernel.resize(1, 1, gdx, gdy);
+        _ykernel.resize(1, 1, gdx, gdy);
+        for (int d=-gdx; d<=gdx; ++d) {
+            for (int e=-gdy; e<=gdy; ++e) {
+                _xkernel(d, e) = (green(d+1, e) - green(d-1, e)) / 2.0;
+                _ykernel(d, e) = (green(d, e+1) - green(d, e-1)) / 2.0;
             }
+        }
+    }
 
-            for (int i=0; i<_gw_num+1; ++i) {
-                memset(*(_yhf_grid+i), 0, sizeof(double) * (_gh_num+1) );
+    void TplStandardThermalForceModel::generate_padded_power_density()
+    {
+        Grid2D &grid = _power_density;
+
+        //halo along y of the chip's rows
+        _workers.parallel_for(_gw_num+1, ROW_GRAIN, _num_threads, [&](size_t first, size_t last, unsigned int) {
+            for (size_t i=first; i<last; ++i) {
+                double *row = grid.row(i);
+                for (int j=-gdy; j<0; ++j)               row[j] = row[mirror_index(j, _gh_num+1)];
+                for (int j=_gh_num+1; j<=_gh_num+gdy; ++j) row[j] = row[mirror_index(j, _gh_num+1)];
             }
-#endif
+        });
+
+        //halo rows along x, whole copies of the mirrored rows
+        _workers.parallel_for(2*gdx, ROW_GRAIN, _num_threads, [&](size_t first, size_t last, unsigned int) {
+            for (int k=first; k<int(last); ++k) {
+                const int i = k < gdx ? k-gdx : _gw_num+1 + k-gdx;
+                const double *source = grid.row(mirror_index(i, _gw_num+1));
+                std::copy(source - gdy, source + _gh_num+1 + gdy, grid.row(i) - gdy);
+            }
+        });
+    }
+
+    void TplStandardThermalForceModel::generate_heat_flux_grid_stencil()
+    {
+        generate_padded_power_density();
+
+        using RowMap      = Eigen::Map<VectorXd, Eigen::Aligned>;
+        using ConstRowMap = Eigen::Map<const VectorXd>;
+
+        _workers.parallel_for(_gw_num+1, ROW_GRAIN, _num_threads, [&](size_t first, size_t last, unsigned int) {
+            for (int i=first; i<int(last); ++i) {
+                RowMap xhf(_xhf_grid.row(i), _gh_num+1);
+                RowMap yhf(_yhf_grid.row(i), _gh_num+1);
+                xhf.setZero();
+                yhf.setZero();
+
+                for (int d=-gdx; d<=gdx; ++d) {
+                    //grid row i-d, grid point j-e at row[j-e]
+                    const double *row = _power_density.row(i-d);
+                    const double *kx  = _xkernel.row(d);
+                    const double *ky  = _ykernel.row(d);
+
+                    for (int e=-gdy; e<=gdy; ++e) {
+                        ConstRowMap density(row - e, _gh_num+1);
+                        if (kx[e] != 0) xhf += kx[e] * density;
+                        if (ky[e] != 0) yhf += ky[e] * density;
+                    }
+                }
+            }
+        });
+    }
+
+    void TplStandardThermalForceModel::initialize_fft()
+    {
+        //the padded grid [-gdx, _gw_num+gdx] x [-gdy, _gh_num+gdy], plus room for the kernel radius
+        _fft_width  = transform_size(_gw_num+1 + 2*gdx, 1);
+        _fft_height = transform_size(_gh_num+1 + 2*gdy, 4);
+
+        //tables at the offsets (d,e), negative offsets wrapped around to the end of the array
+        vector<double> xkernel(_fft_width * _fft_height, 0), ykernel(_fft_width * _fft_height, 0);
+        for (int d=-gdx; d<=gdx; ++d) {
+            for (int e=-gdy; e<=gdy; ++e) {
+                int k = ((d + _fft_width) % _fft_width) * _fft_height + (e + _fft_height) % _fft_height;
+                xkernel[k] = _xkernel(d, e);
+                ykernel[k] = _ykernel(d, e);
+            }
+        }
+        forward_transform(xkernel, _xkernel_spectrum);
+        forward_transform(ykernel, _ykernel_spectrum);
+    }
+
+    void TplStandardThermalForceModel::forward_transform(vector<double> &real, vector<std::complex<double>> &spectrum)
+    {
+        const int half = _fft_height/2 + 1;
+        spectrum.resize(_fft_width * half);
+
+        //real transform of every row along y
+        _workers.parallel_for(_fft_width, ROW_GRAIN, _num_threads, [&](size_t first, size_t last, unsigned int t) {
+            for (size_t x=first; x<last; ++x) {
+                _fft_workers[t].fft.fwd(&spectrum[x*half], &real[x*_fft_height], _fft_height);
+            }
+        });
+
+        //complex transform of every column along x
+        _workers.parallel_for(half, ROW_GRAIN, _num_threads, [&](size_t first, size_t last, unsigned int t) {
+            vector<std::complex<double>> *column = _fft_workers[t].column;
+            column[0].resize(_fft_width);
+            column[1].resize(_fft_width);
+            for (size_t y=first; y<last; ++y) {
+                for (int x=0; x<_fft_width; ++x) column[0][x] = spectrum[x*half + y];
+                _fft_workers[t].fft.fwd(column[1].data(), column[0].data(), _fft_width);
+                for (int x=0; x<_fft_width; ++x) spectrum[x*half + y] = column[1][x];
+            }
+        });
+    }
+
+    void TplStandardThermalForceModel::inverse_transform(vector<std::complex<double>> &spectrum, vector<double> &real)
+    {
+        const int half = _fft_height/2 + 1;
+        real.resize(_fft_width * _fft_height);
+
+        _workers.parallel_for(half, ROW_GRAIN, _num_threads, [&](size_t first, size_t last, unsigned int t) {
+            vector<std::complex<double>> *column = _fft_workers[t].column;
+            column[0].resize(_fft_width);
+            column[1].resize(_fft_width);
+            for (size_t y=first; y<last; ++y) {
+                for (int x=0; x<_fft_width; ++x) column[0][x] = spectrum[x*half + y];
+                _fft_workers[t].fft.inv(column[1].data(), column[0].data(), _fft_width);
+                for (int x=0; x<_fft_width; ++x) spectrum[x*half + y] = column[1][x];
+            }
+        });
+
+        _workers.parallel_for(_fft_width, ROW_GRAIN, _num_threads, [&](size_t first, size_t last, unsigned int t) {
+            for (size_t x=first; x<last; ++x) {
+                _fft_workers[t].fft.inv(&real[x*_fft_height], &spectrum[x*half], _fft_height);
+            }
+        });
+    }
+
+    void TplStandardThermalForceModel::generate_heat_flux_grid_fft()
+    {
+        if (_xkernel_spectrum.empty()) initialize_fft();
+
+        //padded power density, grid point (i,j) at (i+gdx, j+gdy)
+        generate_padded_power_density();
+        _fft_real.assign(_fft_width * _fft_height, 0);
+        for (int i=-gdx; i<=_gw_num+gdx; ++i) {
+            const double *row = _power_density.row(i);
+            std::copy(row - gdy, row + _gh_num+1 + gdy, &_fft_real[(i+gdx) * _fft_height]);
+        }
+        forward_transform(_fft_real, _fft_spectrum);
+
+        for (int direction=0; direction<2; ++direction) {
+            const vector<std::complex<double>> &kernel = direction == 0 ? _xkernel_spectrum : _ykernel_spectrum;
+            _fft_product.resize(_fft_spectrum.size());
+            _workers.parallel_for(_fft_spectrum.size(), ROW_GRAIN * _fft_height, _num_threads, [&](size_t first, size_t last, unsigned int) {
+                for (size_t k=first; k<last; ++k) {
+                    _fft_product[k] = _fft_spectrum[k] * kernel[k];
+                }
+            });
+            inverse_transform(_fft_product, _fft_real);
+
+            _workers.parallel_for(_gw_num+1, ROW_GRAIN, _num_threads, [&](size_t first, size_t last, unsigned int) {
+                for (size_t i=first; i<last; ++i) {
+                    const double *row = &_fft_real[(i+gdx) * _fft_height + gdy];
+                    double *hf = direction == 0 ? _xhf_grid.row(i) : _yhf_grid.row(i);
+                    std::copy(row, row + _gh_num+1, hf);
+                }
+            });
+        }
+    }
+
+    void TplStandardThermalForceModel::generate_heat_flux_grid_direct()
+    {
+        try {
+
+            _xhf_grid.fill(0);
+            _yhf_grid.fill(0);
 
             //hfx[i][j] = (tss[i+1][j] - tss[i-1][j]) / 2
             //tss[i+1][j] : x <- [i+1-(gdx-1), i+1+(gdx-1)] = [i-gdx+2, i+gdx]
@@ -298,46 +803,46 @@ namespace tpl {
 
                     /////////////////////////////////////////////////////////////////////////////////
                     // x heat flux
-                    _xhf_grid[i][j] = 0;
+                    _xhf_grid(i,j) = 0;
                     for (int j0=j-gdy+1; j0<=j+gdy-1; ++j0) { // j0 <- [j-(gdy-1), j+(gdy-1)]
                         int gy_idx = abs(j-j0);//g for green function
 
                         for (int i0=i-gdx; i0<i-gdx+2; ++i0) { //i0 <= [ i-1 - (gdx-1), i+1 - (gdx-1) )
-                            _xhf_grid[i][j] += (-_green_function[abs(i-1-i0)][gy_idx]) * power_density(i0, j0);
+                            _xhf_grid(i,j) += (-_green_function(abs(i-1-i0), gy_idx)) * power_density(i0, j0);
                         }
 
                         for (int i0=i-gdx+2; i0<=i+gdx-2; ++i0) { //i0 <- [ i+1 - (gdx-1), i-1 + (gdx-1) ]
-                            _xhf_grid[i][j] += (_green_function[abs(i+1-i0)][gy_idx] - _green_function[abs(i-1-i0)][gy_idx])
+                            _xhf_grid(i,j) += (_green_function(abs(i+1-i0), gy_idx) - _green_function(abs(i-1-i0), gy_idx))
                                                * power_density(i0, j0);
                         }
 
                         for (int i0=i+gdx-1; i0<=i+gdx; ++i0) { //i0 <- ( i-1 + (gdx-1), i+1 + (gdx-1) ]
-                            _xhf_grid[i][j] += _green_function[abs(i+1-i0)][gy_idx] * power_density(i0, j0);
+                            _xhf_grid(i,j) += _green_function(abs(i+1-i0), gy_idx) * power_density(i0, j0);
                         }
                     }
-                    _xhf_grid[i][j] /= 2.0;
+                    _xhf_grid(i,j) /= 2.0;
                     /////////////////////////////////////////////////////////////////////////////////
 
                     /////////////////////////////////////////////////////////////////////////////////
                     // y heat flux
-                    _yhf_grid[i][j] = 0;
+                    _yhf_grid(i,j) = 0;
                     for (int i0=i-gdx+1; i0<=i+gdx-1; ++i0) { //i0 <- [i-(gdx-1), i+(gdx-1)]
                         int gx_idx = abs(i-i0);//g for green function
 
                         for (int j0=j-gdy; j0<j-gdy+2; ++j0) { //j0 <- [ j-1 - (gdy-1), j+1 - (gdy-1) )
-                            _yhf_grid[i][j] += (-_green_function[gx_idx][abs(j-1-j0)]) * power_density(i0, j0);
+                            _yhf_grid(i,j) += (-_green_function(gx_idx, abs(j-1-j0))) * power_density(i0, j0);
                         }
 
                         for (int j0=j-gdy+2; j0<=j+gdy-2; ++j0) { //j0 <- [ j+1 - (gdy-1), j-1 + (gdy-1) ]
-                            _yhf_grid[i][j] += (_green_function[gx_idx][abs(j+1-j0)] - _green_function[gx_idx][abs(j-1-j0)])
+                            _yhf_grid(i,j) += (_green_function(gx_idx, abs(j+1-j0)) - _green_function(gx_idx, abs(j-1-j0)))
                                                * power_density(i0, j0);
                         }
 
                         for (int j0=j+gdy-1; j0<=j+gdy; ++j0) { //j0 <- ( j-1 + (gdy-1), j+1 + (gdy-1) ]
-                            _yhf_grid[i][j] += _green_function[gx_idx][abs(j+1-j0)] * power_density(i0, j0);
+                            _yhf_grid(i,j) += _green_function(gx_idx, abs(j+1-j0)) * power_density(i0, j0);
                         }
                     }
-                    _yhf_grid[i][j] /= 2.0;
+                    _yhf_grid(i,j) /= 2.0;
                     /////////////////////////////////////////////////////////////////////////////////
                 }
             }// end grid iteration
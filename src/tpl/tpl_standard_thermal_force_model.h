@@ -11,16 +11,35 @@
 
 #include "utils.h"
 #include "tpl_db.h"
+#include "tpl_grid.h"
+#include "tpl_workers.h"
 
+#include <complex>
 #include <map>
 #include <utility>
 #include <vector>
 
+#include <unsupported/Eigen/FFT>
+
 
 namespace tpl {
 
     using std::vector;
 
+    //! How the heat flux grid is computed from the power density.
+    enum class HeatFluxMethod {
+        Direct,  //!< Sum the Green function window of every grid point, the reference method.
+        Stencil, //!< Convolve the mirror padded power density with the derivative tables directly.
+        FFT,     //!< Convolve the mirror padded power density with the derivative tables by FFT.
+        Auto     //!< Stencil or FFT, whichever is estimated to be cheaper for the grid and kernel size.
+    };
+
+    //! How a module's power density is spread over the grid points.
+    enum class PowerDensityMethod {
+        Point, //!< Every grid point inside the module gets the module's full power density.
+        Area   //!< Every grid point gets the power density times the fraction of its bin the module covers.
+    };
+
     //! Standard implementation for tpl move force model.
     class TplStandardThermalForceModel : public TplAbstractThermalForceModel {
     public:
@@ -28,8 +47,15 @@ namespace tpl {
         TplStandardThermalForceModel();
 
         //Destructor.
-        ~TplStandardThermalForceModel();
+        ~TplStandardThermalForceModel() {}
 
+        //! Read the algorithm parameters from the TPLCONFIG json file.
+        /*!
+         * "heat_flux_method" is "auto" (the default), "stencil", "fft" or "direct", see HeatFluxMethod.
+         * "power_density_method" is "point" (the default) or "area", see PowerDensityMethod.
+         * "num_threads" is the number of threads of the grid computations, 0 or missing for one per
+         * hardware thread.
+         */
         bool initialize_model();
 
         //! Standard implementation for compute_head_flux_vector.
@@ -39,10 +65,115 @@ namespace tpl {
             return MU;
         }
 
+        //! Density overflow of the modules at their current positions, 0 when no bin is over target.
+        /*!
+         * The power density is rasterized by area, whatever power_density_method() is, and divided
+         * by the modules' mean power density into the area fraction of every bin the modules cover.
+         * The overflow is the sum over the bins of max(0, fraction - target_density), the bins on
+         * the chip edge being half inside the chip and holding half the target, over the sum of
+         * the fractions.
+         *
+         * By area, the layers of compute_heat_flux_vector() are brought up to date and shared, which
+         * costs little when it follows at the same positions. By point, two more layers are kept by
+         * area for the overflow alone. The fractions are exact for modules of one power density, as
+         * the bookshelf modules are, up to AREA_MOVE_TOLERANCE of a bin a module moved by since it
+         * was last rasterized.
+         */
+        double density_overflow(double target_density);
+
+        //! How the heat flux grid is computed.
+        HeatFluxMethod heat_flux_method() const {
+            return _heat_flux_method;
+        }
+        //! Change how the heat flux grid is computed.
+        void set_heat_flux_method(HeatFluxMethod method) {
+            _heat_flux_method = method;
+        }
+        //! The method Auto resolves to for this grid and kernel size.
+        HeatFluxMethod choose_heat_flux_method() const;
+
+        //! How the power density grid is rasterized.
+        PowerDensityMethod power_density_method() const {
+            return _power_density_method;
+        }
+        //! Change how the power density grid is rasterized.
+        void set_power_density_method(PowerDensityMethod method) {
+            _power_density_method = method;
+        }
+
+        //! Number of threads of the grid computations.
+        unsigned int num_threads() const {
+            return _num_threads;
+        }
+        //! Set the number of threads of the grid computations, 0 for one per hardware thread.
+        void set_num_threads(unsigned int num_threads);
+
     protected:
+        //! A module's rectangle, and the power density it adds to the grid, negative to take it out.
+        struct DensityStamp {
+            double x, y, width, height, value;
+        };
+
+        //! Power density of a range of modules, kept up to date from one call to the next.
+        struct DensityLayer {
+            Grid2D grid;
+            size_t first = 0;         //!< First module of the layer.
+            size_t last  = 0;         //!< Past the last module of the layer.
+            vector<double> x, y;      //!< Position every module of the layer was rasterized at.
+            vector<double> width, height, value; //!< Size and power density every module was rasterized with.
+            PowerDensityMethod method = PowerDensityMethod::Point; //!< Method the grid was rasterized with.
+            unsigned int updates = 0; //!< Incremental updates since the grid was last rasterized from scratch.
+            bool valid = false;
+        };
+
         //! Generate the power density.
+        /*!
+         * The power density is the sum of two layers, the fixed modules and the free ones. A layer
+         * only takes out and puts back the modules whose footprint changed since the last call, and
+         * is rasterized from scratch when over half of its modules changed, every REBUILD_PERIOD
+         * updates to flush the rounding errors, and when power_density_method() changes. So the
+         * fixed macros are rasterized once, and the cost follows how much the placement moved.
+         * Modules are clipped to the chip.
+         */
         void generate_power_density();
 
+        //! Bring layer up to date with the modules [first, last) rasterized by method.
+        void update_layer(DensityLayer &layer, size_t first, size_t last, PowerDensityMethod method);
+
+        //! Whether module k covers other grid points, or with another density, than layer holds it at.
+        /*!
+         * A module resized or of another power density always changed. By area, a module also
+         * changed when it moved by AREA_MOVE_TOLERANCE of a bin or more, so its density is at most
+         * that much off its position and the total power is kept.
+         */
+        bool footprint_changed(size_t k, const DensityLayer &layer) const;
+
+        //! Add stamp(0), ..., stamp(n-1) rasterized by method to target.
+        /*!
+         * Up to MODULE_GRAIN stamps are rasterized right into target. More are cut into chunks
+         * taken by the threads in turn, every thread rasterizes into its own part of the grid,
+         * and the parts are added to target row by row in parallel.
+         */
+        template<typename Stamps>
+        void rasterize(size_t n, const Stamps &stamp, PowerDensityMethod method, Grid2D &target);
+
+        //! Add the stamp's full power density to the grid points inside it.
+        void rasterize_points(const DensityStamp &stamp, Grid2D &grid) const;
+
+        //! Add the stamp's power density times the covered fraction of every bin to the grid.
+        /*!
+         * The bin of grid point (i,j) is centered on it, so the grid, weighted by the bin area,
+         * holds the power of the modules. The weights are separable, the overlap in x times the
+         * overlap in y. A macro covering more than MACRO_POINTS grid points adds its fully covered
+         * inner points as the 4 corners of a rectangle to difference, integrated by
+         * integrate_difference() once every module is in, and only its border points to grid.
+         * \return Whether difference was written.
+         */
+        bool rasterize_area(const DensityStamp &stamp, Grid2D &grid, Grid2D &difference) const;
+
+        //! Add the 2D prefix sum of difference to grid, difference is reset to zero.
+        void integrate_difference(Grid2D &difference, Grid2D &grid) const;
+
         //! Fetch power density for grid (i,j).
         /*!
          * \param i x index for power density.
@@ -59,27 +190,103 @@ namespace tpl {
          */
         void generate_heat_flux_grid();
 
+        //! Interpolate the heat flux grids at the centers of the free modules [first, last).
+        /*!
+         * Bilinear interpolation in the bin holding the center, clamped to the chip, so a module
+         * hanging over the chip edge gets the heat flux of the nearest point of the edge. With
+         * SSE2, the bin indices and weights are computed for two modules at a time, and the two
+         * corners of a bin's side, adjacent in a grid row, are read by one load. The x and y heat
+         * flux share the bin's offset in the grids and are interpolated together.
+         */
+        void interpolate_heat_flux(size_t first, size_t last, double *HFx, double *HFy) const;
+
+        //! Generate the heat flux grid by summing the Green function window of every grid point.
+        void generate_heat_flux_grid_direct();
+
+        //! Fill the derivative tables of the Green function.
+        /*!
+         * The heat flux at grid point (i,j) sums up the power density at (i-d,j-e) times
+         *   Kx(d,e) = (G(d+1,e) - G(d-1,e)) / 2  and  Ky(d,e) = (G(d,e+1) - G(d,e-1)) / 2,
+         * which is what generate_heat_flux_grid_direct() does term by term. Both tables are
+         * grids of one point with a halo, holding the offsets d in [-gdx, gdx] and e in [-gdy, gdy].
+         */
+        void initialize_kernels();
+
+        //! Fill the halo of gdx bins in x and gdy bins in y around the power density.
+        /*!
+         * The halo mirrors the grid around the chip boundary, like power_density(i,j) does.
+         */
+        void generate_padded_power_density();
+
+        //! Generate the heat flux grid from the padded power density and the derivative tables.
+        /*!
+         * For every table entry, one row of the result gains the entry times a shifted row of
+         * the padded grid, a branch free loop Eigen vectorizes. Tiles of rows run in parallel.
+         */
+        void generate_heat_flux_grid_stencil();
+
+        //! Generate the heat flux grid by FFT convolution of the padded grid with the derivative tables.
+        /*!
+         * The transform size holds the padded grid plus the kernel radius, so the circular
+         * convolution does not wrap around into the chip. The tables' transforms are computed once.
+         */
+        void generate_heat_flux_grid_fft();
+
+        //! Choose the transform size and compute the transforms of the two kernels.
+        void initialize_fft();
+
+        //! 2D transform of a real _fft_width x _fft_height array, row major in x, to its half spectrum.
+        /*!
+         * The rows, and then the columns, are transformed in parallel.
+         */
+        void forward_transform(vector<double> &real, vector<std::complex<double>> &spectrum);
+
+        //! Inverse of forward_transform, spectrum is overwritten.
+        void inverse_transform(vector<std::complex<double>> &spectrum, vector<double> &real);
+
         int _gw_num;     //!< Number of bin in x direction, g for grid.
         int _gh_num;     //!< Number of bin in y direction, g for grid.
 
-#ifndef NDEBUG
-        vector<vector<double>> _power_density;
-        vector<vector<double>> _xhf_grid;
-        vector<vector<double>> _yhf_grid;
-#else
-        double **_power_density; //!< 2 dimentional array of size col:(_gw_num+1), row:(_gh_num+1).
-        double **_xhf_grid;      //!< 2 dimentional array of size col:(_gw_num+1), row:(_gh_num+1).
-        double **_yhf_grid;      //!< 2 dimentional array of size col:(_gw_num+1), row:(_gh_num+1).
-#endif
-
         int gdx; //!< Number of values of green function in x direction, g for green function.
         int gdy; //!< Number of values of green function in y direction, g for green function.
 
-#ifndef NDEBUG
-        vector<vector<double>> _green_function;
-#else
-        double **_green_function; //!< 2 dimentional array of size col:gdx, row:gdy.
-#endif
+        Grid2D _power_density;  //!< (_gw_num+1) x (_gh_num+1) points, with a mirrored halo of gdx x gdy points.
+        Grid2D _xhf_grid;       //!< (_gw_num+1) x (_gh_num+1) points.
+        Grid2D _yhf_grid;       //!< (_gw_num+1) x (_gh_num+1) points.
+        Grid2D _green_function; //!< gdx x gdy points.
+
+        HeatFluxMethod _heat_flux_method; //!< How the heat flux grid is computed.
+        PowerDensityMethod _power_density_method; //!< How the power density grid is rasterized.
+
+        Grid2D _xkernel; //!< Derivative table Kx, see initialize_kernels().
+        Grid2D _ykernel; //!< Derivative table Ky, see initialize_kernels().
+
+        int _fft_width;  //!< Transform size in x direction.
+        int _fft_height; //!< Transform size in y direction.
+        vector<std::complex<double>> _xkernel_spectrum; //!< Half spectrum of the x heat flux kernel.
+        vector<std::complex<double>> _ykernel_spectrum; //!< Half spectrum of the y heat flux kernel.
+        vector<double>               _fft_real;         //!< Work array, the extended power density and the results.
+        vector<std::complex<double>> _fft_spectrum;     //!< Work array, the half spectrum of the power density.
+        vector<std::complex<double>> _fft_product;      //!< Work array, the product with a kernel's spectrum.
+
+        //! A thread's transform plans and work arrays, Eigen::FFT caches its plans and is not shared.
+        struct FftWorker {
+            Eigen::FFT<double> fft;
+            vector<std::complex<double>> column[2]; //!< One column of a spectrum, and its transform.
+        };
+        vector<FftWorker> _fft_workers;   //!< One per thread.
+
+        unsigned int _num_threads;                //!< Number of threads of the grid computations.
+        TplWorkers             _workers;          //!< Threads of the grid computations, kept from one call to the next.
+        vector<Grid2D>         _partial_density;  //!< Every thread's part of the power density.
+        vector<char>           _partial_used;     //!< Whether a thread rasterized modules into its part.
+        vector<Grid2D>         _partial_difference;      //!< Every thread's difference array of the macros' inner points.
+        vector<char>           _partial_difference_used; //!< Whether a thread wrote its difference array.
+
+        DensityLayer _free_layer;  //!< Power density of the free modules.
+        DensityLayer _fixed_layer; //!< Power density of the fixed modules.
+        DensityLayer _free_area_layer;  //!< Power density of the free modules by area, for density_overflow() by point.
+        DensityLayer _fixed_area_layer; //!< Power density of the fixed modules by area, for density_overflow() by point.
 
         double BIN_WIDTH;  //!< Algorithm parameter : a grid bin's width.
         double BIN_HEIGHT; //!< Algorithm parameter : a grid bin's height.
@@ -0,0 +1,186 @@
+/*!
+ * \file tpl_trace.cpp
+ * \brief Opt-in binary trace of the placement matrices and vectors implementation file.
+ */
+
+#include "tpl_trace.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <boost/property_tree/json_parser.hpp>
+
+namespace tpl {
+    using namespace std;
+
+    namespace {
+        const char     TRACE_MAGIC[8] = {'T', 'P', 'L', 'T', 'R', 'A', 'C', 'E'};
+        const uint32_t TRACE_VERSION  = 1;
+        const uint32_t VECTOR_RECORD  = 1;
+        const uint32_t MATRIX_RECORD  = 2;
+    }
+
+    bool TplTraceSettings::load()
+    {
+        try {
+            namespace pt = boost::property_tree;
+            const char *config = getenv("TPLCONFIG");
+            if (config == nullptr) return false;
+
+            pt::ptree tree;
+            pt::read_json(config, tree);
+
+            enabled  = tree.get<bool>  ("trace_enabled",  enabled);
+            path     = tree.get<string>("trace_path",     path);
+            interval = tree.get<int>   ("trace_interval", interval);
+
+            return true;
+        } catch(...) {
+            return false;
+        }
+    }
+
+    TplTrace::TplTrace(const TplTraceSettings &settings) : _interval(max(1, settings.interval))
+    {
+        if (!settings.enabled) return;
+
+        _file = fopen(settings.path.c_str(), "wb");
+        if (_file == nullptr) {
+            cout << "can not open trace file " << settings.path << ", tracing disabled" << endl;
+            return;
+        }
+        fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC), _file);
+        fwrite(&TRACE_VERSION, sizeof(TRACE_VERSION), 1, _file);
+
+        _writer = std::thread(&TplTrace::write_loop, this);
+    }
+
+    TplTrace::~TplTrace()
+    {
+        if (_file == nullptr) return;
+
+        flush();
+        {
+            lock_guard<mutex> lock(_mutex);
+            _stop = true;
+        }
+        _queued.notify_one();
+        _writer.join();
+        fclose(_file);
+    }
+
+    TplTrace &TplTrace::trace()
+    {
+        static TplTrace _instance([]() {
+            TplTraceSettings settings;
+            settings.load();
+            return settings;
+        }());
+        return _instance;
+    }
+
+    void TplTrace::record(const char *name, int iteration, const double *values, size_t n)
+    {
+        if (_file == nullptr) return;
+
+        lock_guard<mutex> lock(_mutex);
+        begin_record(VECTOR_RECORD, name, iteration);
+        const uint64_t size = n;
+        append(&size, sizeof(size));
+        append(values, n * sizeof(double));
+        submit(false);
+    }
+
+    void TplTrace::record(const char *name, int iteration, const SpMat &A)
+    {
+        if (_file == nullptr) return;
+
+        //the arrays of a compressed matrix are copied as they are
+        SpMat compressed;
+        const SpMat *C = &A;
+        if (!A.isCompressed()) {
+            compressed = A;
+            compressed.makeCompressed();
+            C = &compressed;
+        }
+
+        lock_guard<mutex> lock(_mutex);
+        begin_record(MATRIX_RECORD, name, iteration);
+        const int64_t shape[3] = {C->rows(), C->cols(), C->nonZeros()};
+        append(shape, sizeof(shape));
+        static_assert(sizeof(SpMat::StorageIndex) == sizeof(int32_t), "trace indices are 32 bit");
+        append(C->outerIndexPtr(), (C->cols() + 1) * sizeof(int32_t));
+        append(C->innerIndexPtr(), C->nonZeros() * sizeof(int32_t));
+        append(C->valuePtr(), C->nonZeros() * sizeof(double));
+        submit(false);
+    }
+
+    void TplTrace::flush()
+    {
+        if (_file == nullptr) return;
+
+        unique_lock<mutex> lock(_mutex);
+        submit(true);
+        _written.wait(lock, [this]() { return _pending.empty() && !_writing; });
+        fflush(_file);
+    }
+
+    void TplTrace::begin_record(uint32_t kind, const char *name, int iteration)
+    {
+        const uint32_t length = strlen(name);
+        const int32_t  number = iteration;
+        append(&kind, sizeof(kind));
+        append(&number, sizeof(number));
+        append(&length, sizeof(length));
+        append(name, length);
+    }
+
+    void TplTrace::append(const void *data, size_t bytes)
+    {
+        const char *first = static_cast<const char *>(data);
+        _buffer.insert(_buffer.end(), first, first + bytes);
+    }
+
+    void TplTrace::submit(bool force)
+    {
+        if (_buffer.empty() || (!force && _buffer.size() < BUFFER_BYTES)) return;
+
+        //called with _mutex held, waits for room in the queue
+        unique_lock<mutex> lock(_mutex, adopt_lock);
+        _written.wait(lock, [this]() { return _pending.size() < MAX_PENDING; });
+        lock.release();
+
+        _pending.push_back(std::move(_buffer));
+        _buffer.clear();
+        if (!_spare.empty()) {
+            _buffer.swap(_spare.back());
+            _spare.pop_back();
+        }
+        _queued.notify_one();
+    }
+
+    void TplTrace::write_loop()
+    {
+        unique_lock<mutex> lock(_mutex);
+        for (;;) {
+            _queued.wait(lock, [this]() { return _stop || !_pending.empty(); });
+            if (_pending.empty()) return;
+
+            vector<char> buffer = std::move(_pending.front());
+            _pending.pop_front();
+            _writing = true;
+
+            lock.unlock();
+            fwrite(buffer.data(), 1, buffer.size(), _file);
+            buffer.clear();
+            lock.lock();
+
+            _spare.push_back(std::move(buffer));
+            _writing = false;
+            _written.notify_all();
+        }
+    }
+
+}//end namespace tpl
@@ -0,0 +1,118 @@
+/*!
+ * \file tpl_trace.h
+ * \brief Opt-in binary trace of the placement matrices and vectors.
+ */
+
+#ifndef TPL_TRACE_H
+#define TPL_TRACE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/core/noncopyable.hpp>
+
+#include "utils.h"
+
+namespace tpl {
+
+    //! Settings of a TplTrace, read from the TPLCONFIG json file.
+    struct TplTraceSettings {
+        bool enabled = false;              //!< Whether anything is traced.
+        std::string path = "tpl_trace.bin"; //!< File the records are written to.
+        int interval = 1;                  //!< Iterations between two sampled ones.
+
+        //! Read the settings from the TPLCONFIG json file, keeping the defaults for missing keys.
+        /*!
+         * The keys are "trace_enabled", "trace_path" and "trace_interval".
+         * \return false if TPLCONFIG is not set or can not be read.
+         */
+        bool load();
+    };
+
+    //! Binary trace of the matrices and vectors of the sampled placement iterations.
+    /*!
+     * The file starts with the 8 bytes "TPLTRACE" and a 32 bit version, then holds one record
+     * after another, in the machine's byte order:
+     *   uint32 kind, int32 iteration, uint32 name length, the name's bytes, then
+     *   - kind 1, a vector: uint64 size and size doubles,
+     *   - kind 2, a sparse matrix in compressed columns: int64 rows, cols and nonzeros,
+     *     cols+1 int32 column starts, nonzeros int32 row indices and nonzeros doubles.
+     *
+     * A record is copied into a memory buffer, and full buffers are written by a background
+     * thread, so the placement thread never waits on the disk unless MAX_PENDING buffers are
+     * queued. A disabled trace opens no file and starts no thread, and the callers test
+     * sampled() before gathering anything, so a production run pays one branch per iteration.
+     */
+    class TplTrace : boost::noncopyable {
+    public:
+        //! Open the trace file and start the writer thread when the settings enable the trace.
+        explicit TplTrace(const TplTraceSettings &settings);
+
+        //! Write the buffered records, and stop the writer thread.
+        ~TplTrace();
+
+        //! The trace of the placement, set up from the TPLCONFIG json file on first use.
+        static TplTrace &trace();
+
+        //! Whether the trace is enabled and its file could be opened.
+        bool enabled() const { return _file != nullptr; }
+
+        //! Whether the records of iteration are traced.
+        bool sampled(int iteration) const { return _file != nullptr && iteration % _interval == 0; }
+
+        //! Record the vector values[0, n) of iteration.
+        void record(const char *name, int iteration, const double *values, std::size_t n);
+
+        //! Record the vector v of iteration.
+        void record(const char *name, int iteration, const VectorXd &v)
+        {
+            record(name, iteration, v.data(), v.size());
+        }
+
+        //! Record the sparse matrix A of iteration.
+        void record(const char *name, int iteration, const SpMat &A);
+
+        //! Hand the buffered records to the writer thread and wait until they are written.
+        void flush();
+
+    private:
+        //! Record header, the name and kind of a record.
+        void begin_record(std::uint32_t kind, const char *name, int iteration);
+
+        //! Copy bytes to the buffer.
+        void append(const void *data, std::size_t bytes);
+
+        //! Queue the buffer for the writer thread if it holds BUFFER_BYTES, or any record when force is set.
+        void submit(bool force);
+
+        //! Writer thread, writes the queued buffers until stopped.
+        void write_loop();
+
+        static const std::size_t BUFFER_BYTES = 1 << 22; //!< Bytes of a buffer handed to the writer.
+        static const std::size_t MAX_PENDING  = 8;       //!< Queued buffers the placement thread waits on.
+
+        std::FILE *_file = nullptr;
+        int _interval = 1;
+
+        std::vector<char>              _buffer;  //!< Records not yet queued.
+        std::deque<std::vector<char>>  _pending; //!< Buffers queued for the writer.
+        std::vector<std::vector<char>> _spare;   //!< Written buffers, kept for their capacity.
+        bool _writing = false;                   //!< Whether the writer holds a buffer out of the queue.
+        bool _stop = false;
+
+        std::mutex _mutex;
+        std::condition_variable _queued;  //!< Signaled when a buffer is queued or the writer is stopped.
+        std::condition_variable _written; //!< Signaled when a buffer is written.
+        std::thread _writer;
+    };
+
+}//end namespace tpl
+
+#endif //TPL_TRACE_H
@@ -0,0 +1,133 @@
+/*!
+ * \file tpl_workers.h
+ * \brief Threads kept waiting for the jobs of the next parallel loop.
+ */
+
+#ifndef TPL_WORKERS_H
+#define TPL_WORKERS_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace tpl {
+
+    //! Threads kept waiting for the jobs of the next round.
+    /*!
+     * A placement iteration runs many short parallel loops, a product per CG iteration or a
+     * pass per grid, so the threads are not started for every one of them. They are started
+     * by the first round that needs them and wait for the next round until the workers are
+     * destroyed.
+     *
+     * One round runs at a time, run() is not to be called from a job or from two threads.
+     */
+    class TplWorkers {
+    public:
+        //! Default constructor, no thread is started yet.
+        TplWorkers() = default;
+        TplWorkers(const TplWorkers &) = delete;
+        TplWorkers &operator=(const TplWorkers &) = delete;
+
+        //! Stop and join the threads.
+        ~TplWorkers()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stop = true;
+            }
+            _started.notify_all();
+            for (std::thread &t : _threads) {
+                t.join();
+            }
+        }
+
+        //! Run job(0), ..., job(n-1), job(t) on thread t, job(0) on the calling thread.
+        /*!
+         * Returns once every job is done. An exception of job(0) is rethrown then.
+         */
+        void run(std::size_t n, const std::function<void(std::size_t)> &job)
+        {
+            if (n == 0) return;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                while (_threads.size() + 1 < n) {
+                    _threads.emplace_back(&TplWorkers::loop, this, _threads.size() + 1, _round);
+                }
+                _job     = &job;
+                _size    = n;
+                _pending = n - 1;
+                ++_round;
+            }
+            _started.notify_all();
+
+            //the threads run job until the round is over, even if job(0) throws
+            std::exception_ptr error;
+            try {
+                job(0);
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            std::unique_lock<std::mutex> lock(_mutex);
+            _finished.wait(lock, [this]() { return _pending == 0; });
+            if (error) std::rethrow_exception(error);
+        }
+
+        //! Run job(first, last, t) over [0, n) in chunks of grain items taken in turn by num_threads threads, t being the thread's number.
+        template<typename Job>
+        void parallel_for(std::size_t n, std::size_t grain, unsigned int num_threads, const Job &job)
+        {
+            const std::size_t num_chunks = (n + grain - 1) / grain;
+            num_threads = std::min<std::size_t>(num_threads, num_chunks);
+            if (num_threads <= 1) {
+                if (n > 0) job(std::size_t(0), n, 0u);
+                return;
+            }
+
+            std::atomic<std::size_t> next_chunk(0);
+            run(num_threads, [&](std::size_t t) {
+                for (std::size_t c = next_chunk++; c < num_chunks; c = next_chunk++) {
+                    job(c * grain, std::min(n, (c+1) * grain), static_cast<unsigned int>(t));
+                }
+            });
+        }
+
+    private:
+        //! Thread t, runs job(t) of every round of more than t jobs started after round seen.
+        void loop(std::size_t t, std::size_t seen)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (;;) {
+                _started.wait(lock, [this, seen]() { return _stop || _round != seen; });
+                if (_stop) return;
+                seen = _round;
+                if (t >= _size) continue;
+
+                const std::function<void(std::size_t)> &job = *_job;
+                lock.unlock();
+                job(t);
+                lock.lock();
+                if (--_pending == 0) _finished.notify_one();
+            }
+        }
+
+        std::vector<std::thread> _threads; //!< Thread t is _threads[t-1].
+        std::mutex _mutex;
+        std::condition_variable _started;  //!< Signaled when a round starts or the threads stop.
+        std::condition_variable _finished; //!< Signaled when the last job of a round is done.
+        const std::function<void(std::size_t)> *_job = nullptr;
+        std::size_t _size    = 0;  //!< Number of jobs of the round.
+        std::size_t _round   = 0;  //!< Number of rounds started.
+        std::size_t _pending = 0;  //!< Jobs of the round the threads have not finished.
+        bool _stop = false;
+    };
+
+}//end namespace tpl
+
+#endif //TPL_WORKERS_H
@@ -11,6 +11,10 @@
 #include <Eigen/IterativeLinearSolvers>
 #include <Eigen/Cholesky>
 
+#include <vector>
+
+#include <boost/align/aligned_allocator.hpp>
+
 #ifndef NDEBUG
 #include <cstdio>
 #include <cassert>
@@ -41,6 +45,10 @@ namespace tpl {
      */
     using LLTSolver = Eigen::SimplicialLLT<SpMat>;
 
+    //! \typedef std::vector<T, boost::alignment::aligned_allocator<T, 64> > AlignedVector;
+    template<typename T>
+    using AlignedVector = std::vector<T, boost::alignment::aligned_allocator<T, 64> >;
+
 }
 
 #endif //TPL_UTILS_H
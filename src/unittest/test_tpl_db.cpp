@@ -7,10 +7,54 @@
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
 
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <map>
+
+#include <boost/filesystem.hpp>
+
 #include "tpl_db.h"
+#include "../bookshelf/bookshelf_scanner.h"
 
 using namespace std;
 using namespace tpl;
+
+//! Snapshot a copy of the circuit at path whose files were modified at source_time, then edit
+//! the x of module o0 in its .pl file without changing the file's size or modification time.
+static void edit_after_snapshot(const string &path, time_t source_time, bool &write_status, bool &read_status,
+                                Coordinate &x, Coordinate &edited_x)
+{
+    namespace fs = boost::filesystem;
+    fs::path copy = fs::temp_directory_path() / fs::unique_path("tpl-%%%%-%%%%") / "adaptec1";
+    fs::create_directories(copy);
+    for (const char *suffix : {".nodes", ".pl", ".nets"}) {
+        fs::copy_file(path + "/adaptec1" + suffix, copy / (string("adaptec1") + suffix));
+        fs::last_write_time(copy / (string("adaptec1") + suffix), source_time);
+    }
+
+    TplLoadOptions options;
+    options.use_cache = true;
+    write_status = TplDB::db().load_circuit(copy.string(), options);
+    x = TplDB::db().modules.module("o0").x;
+
+    fs::path pl = copy / "adaptec1.pl";
+    ifstream in(pl.string());
+    string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    in.close();
+    size_t at = text.find("\no0\t0\t");
+    REQUIRE(at != string::npos);
+    text[at + 4] = '1';
+    ofstream(pl.string()) << text;
+    fs::last_write_time(pl, source_time);
+
+    read_status = TplDB::db().load_circuit(copy.string(), options);
+    edited_x = TplDB::db().modules.module("o0").x;
+    fs::remove_all(copy.parent_path());
+}
+
 SCENARIO("adaptec1", "[adaptec1]") {
 
     GIVEN("A circuit adaptec1") {
@@ -26,10 +70,272 @@ SCENARIO("adaptec1", "[adaptec1]") {
                 REQUIRE(TplDB::db().modules.chip_height() == 11589);
                 REQUIRE(TplDB::db().modules.num_free() == 210904);
             }
+
+            THEN("Every pin refers to its module by index") {
+                ifstream in(path + "/adaptec1.nets");
+                string storage((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+                BookshelfNets bnets;
+                REQUIRE(scan_bookshelf_net(storage.data(), storage.data() + storage.size(), bnets) == true);
+                REQUIRE(TplDB::db().nets.num_nets() == bnets.data.size());
+
+                TplNets::const_net_iterator nit = TplDB::db().nets.cnet_begin();
+                for (size_t i=0; i<bnets.data.size(); ++i, ++nit) {
+                    const BookshelfNet &bnet = bnets.data[i];
+                    REQUIRE(nit->id == bnet.id);
+                    REQUIRE(nit->degree == bnet.degree);
+                    REQUIRE(nit->pins.size() == bnet.pins.size());
+                    for (size_t j=0; j<bnet.pins.size(); ++j) {
+                        const TplPin &pin = nit->pins[j];
+                        REQUIRE(pin.module_index < TplDB::db().modules.size());
+                        REQUIRE(TplDB::db().modules[pin.module_index].id == bnet.pins[j].id);
+                        REQUIRE(pin.io == bnet.pins[j].io);
+                        REQUIRE(pin.dx == bnet.pins[j].dx);
+                        REQUIRE(pin.dy == bnet.pins[j].dy);
+                    }
+                }
+            }
+        }
+
+        WHEN("We traverse the netlist as a list of nets and in compressed sparse row form") {
+            TplDB::db().load_circuit(path);
+            const TplModules &modules = TplDB::db().modules;
+            const TplNets    &nets    = TplDB::db().nets;
+
+            //the former layout, every net a list node with its own pin vector
+            list<TplNet> netlist;
+            for (TplNets::const_net_iterator nit=nets.cnet_begin(); nit!=nets.cnet_end(); ++nit) {
+                netlist.push_back(TplNet{nit->id, nit->degree, vector<TplPin>(nit->pins.begin(), nit->pins.end())});
+            }
+
+            double list_sum = 0, csr_sum = 0;
+            for (list<TplNet>::const_iterator nit=netlist.begin(); nit!=netlist.end(); ++nit) {
+                for (vector<TplPin>::const_iterator pit=nit->pins.begin(); pit!=nit->pins.end(); ++pit) {
+                    list_sum += modules[pit->module_index].x + pit->dx;
+                }
+            }
+            for (TplNets::const_net_iterator nit=nets.cnet_begin(); nit!=nets.cnet_end(); ++nit) {
+                for (TplNets::const_pin_iterator pit=nets.cpin_begin(nit); pit!=nets.cpin_end(nit); ++pit) {
+                    csr_sum += modules[pit->module_index].x + pit->dx;
+                }
+            }
+
+            THEN("Both traversals visit the same pins") {
+                REQUIRE(list_sum == csr_sum);
+            }
+        }
+
+        WHEN("We look at the modules' geometry as a structure of arrays") {
+            TplDB::db().load_circuit(path);
+            TplModules &modules = TplDB::db().modules;
+            const TplModuleGeometry &g = modules.geometry();
+
+            THEN("The arrays are aligned and mirror the modules") {
+                REQUIRE(reinterpret_cast<uintptr_t>(g.x.data()) % 64 == 0);
+                REQUIRE(reinterpret_cast<uintptr_t>(g.power_density.data()) % 64 == 0);
+                REQUIRE(g.x.size() == modules.size());
+                for (size_t i=0; i<modules.size(); ++i) {
+                    REQUIRE(g.x[i]      == modules[i].x);
+                    REQUIRE(g.y[i]      == modules[i].y);
+                    REQUIRE(g.width[i]  == modules[i].width);
+                    REQUIRE(g.height[i] == modules[i].height);
+                    REQUIRE(g.power_density[i] == modules[i].power_density);
+                    REQUIRE(g.fixed[i]  == modules[i].fixed);
+                }
+            }
+
+            THEN("Both views follow the modules' moves") {
+                vector<double> xs(modules.num_free(), 100), ys(modules.num_free(), 200);
+                modules.set_free_module_coordinates(xs, ys);
+                REQUIRE(modules.geometry().x[0] == modules[0].x);
+                REQUIRE(modules.geometry().y[0] == 200 - modules[0].height / 2.0);
+
+                vector<double> delta(modules.num_free(), 1);
+                modules.move_free_modules(delta.data(), delta.data());
+                REQUIRE(modules.geometry().x[0] == modules[0].x);
+                REQUIRE(modules.geometry().y[0] == 201 - modules[0].height / 2.0);
+
+                const TplModuleGeometry &mirror = modules.geometry();
+                modules.set_position(0, 7, 8);
+                modules.set_size(0, 3, 4);
+                REQUIRE(mirror.x[0] == 7);
+                REQUIRE(mirror.y[0] == 8);
+                REQUIRE(mirror.width[0]  == 3);
+                REQUIRE(mirror.height[0] == 4);
+                REQUIRE(modules[0].x == 7);
+                REQUIRE(modules[0].height == 4);
+            }
+        }
+
+        WHEN("We load the circuit by copying and by memory mapping") {
+            TplLoadOptions options;
+            options.use_cache = false;
+
+            options.mode = LoadMode::Copy;
+            bool copy_status = TplDB::db().load_circuit(path, options);
+            unsigned int copy_modules = TplDB::db().modules.size();
+            unsigned int copy_nets    = TplDB::db().nets.num_nets();
+            unsigned int copy_pins    = TplDB::db().nets.num_pins();
+
+            options.mode = LoadMode::Mmap;
+            bool mmap_status = TplDB::db().load_circuit(path, options);
+
+            THEN("Both modes get the same circuit") {
+                REQUIRE(copy_status == true);
+                REQUIRE(mmap_status == true);
+                REQUIRE(TplDB::db().modules.size()   == copy_modules);
+                REQUIRE(TplDB::db().nets.num_nets()  == copy_nets);
+                REQUIRE(TplDB::db().nets.num_pins()  == copy_pins);
+            }
+        }
+
+        WHEN("We load the circuit from the bookshelf files and then from its snapshot") {
+            TplLoadOptions options;
+            options.use_cache = false;
+            bool parse_status = TplDB::db().load_circuit(path, options);
+            vector<TplModule> parsed_modules(TplDB::db().modules.cbegin(), TplDB::db().modules.cend());
+            unsigned int parsed_free = TplDB::db().modules.num_free();
+            Length parsed_width  = TplDB::db().modules.chip_width();
+            Length parsed_height = TplDB::db().modules.chip_height();
+            unsigned int parsed_nets = TplDB::db().nets.num_nets();
+            unsigned int parsed_pins = TplDB::db().nets.num_pins();
+
+            options.use_cache = true;
+            bool write_status = TplDB::db().load_circuit(path, options);
+            bool read_status  = TplDB::db().load_circuit(path, options);
+
+            THEN("The snapshot holds the same circuit") {
+                REQUIRE(parse_status == true);
+                REQUIRE(write_status == true);
+                REQUIRE(read_status  == true);
+                REQUIRE(TplDB::db().modules.size()        == parsed_modules.size());
+                REQUIRE(TplDB::db().modules.num_free()    == parsed_free);
+                REQUIRE(TplDB::db().modules.chip_width()  == parsed_width);
+                REQUIRE(TplDB::db().modules.chip_height() == parsed_height);
+                REQUIRE(TplDB::db().nets.num_nets() == parsed_nets);
+                REQUIRE(TplDB::db().nets.num_pins() == parsed_pins);
+                for (size_t i=0; i<parsed_modules.size(); ++i) {
+                    REQUIRE(TplDB::db().modules[i].id     == parsed_modules[i].id);
+                    REQUIRE(TplDB::db().modules[i].x      == parsed_modules[i].x);
+                    REQUIRE(TplDB::db().modules[i].y      == parsed_modules[i].y);
+                    REQUIRE(TplDB::db().modules[i].width  == parsed_modules[i].width);
+                    REQUIRE(TplDB::db().modules[i].fixed  == parsed_modules[i].fixed);
+                }
+            }
+        }
+
+        WHEN("We edit a source file modified right before the snapshot, keeping its size and time") {
+            bool write_status, read_status;
+            Coordinate x, edited_x;
+            edit_after_snapshot(path, time(nullptr), write_status, read_status, x, edited_x);
+
+            THEN("The content hash finds the snapshot stale and the circuit is parsed again") {
+                REQUIRE(write_status == true);
+                REQUIRE(read_status  == true);
+                REQUIRE(edited_x == x + 1);
+            }
+        }
+
+        WHEN("We edit a source file modified long before the snapshot, keeping its size and time") {
+            bool write_status, read_status;
+            Coordinate x, edited_x;
+            edit_after_snapshot(path, time(nullptr) - 3600, write_status, read_status, x, edited_x);
+
+            THEN("Size and time are trusted without reading the file, the snapshot is used") {
+                REQUIRE(write_status == true);
+                REQUIRE(read_status  == true);
+                REQUIRE(edited_x == x);
+            }
         }
     }
 }//end adaptec1
 
+//! Two free cells "a" and "b", then the macro "m" at (100, 100), shredded into three cells.
+static TplModules shredded_macro(map<Id, vector<TplModule>> &macro_cells)
+{
+    vector<TplModule> data;
+    data.emplace_back("a", 0, 0, 1, 1, false, 1.0);
+    data.emplace_back("b", 5, 5, 1, 1, false, 1.0);
+    data.emplace_back("m", 100, 100, 10, 30, true, 1.0);
+    TplModules modules(std::move(data), 2);
+
+    macro_cells["m"].emplace_back("m_0", 10, 40, 30, 10, false, 1.0);
+    macro_cells["m"].emplace_back("m_1", 20, 40, 30, 10, false, 1.0);
+    macro_cells["m"].emplace_back("m_2", 30, 40, 30, 10, false, 1.0);
+    return modules;
+}
+
+SCENARIO("shredded macros", "[shred]") {
+
+    GIVEN("A macro shredded into three cells") {
+        map<Id, vector<TplModule>> macro_cells;
+        TplModules modules = shredded_macro(macro_cells);
+        modules.add_shredded_cells(macro_cells);
+
+        THEN("Every cell is found at its own index") {
+            REQUIRE(modules.size() == 5);
+            for (const char *id : {"a", "b", "m_0", "m_1", "m_2"}) {
+                REQUIRE(modules[modules.module_index(id)].id == id);
+            }
+        }
+
+        WHEN("We aggregate the cells back into the macro") {
+            modules.aggregate_cells();
+
+            THEN("The macro is back at its index, at the cells' mean position") {
+                REQUIRE(modules.size() == 3);
+                REQUIRE(modules.module_index("a") == 0);
+                REQUIRE(modules.module_index("b") == 1);
+                REQUIRE(modules.module_index("m") == 2);
+                REQUIRE(modules[2].x == 20);
+                REQUIRE(modules[2].y == 40);
+                //the cells spread in x only, so the tall macro is turned wide
+                REQUIRE(modules[2].width  == 30);
+                REQUIRE(modules[2].height == 10);
+            }
+        }
+    }
+
+    GIVEN("Nets with two nets between shredded cells added") {
+        TplPin pin;
+        pin.io = IOType::Input;
+        pin.dx = 0;
+        pin.dy = 0;
+        TplNet net;
+        net.degree = 2;
+        net.pins.assign(2, pin);
+
+        vector<TplNet> origin(3, net), shredded(2, net);
+        TplNets nets;
+        nets.assign(origin);
+        const std::uint64_t origin_revision = nets.revision();
+        nets.backup_net();
+        nets.add_net(shredded);
+
+        WHEN("We move them to other nets") {
+            TplNets moved(std::move(nets));
+            TplNets assigned;
+            assigned = std::move(moved);
+
+            THEN("The shredded nets are still told apart from the original ones") {
+                REQUIRE(assigned.num_nets() == 5);
+                REQUIRE(assigned.num_origin_nets() == 3);
+            }
+        }
+
+        WHEN("We delete the shredded nets") {
+            const std::uint64_t shredded_revision = nets.revision();
+            nets.delete_net();
+
+            THEN("Every change of the nets gave them a new revision") {
+                REQUIRE(nets.num_nets() == 3);
+                REQUIRE(shredded_revision != origin_revision);
+                REQUIRE(nets.revision() != origin_revision);
+                REQUIRE(nets.revision() != shredded_revision);
+            }
+        }
+    }
+}//end shredded macros
+
 /*
 SCENARIO("adaptec2", "[adaptec2]") {
 
@@ -165,4 +471,57 @@ SCENARIO("bigblue4", "[bigblue4]") {
 }//end bigblue4
  */
 
+//! Print the time of a pass over every pin of the circuit at path, through a list of nets and through TplNets.
+/*!
+ * The list is copied from TplNets in one pass, the way the former TplNets(const BookshelfNets &)
+ * copied the parsed nets into its std::list, so it is the layout the compressed rows replaced.
+ */
+static void report_net_traversal(const string &path)
+{
+    TplDB::db().load_circuit(path);
+    const TplModules &modules = TplDB::db().modules;
+    const TplNets    &nets    = TplDB::db().nets;
+
+    list<TplNet> netlist;
+    for (TplNets::const_net_iterator nit=nets.cnet_begin(); nit!=nets.cnet_end(); ++nit) {
+        netlist.push_back(TplNet{nit->id, nit->degree, vector<TplPin>(nit->pins.begin(), nit->pins.end())});
+    }
+
+    const int iterations = 10;
+    double list_sum = 0, csr_sum = 0;
 
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int k=0; k<iterations; ++k) {
+        for (list<TplNet>::const_iterator nit=netlist.begin(); nit!=netlist.end(); ++nit) {
+            for (vector<TplPin>::const_iterator pit=nit->pins.begin(); pit!=nit->pins.end(); ++pit) {
+                list_sum += modules[pit->module_index].x + pit->dx;
+            }
+        }
+    }
+    double list_time = chrono::duration<double>(chrono::steady_clock::now() - start).count() / iterations;
+
+    start = chrono::steady_clock::now();
+    for (int k=0; k<iterations; ++k) {
+        for (TplNets::const_net_iterator nit=nets.cnet_begin(); nit!=nets.cnet_end(); ++nit) {
+            for (TplNets::const_pin_iterator pit=nets.cpin_begin(nit); pit!=nets.cpin_end(nit); ++pit) {
+                csr_sum += modules[pit->module_index].x + pit->dx;
+            }
+        }
+    }
+    double csr_time = chrono::duration<double>(chrono::steady_clock::now() - start).count() / iterations;
+
+    cout << path << " net traversal : list " << list_time << "s, csr " << csr_time << "s per pass" << endl;
+    REQUIRE(list_sum == csr_sum);
+}
+
+SCENARIO("net traversal", "[benchmark][.]") {
+
+    GIVEN("The circuits adaptec1 and bigblue4") {
+        string path(getenv("BENCHMARK"));
+
+        THEN("We print the time of a pass over the pins as a list of nets and in compressed rows") {
+            report_net_traversal(path + "/ispd2005/adaptec1");
+            report_net_traversal(path + "/ispd2005/bigblue4");
+        }
+    }
+}//end net traversal
@@ -0,0 +1,174 @@
+/*!
+ * \file test_tpl_overlap.cpp
+ * \brief Overlap engine unittest.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include "tpl_db.h"
+#include "tpl_overlap.h"
+#include "test_utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+using namespace std;
+using namespace tpl;
+
+//! Geometry of n random rectangles, some of them crossing the chip [0, 1000]^2.
+static TplModuleGeometry random_rectangles(size_t n)
+{
+    TplModuleGeometry g;
+    srand(12345);
+    for (size_t i=0; i<n; ++i) {
+        g.x.push_back(rand() % 1100 - 50 + (i % 3) * 0.25);
+        g.y.push_back(rand() % 1100 - 50 - (i % 5) * 0.5);
+        g.width.push_back(1 + rand() % 150);
+        g.height.push_back(i % 7 == 0 ? 0 : 1 + rand() % 150);
+    }
+    return g;
+}
+
+//! Union area of the rectangles, by testing the center of every cell of the coordinate grid.
+static double brute_force_union(const TplModuleGeometry &g, size_t n)
+{
+    vector<double> xs, ys;
+    for (size_t i=0; i<n; ++i) {
+        xs.push_back(g.x[i]);
+        xs.push_back(g.x[i] + g.width[i]);
+        ys.push_back(g.y[i]);
+        ys.push_back(g.y[i] + g.height[i]);
+    }
+    sort(xs.begin(), xs.end());
+    sort(ys.begin(), ys.end());
+    xs.erase(unique(xs.begin(), xs.end()), xs.end());
+    ys.erase(unique(ys.begin(), ys.end()), ys.end());
+
+    double area = 0;
+    for (size_t a=0; a+1<xs.size(); ++a) {
+        for (size_t b=0; b+1<ys.size(); ++b) {
+            double x = (xs[a] + xs[a+1]) / 2, y = (ys[b] + ys[b+1]) / 2;
+            for (size_t i=0; i<n; ++i) {
+                if (g.x[i] < x && x < g.x[i] + g.width[i] && g.y[i] < y && y < g.y[i] + g.height[i]) {
+                    area += (xs[a+1] - xs[a]) * (ys[b+1] - ys[b]);
+                    break;
+                }
+            }
+        }
+    }
+    return area;
+}
+
+//! Require the overlap of the n modules of g to be the single sweep one, cut in 1 to 32 strips.
+static void check_overlap_strips(const TplModuleGeometry &g, size_t n, bool report)
+{
+    TplOverlapEngine engine;
+    const double expected = engine.exact_overlap(g, n, 1);
+
+    double exact = 0;
+    unsigned int strips = 1;
+    sweep_threads(report ? "exact overlap" : nullptr,
+                  [&](unsigned int num_strips) { strips = num_strips; },
+                  [&]() { exact = engine.exact_overlap(g, n, strips); },
+                  [&](unsigned int) { REQUIRE( std::abs(exact - expected) <= 1e-9 ); });
+}
+
+SCENARIO("random rectangles", "[overlap]") {
+
+    GIVEN("150 random rectangles") {
+        const size_t n = 150;
+        TplModuleGeometry g = random_rectangles(n);
+        TplOverlapEngine engine;
+
+        WHEN("We compute the exact and the estimated overlap twice") {
+            double exact = engine.exact_overlap(g, n);
+            double union_area = engine.union_area();
+            double estimate = engine.estimated_overlap(g, n, 1000, 1000);
+            double again = engine.exact_overlap(g, n);
+
+            THEN("The exact overlap is the brute force one, and the estimate is below it") {
+                double expected = brute_force_union(g, n);
+                REQUIRE( std::abs(union_area - expected) <= 1e-9 * expected );
+                REQUIRE( again == exact );
+                REQUIRE( estimate <= exact + 1e-12 );
+            }
+        }
+
+        WHEN("We sweep the rectangles in 1 to 8 strips") {
+            THEN("Every strip count gets the brute force union area") {
+                double expected = brute_force_union(g, n);
+                for (unsigned int num_strips=1; num_strips<=8; ++num_strips) {
+                    engine.exact_overlap(g, n, num_strips);
+                    REQUIRE( std::abs(engine.union_area() - expected) <= 1e-9 * expected );
+                }
+            }
+        }
+    }
+}//end SCENARIO
+
+SCENARIO("adaptec1 overlap", "[adaptec1]") {
+
+    GIVEN("A circuit adaptec1") {
+        string path(getenv("BENCHMARK"));
+        path += "/ispd2005/adaptec1";
+
+        TplDB::db().load_circuit(path);
+        TplDB::db().modules.set_random_position();
+        const TplModuleGeometry &g = TplDB::db().modules.geometry();
+        const size_t n = TplDB::db().modules.size();
+
+        WHEN("We compute the exact and the estimated overlap") {
+            TplOverlapEngine engine;
+            double exact = engine.exact_overlap(g, n);
+            double estimate = engine.estimated_overlap(g, n, TplDB::db().modules.chip_width(), TplDB::db().modules.chip_height());
+
+            THEN("The estimate is a lower bound of the exact overlap") {
+                REQUIRE( 0 <= exact );
+                REQUIRE( exact <= 1 );
+                REQUIRE( estimate <= exact + 1e-12 );
+            }
+        }
+
+        WHEN("We compute the exact overlap in 1 to 32 strips") {
+            THEN("Every strip count gets the single sweep result") {
+                check_overlap_strips(g, n, false);
+            }
+        }
+    }
+}//end SCENARIO
+
+SCENARIO("overlap scaling", "[benchmark][.]") {
+
+    for (const string &circuit : SWEEP_CIRCUITS) {
+        GIVEN("A circuit " + circuit) {
+            load_benchmark(circuit);
+            TplDB::db().modules.set_random_position();
+            const TplModuleGeometry &g = TplDB::db().modules.geometry();
+            const size_t n = TplDB::db().modules.size();
+
+            WHEN("We time the exact and the estimated overlap") {
+                TplOverlapEngine engine;
+                double exact = 0, estimate = 0;
+                sweep_threads("exact overlap", [](unsigned int) {},
+                              [&]() { exact = engine.exact_overlap(g, n); },
+                              [](unsigned int) {}, {engine.num_threads()});
+                sweep_threads("estimated overlap", [](unsigned int) {},
+                              [&]() { estimate = engine.estimated_overlap(g, n, TplDB::db().modules.chip_width(), TplDB::db().modules.chip_height()); },
+                              [](unsigned int) {}, {1});
+                printf("exact overlap %.6f, estimated overlap %.6f\n", exact, estimate);
+
+                THEN("The estimate is a lower bound of the exact overlap") {
+                    REQUIRE( estimate <= exact + 1e-12 );
+                }
+            }
+
+            WHEN("We compute the exact overlap in 1 to 32 strips") {
+                THEN("Every strip count gets the single sweep result") {
+                    check_overlap_strips(TplDB::db().modules.geometry(), TplDB::db().modules.size(), true);
+                }
+            }
+        }
+    }
+}//end SCENARIO
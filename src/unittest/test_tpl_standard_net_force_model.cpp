@@ -7,14 +7,291 @@
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
 #include <fstream>
+#include <set>
 
 #include "tpl_db.h"
 #include "tpl_standard_net_model.h"
 #include "tpl_standard_net_force_model.h"
+#include "test_utils.h"
 
 using namespace std;
 using namespace tpl;
 
+//! Assemble Cx for the current placement, plus a small diagonal shift keeping it positive definite.
+static SpMat assemble_x_matrix(TplStandardNetModel &nmodel, TplStandardNetForceModel &nfmodel, VectorXd &dx)
+{
+    NetWeight NWx, NWy;
+    nmodel.compute_net_weight(NWx, NWy);
+
+    int num_free = TplDB::db().modules.num_free();
+    SpMat Cx(num_free, num_free), Cy(num_free, num_free);
+    VectorXd dy(num_free);
+    dx.resize(num_free);
+    nfmodel.compute_net_force_matrix(NWx, NWy, Cx, Cy, dx, dy);
+
+    //like the move force matrix does in the global placement
+    for (int i=0; i<num_free; ++i) Cx.coeffRef(i, i) += 1e-3;
+    return Cx;
+}
+
+//! Cx and dx summed up from triplets, the reference of the assembly on the pattern.
+static SpMat reference_x_matrix(const NetWeight &NWx, VectorXd &rdx)
+{
+    const TplModules &modules = TplDB::db().modules;
+    const TplNets    &nets    = TplDB::db().nets;
+    int num_free = modules.num_free();
+
+    vector<SpElem> coefficients;
+    rdx = VectorXd::Zero(num_free);
+    for (size_t k=0; k<NWx.size(); ++k) {
+        const TplPin &p1 = nets.pin(NWx.pin1[k]), &p2 = nets.pin(NWx.pin2[k]);
+        int i1 = p1.module_index, i2 = p2.module_index;
+        bool f1 = modules[i1].fixed, f2 = modules[i2].fixed;
+        double w = NWx.weight[k];
+        if (!f1) coefficients.push_back(SpElem(i1, i1, w));
+        if (!f2) coefficients.push_back(SpElem(i2, i2, w));
+        if (!f1 && !f2) {
+            coefficients.push_back(SpElem(i1, i2, -w));
+            coefficients.push_back(SpElem(i2, i1, -w));
+            rdx(i1) += w*(p1.dx - p2.dx);
+            rdx(i2) += w*(p2.dx - p1.dx);
+        } else if (!f1 && f2) {
+            rdx(i1) += w*(p1.dx - p2.dx - modules[i2].x);
+        } else if (f1 && !f2) {
+            rdx(i2) += w*(p2.dx - p1.dx - modules[i1].x);
+        }
+    }
+    SpMat reference(num_free, num_free);
+    reference.setFromTriplets(coefficients.begin(), coefficients.end());
+    return reference;
+}
+
+//! Number of pairs of distinct modules tied by the net weights of either direction.
+static size_t count_module_pairs(const NetWeight &NWx, const NetWeight &NWy)
+{
+    const TplNets &nets = TplDB::db().nets;
+    set<pair<int, int>> pairs;
+    for (const NetWeight *NW : {&NWx, &NWy}) {
+        for (size_t k=0; k<NW->size(); ++k) {
+            int i1 = nets.pin(NW->pin1[k]).module_index, i2 = nets.pin(NW->pin2[k]).module_index;
+            if (i1 != i2) pairs.insert(make_pair(min(i1, i2), max(i1, i2)));
+        }
+    }
+    return pairs.size();
+}
+
+//! Require the lower triangle product to be the full product, with 1 to 32 threads and back to fewer.
+/*!
+ * With report set, the time and bandwidth of both products are printed.
+ */
+static void check_symmetric_product(const SpMat &C, bool report)
+{
+    VectorXd x = VectorXd::Random(C.cols());
+    VectorXd expected, y;
+    const int repetitions = 10;
+
+    const double full_bytes = C.nonZeros() * (sizeof(double) + sizeof(int)) + (C.outerSize() + 1) * sizeof(int);
+    sweep_threads(report ? "full product" : nullptr,
+                  [](unsigned int) {},
+                  [&]() { expected = C * x; },
+                  [](unsigned int) {},
+                  {1}, repetitions, full_bytes);
+
+    TplSymmetricMatrix M;
+    M.assign(C);
+    REQUIRE( M.num_stored() == static_cast<size_t>((C.nonZeros() + C.rows()) / 2) );
+
+    //more threads, then fewer, so the waiting threads skip the products they have no range of
+    sweep_threads(report ? "lower product" : nullptr,
+                  [&](unsigned int num_threads) { M.set_num_threads(num_threads); },
+                  [&]() { M.multiply(x, y); },
+                  [&](unsigned int) { REQUIRE( (y - expected).norm() <= 1e-12 * (1 + expected.norm()) ); },
+                  {1, 2, 4, 8, 16, 32, 2, 8}, repetitions, M.bytes());
+}
+
+//! Random symmetric n x n matrix, every row with a diagonal entry and up to 2 * band off diagonal ones.
+static SpMat random_symmetric_matrix(int n, int band)
+{
+    srand(12345);
+    vector<SpElem> entries;
+    for (int i=0; i<n; ++i) {
+        entries.push_back(SpElem(i, i, 1 + rand() % 100));
+        for (int k=0; k<band; ++k) {
+            int j = i - 1 - rand() % (4 * band);
+            if (j < 0) continue;
+            double v = -(1 + rand() % 100) / 100.0;
+            entries.push_back(SpElem(i, j, v));
+            entries.push_back(SpElem(j, i, v));
+        }
+    }
+    SpMat C(n, n);
+    C.setFromTriplets(entries.begin(), entries.end());
+    return C;
+}
+
+SCENARIO("symmetric product", "[symmetric]") {
+
+    GIVEN("A random symmetric matrix of 200000 rows") {
+        SpMat C = random_symmetric_matrix(200000, 5);
+
+        THEN("Every thread count gets the product of the full matrix") {
+            check_symmetric_product(C, false);
+        }
+
+        WHEN("A matrix of the same pattern, then one of another pattern, are assigned after it") {
+            TplSymmetricMatrix M;
+            M.assign(C);
+
+            SpMat D = C * 2;
+            D.coeffRef(0, 0) = 7;
+            M.assign(D);
+            VectorXd x = VectorXd::Random(D.cols()), y;
+            M.multiply(x, y);
+            VectorXd expected = D * x;
+
+            SpMat E = random_symmetric_matrix(1000, 3);
+            M.assign(E);
+            VectorXd u = VectorXd::Random(E.cols()), v;
+            M.multiply(u, v);
+            VectorXd expected_e = E * u;
+
+            THEN("Every product is the one of the matrix assigned last") {
+                REQUIRE( (y - expected).norm() <= 1e-12 * (1 + expected.norm()) );
+                REQUIRE( M.num_stored() == static_cast<size_t>((E.nonZeros() + E.rows()) / 2) );
+                REQUIRE( (v - expected_e).norm() <= 1e-12 * (1 + expected_e.norm()) );
+            }
+        }
+    }
+}//end SCENARIO
+
+SCENARIO("pattern of shredded nets", "[shred]") {
+
+    GIVEN("A net on 20 shredded cells still of degree 2, and a net on 3 of them") {
+        const int num_cells = 20;
+        vector<TplModule> data;
+        for (int i=0; i<num_cells; ++i) {
+            data.emplace_back("m_" + to_string(i), 10 * i, 0, 10, 10, false, 1.0);
+        }
+        load_netlist(std::move(data), {make_net(num_cells, 2), make_net(3)});
+
+        WHEN("We compute the net force matrices") {
+            TplStandardNetForceModel nfmodel;
+            NetWeight NWx, NWy;
+            SpMat Cx(num_cells, num_cells), Cy(num_cells, num_cells);
+            VectorXd dx(num_cells), dy(num_cells);
+            nfmodel.compute_net_force_matrix(NWx, NWy, Cx, Cy, dx, dy);
+
+            THEN("The pattern holds the diagonal and the clique of the small net only") {
+                REQUIRE( nfmodel.pattern().rows() == num_cells );
+                REQUIRE( nfmodel.pattern().nonZeros() == num_cells + 6 );
+            }
+        }
+    }
+
+    GIVEN("One net of 20 cells, too large for a clique, placed in a scattered order") {
+        const int num_cells = 20;
+        vector<TplModule> data;
+        for (int i=0; i<num_cells; ++i) {
+            data.emplace_back("c_" + to_string(i), 10 * ((7 * i) % num_cells), 10 * ((3 * i) % num_cells), 5, 5, false, 1.0);
+        }
+        load_netlist(std::move(data), {make_net(num_cells)});
+
+        TplStandardNetModel nmodel;
+        TplStandardNetForceModel nfmodel;
+        NetWeight NWx, NWy;
+        SpMat Cx(num_cells, num_cells), Cy(num_cells, num_cells);
+        VectorXd dx(num_cells), dy(num_cells);
+
+        nmodel.compute_net_weight(NWx, NWy);
+        nfmodel.compute_net_force_matrix(NWx, NWy, Cx, Cy, dx, dy);
+        const long first_nonzeros = nfmodel.pattern().nonZeros();
+
+        WHEN("We move the cells so that other cells are at the net's boundary, then move them back") {
+            vector<double> x(num_cells), y(num_cells);
+            for (int i=0; i<num_cells; ++i) {
+                x[i] = 10 * i;
+                y[i] = 10 * ((11 * i) % num_cells);
+            }
+            TplDB::db().modules.set_free_module_coordinates(x, y);
+            nmodel.compute_net_weight(NWx, NWy);
+            nfmodel.compute_net_force_matrix(NWx, NWy, Cx, Cy, dx, dy);
+
+            VectorXd rdx;
+            SpMat reference = reference_x_matrix(NWx, rdx);
+            SpMat moved_Cx  = Cx;
+            NetWeight moved_NWx = NWx;
+            const long moved_nonzeros = nfmodel.pattern().nonZeros();
+            const size_t moved_pairs  = count_module_pairs(NWx, NWy);
+
+            for (int i=0; i<num_cells; ++i) {
+                x[i] = 10 * ((7 * i) % num_cells);
+                y[i] = 10 * ((3 * i) % num_cells);
+            }
+            TplDB::db().modules.set_free_module_coordinates(x, y);
+            nmodel.compute_net_weight(NWx, NWy);
+            nfmodel.compute_net_force_matrix(NWx, NWy, Cx, Cy, dx, dy);
+
+            THEN("The pattern holds the current connections only, and does not grow") {
+                REQUIRE( count_module_pairs(NWx, moved_NWx) > count_module_pairs(NWx, NWx) );
+                REQUIRE( moved_nonzeros == static_cast<long>(num_cells + 2 * moved_pairs) );
+                REQUIRE( (SpMat(moved_Cx - reference)).norm() <= 1e-12 * (1 + reference.norm()) );
+                REQUIRE( nfmodel.pattern().nonZeros() == first_nonzeros );
+                REQUIRE( first_nonzeros == static_cast<long>(num_cells + 2 * count_module_pairs(NWx, NWy)) );
+            }
+        }
+    }
+}//end SCENARIO
+
+SCENARIO("lower triangle solver", "[solver]") {
+
+    GIVEN("A solver on the lower triangle, and tridiagonal systems of 50 and 30 rows") {
+        TplSolverSettings settings;
+        settings.tolerance = 1e-12;
+        settings.warm_start = false;
+        TplLinearSolver solver("tridiagonal", settings);
+
+        auto tridiagonal = [](int n) {
+            vector<SpElem> entries;
+            for (int i=0; i<n; ++i) {
+                entries.push_back(SpElem(i, i, 4));
+                if (i > 0) {
+                    entries.push_back(SpElem(i, i-1, -1));
+                    entries.push_back(SpElem(i-1, i, -1));
+                }
+            }
+            SpMat A(n, n);
+            A.setFromTriplets(entries.begin(), entries.end());
+            return A;
+        };
+
+        WHEN("We solve the large system, then the small one") {
+            SpMat A = tridiagonal(50), B = tridiagonal(30);
+            VectorXd a = VectorXd::Ones(50), b = VectorXd::Ones(30), x, y;
+            bool a_ok = solver.solve(A, a, x);
+            bool b_ok = solver.solve(B, b, y);
+
+            THEN("Both converge to their own solution") {
+                REQUIRE( a_ok );
+                REQUIRE( b_ok );
+                REQUIRE( (A * x - a).norm() <= 1e-10 );
+                REQUIRE( (B * y - b).norm() <= 1e-10 );
+            }
+        }
+
+        WHEN("We allow a single iteration") {
+            settings.max_iterations = 1;
+            solver.set_settings(settings);
+            SpMat A = tridiagonal(50);
+            VectorXd a = VectorXd::LinSpaced(50, 1, 50), x;
+
+            THEN("The solve reports that it did not converge") {
+                REQUIRE_FALSE( solver.solve(A, a, x) );
+                REQUIRE( solver.iterations() == 1 );
+            }
+        }
+    }
+}//end SCENARIO
+
 SCENARIO("adaptec1", "[adaptec1]") {
 
     GIVEN("A circuit adaptec1") {
@@ -26,6 +303,88 @@ SCENARIO("adaptec1", "[adaptec1]") {
         TplStandardNetModel nmodel;
         TplStandardNetForceModel nfmodel;
 
+        WHEN("We assemble the net force matrices twice") {
+            TplDB::db().modules.set_random_position();
+            NetWeight NWx, NWy;
+            nmodel.compute_net_weight(NWx, NWy);
+
+            int num_free = TplDB::db().modules.num_free();
+            SpMat Cx(num_free, num_free), Cy(num_free, num_free);
+            VectorXd dx(num_free), dy(num_free);
+            nfmodel.compute_net_force_matrix(NWx, NWy, Cx, Cy, dx, dy);
+
+            VectorXd rdx;
+            SpMat reference = reference_x_matrix(NWx, rdx);
+
+            THEN("They match the matrices summed up from triplets") {
+                REQUIRE( (SpMat(Cx - reference)).norm() <= 1e-9 * (1 + reference.norm()) );
+                REQUIRE( (dx - rdx).norm() <= 1e-9 * (1 + rdx.norm()) );
+            }
+
+            THEN("The second assembly reuses the sparsity pattern") {
+                const double *values = Cx.valuePtr();
+                SpMat Cx1 = Cx;
+                nfmodel.compute_net_force_matrix(NWx, NWy, Cx, Cy, dx, dy);
+
+                REQUIRE( Cx.valuePtr() == values );
+                REQUIRE( (SpMat(Cx - Cx1)).norm() == 0 );
+            }
+        }
+
+        WHEN("We solve the x system with both preconditioners") {
+            TplDB::db().modules.set_random_position();
+            VectorXd dx;
+            SpMat Cx = assemble_x_matrix(nmodel, nfmodel, dx);
+
+            TplSolverSettings settings;
+            settings.tolerance = 1e-10;
+            settings.warm_start = false;
+            TplLinearSolver diagonal("diagonal", settings);
+            settings.preconditioner = Preconditioner::IncompleteCholesky;
+            TplLinearSolver cholesky("incomplete cholesky", settings);
+
+            VectorXd x_diagonal, x_cholesky;
+            bool diagonal_ok = diagonal.solve(Cx, -dx, x_diagonal);
+            bool cholesky_ok = cholesky.solve(Cx, -dx, x_cholesky);
+
+            THEN("They converge to the same solution, the incomplete Cholesky one in fewer iterations") {
+                REQUIRE( diagonal_ok );
+                REQUIRE( cholesky_ok );
+                REQUIRE( (x_diagonal - x_cholesky).norm() <= 1e-6 * (1 + x_diagonal.norm()) );
+                REQUIRE( cholesky.iterations() <= diagonal.iterations() );
+            }
+
+            THEN("The lower triangle solve agrees with Eigen's solve on both triangles") {
+                TplSolverSettings settings;
+                settings.tolerance = 1e-10;
+                settings.warm_start = false;
+                settings.symmetric = false;
+                TplLinearSolver full("full", settings);
+
+                VectorXd x_full;
+                REQUIRE( full.solve(Cx, -dx, x_full) );
+                REQUIRE( (x_full - x_diagonal).norm() <= 1e-6 * (1 + x_full.norm()) );
+            }
+
+            THEN("A warm start from the solution takes no iteration") {
+                settings.warm_start = true;
+                cholesky.set_settings(settings);
+                VectorXd x = x_cholesky;
+                REQUIRE( cholesky.solve(Cx, -dx, x) );
+                REQUIRE( cholesky.iterations() <= 1 );
+            }
+        }
+
+        WHEN("We multiply by the lower triangle of Cx only") {
+            TplDB::db().modules.set_random_position();
+            VectorXd dx;
+            SpMat Cx = assemble_x_matrix(nmodel, nfmodel, dx);
+
+            THEN("Every thread count gets the product of the full matrix") {
+                check_symmetric_product(Cx, false);
+            }
+        }
+
         WHEN("We compute the net force target") {
             TplDB::db().modules.move_to_center();
             NetWeight NWx, NWy;
@@ -61,6 +420,28 @@ SCENARIO("adaptec1", "[adaptec1]") {
     }
 }//end SCENARIO
 
+SCENARIO("symmetric product scaling", "[benchmark][.]") {
+
+    for (const string &circuit : SWEEP_CIRCUITS) {
+        GIVEN("A circuit " + circuit) {
+            load_benchmark(circuit);
+
+            TplStandardNetModel nmodel;
+            TplStandardNetForceModel nfmodel;
+
+            WHEN("We multiply by the lower triangle of Cx only") {
+                TplDB::db().modules.set_random_position();
+                VectorXd dx;
+                SpMat Cx = assemble_x_matrix(nmodel, nfmodel, dx);
+
+                THEN("Every thread count gets the product of the full matrix") {
+                    check_symmetric_product(Cx, true);
+                }
+            }
+        }
+    }
+}//end SCENARIO
+
 /*
 SCENARIO("adaptec2", "[adaptec2]") {
 
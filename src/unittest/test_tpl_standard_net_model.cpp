@@ -9,10 +9,34 @@
 
 #include "tpl_db.h"
 #include "tpl_standard_net_model.h"
+#include "test_utils.h"
+
+#include <cstdio>
 
 using namespace std;
 using namespace tpl;
 
+//! Require the net weight of every thread count to be the sequential one, connection by connection.
+static void check_net_weight_threads(TplStandardNetModel &nmodel, bool report)
+{
+    NetWeight expected_x, expected_y;
+    nmodel.set_num_threads(1);
+    nmodel.compute_net_weight(expected_x, expected_y);
+
+    NetWeight x_net_weight, y_net_weight;
+    sweep_threads(report ? "compute net weight" : nullptr,
+                  [&](unsigned int num_threads) { nmodel.set_num_threads(num_threads); },
+                  [&]() { nmodel.compute_net_weight(x_net_weight, y_net_weight); },
+                  [&](unsigned int) {
+                      REQUIRE( x_net_weight.pin1   == expected_x.pin1 );
+                      REQUIRE( x_net_weight.pin2   == expected_x.pin2 );
+                      REQUIRE( x_net_weight.weight == expected_x.weight );
+                      REQUIRE( y_net_weight.pin1   == expected_y.pin1 );
+                      REQUIRE( y_net_weight.pin2   == expected_y.pin2 );
+                      REQUIRE( y_net_weight.weight == expected_y.weight );
+                  });
+}
+
 SCENARIO("adaptec1", "[adaptec1]") {
 
     GIVEN("A circuit adaptec1") {
@@ -38,18 +62,120 @@ SCENARIO("adaptec1", "[adaptec1]") {
                 REQUIRE( x_net_weight.size() != 0);
                 REQUIRE( y_net_weight.size() != 0);
 
-                for(NetWeight::iterator it=x_net_weight.begin(); it!=x_net_weight.end(); ++it) {
-                    REQUIRE( it->second > 0 );
+                for(size_t k=0; k<x_net_weight.size(); ++k) {
+                    REQUIRE( x_net_weight.weight[k] > 0 );
+                }
+
+                for(size_t k=0; k<y_net_weight.size(); ++k) {
+                    REQUIRE( y_net_weight.weight[k] > 0 );
                 }
+            }
+        }
+
+        WHEN("we compute the net weight with 1 to 32 threads") {
+            THEN("every thread count gets the sequential result") {
+                check_net_weight_threads(nmodel, false);
+            }
+        }
+    }
+}//end SCENARIO
+
+SCENARIO("net weight scaling", "[benchmark][.]") {
 
-                for(NetWeight::iterator it=y_net_weight.begin(); it!=y_net_weight.end(); ++it) {
-                    REQUIRE( it->second > 0 );
+    for (const string &circuit : SWEEP_CIRCUITS) {
+        GIVEN("A circuit " + circuit) {
+            load_benchmark(circuit);
+
+            TplStandardNetModel nmodel;
+
+            WHEN("we compute the net weight with 1 to 32 threads") {
+                THEN("every thread count gets the sequential result") {
+                    check_net_weight_threads(nmodel, true);
                 }
             }
         }
     }
 }//end SCENARIO
 
+//! Require connection k of NW to tie pins pin1 and pin2 with weight.
+static void require_connection(const NetWeight &NW, size_t k, unsigned int pin1, unsigned int pin2, double weight)
+{
+    REQUIRE( NW.pin1[k] == pin1 );
+    REQUIRE( NW.pin2[k] == pin2 );
+    REQUIRE( NW.weight[k] == Approx(weight) );
+}
+
+SCENARIO("B2B net weight", "[b2b]") {
+
+    GIVEN("One net of four pins, at the centers (1, 1), (5, 10), (11, 4) and (7, 6)") {
+        vector<TplModule> data;
+        data.emplace_back("a",  0, 0, 2, 2, false, 1.0);
+        data.emplace_back("b",  4, 9, 2, 2, false, 1.0);
+        data.emplace_back("c", 10, 3, 2, 2, false, 1.0);
+        data.emplace_back("d",  6, 5, 2, 2, false, 1.0);
+        load_netlist(std::move(data), {make_net(4)});
+
+        for (unsigned int num_threads : {1u, 3u}) {
+            WHEN("We compute the net weight with " + to_string(num_threads) + " threads") {
+                TplStandardNetModel nmodel;
+                nmodel.set_num_threads(num_threads);
+                NetWeight NWx, NWy;
+                nmodel.compute_net_weight(NWx, NWy);
+
+                //the inner pins tie to both boundary pins with 2/(4-1) over their distance
+                const double w = 2.0 / 3;
+
+                THEN("The pins sorted by x, a b d c, tie b and d to a and c") {
+                    REQUIRE( NWx.size() == 4 );
+                    require_connection(NWx, 0, 0, 1, w / 4);
+                    require_connection(NWx, 1, 2, 1, w / 6);
+                    require_connection(NWx, 2, 0, 3, w / 6);
+                    require_connection(NWx, 3, 2, 3, w / 4);
+                }
+
+                THEN("The pins sorted by y, a c d b, tie c and d to a and b") {
+                    REQUIRE( NWy.size() == 4 );
+                    require_connection(NWy, 0, 0, 2, w / 3);
+                    require_connection(NWy, 1, 1, 2, w / 6);
+                    require_connection(NWy, 2, 0, 3, w / 5);
+                    require_connection(NWy, 3, 1, 3, w / 4);
+                }
+            }
+        }
+    }
+}//end SCENARIO
+
+SCENARIO("shredded macro net weight", "[shred]") {
+
+    GIVEN("Two cells of a shredded macro, tied by one original net and one shredded net") {
+        vector<TplModule> data;
+        data.emplace_back("m_0",  0, 0, 10, 10, false, 1.0);
+        data.emplace_back("m_1", 10, 4, 10, 10, false, 1.0);
+        TplNet net = make_net(2);
+        load_netlist(std::move(data), {net});
+
+        swap(net.pins[0], net.pins[1]);
+        TplDB::db().nets.add_net(vector<TplNet>(1, net));
+
+        WHEN("We compute the shredded nets' weight") {
+            TplStandardNetModel nmodel;
+            NetWeight x_net_weight, y_net_weight;
+            nmodel.update_shred_net_weight(x_net_weight, y_net_weight, 1);
+
+            THEN("The weight ties the shredded net's own pins in TplNets") {
+                REQUIRE( x_net_weight.size() == 1 );
+                REQUIRE( x_net_weight.pin1[0] == 2 );
+                REQUIRE( x_net_weight.pin2[0] == 3 );
+                REQUIRE( x_net_weight.weight[0] == Approx(2.0 / 10) );
+                REQUIRE( y_net_weight.size() == 1 );
+                REQUIRE( y_net_weight.pin1[0] == 2 );
+                REQUIRE( y_net_weight.pin2[0] == 3 );
+                REQUIRE( y_net_weight.weight[0] == Approx(2.0 / 4) );
+            }
+        }
+    }
+}//end SCENARIO
+
 /*
 SCENARIO("adaptec2", "[adaptec2]") {
 
@@ -69,12 +195,12 @@ SCENARIO("adaptec2", "[adaptec2]") {
                 REQUIRE( x_net_weight.size() != 0);
                 REQUIRE( y_net_weight.size() != 0);
 
-                for(NetWeight::iterator it=x_net_weight.begin(); it!=x_net_weight.end(); ++it) {
-                    REQUIRE( it->second > 0 );
+                for(size_t k=0; k<x_net_weight.size(); ++k) {
+                    REQUIRE( x_net_weight.weight[k] > 0 );
                 }
 
-                for(NetWeight::iterator it=y_net_weight.begin(); it!=y_net_weight.end(); ++it) {
-                    REQUIRE( it->second > 0 );
+                for(size_t k=0; k<y_net_weight.size(); ++k) {
+                    REQUIRE( y_net_weight.weight[k] > 0 );
                 }
             }
         }
@@ -99,12 +225,12 @@ SCENARIO("adaptec3", "[adaptec3]") {
                 REQUIRE( x_net_weight.size() != 0);
                 REQUIRE( y_net_weight.size() != 0);
 
-                for(NetWeight::iterator it=x_net_weight.begin(); it!=x_net_weight.end(); ++it) {
-                    REQUIRE( it->second > 0 );
+                for(size_t k=0; k<x_net_weight.size(); ++k) {
+                    REQUIRE( x_net_weight.weight[k] > 0 );
                 }
 
-                for(NetWeight::iterator it=y_net_weight.begin(); it!=y_net_weight.end(); ++it) {
-                    REQUIRE( it->second > 0 );
+                for(size_t k=0; k<y_net_weight.size(); ++k) {
+                    REQUIRE( y_net_weight.weight[k] > 0 );
                 }
             }
         }
@@ -129,12 +255,12 @@ SCENARIO("adaptec4", "[adaptec4]") {
                 REQUIRE( x_net_weight.size() != 0);
                 REQUIRE( y_net_weight.size() != 0);
 
-                for(NetWeight::iterator it=x_net_weight.begin(); it!=x_net_weight.end(); ++it) {
-                    REQUIRE( it->second > 0 );
+                for(size_t k=0; k<x_net_weight.size(); ++k) {
+                    REQUIRE( x_net_weight.weight[k] > 0 );
                 }
 
-                for(NetWeight::iterator it=y_net_weight.begin(); it!=y_net_weight.end(); ++it) {
-                    REQUIRE( it->second > 0 );
+                for(size_t k=0; k<y_net_weight.size(); ++k) {
+                    REQUIRE( y_net_weight.weight[k] > 0 );
                 }
             }
         }
@@ -159,12 +285,12 @@ SCENARIO("bigblue1", "[bigblue1]") {
                 REQUIRE( x_net_weight.size() != 0);
                 REQUIRE( y_net_weight.size() != 0);
 
-                for(NetWeight::iterator it=x_net_weight.begin(); it!=x_net_weight.end(); ++it) {
-                    REQUIRE( it->second > 0 );
+                for(size_t k=0; k<x_net_weight.size(); ++k) {
+                    REQUIRE( x_net_weight.weight[k] > 0 );
                 }
 
-                for(NetWeight::iterator it=y_net_weight.begin(); it!=y_net_weight.end(); ++it) {
-                    REQUIRE( it->second > 0 );
+                for(size_t k=0; k<y_net_weight.size(); ++k) {
+                    REQUIRE( y_net_weight.weight[k] > 0 );
                 }
             }
         }
@@ -189,12 +315,12 @@ SCENARIO("bigblue2", "[bigblue2]") {
                 REQUIRE( x_net_weight.size() != 0);
                 REQUIRE( y_net_weight.size() != 0);
 
-                for(NetWeight::iterator it=x_net_weight.begin(); it!=x_net_weight.end(); ++it) {
-                    REQUIRE( it->second > 0 );
+                for(size_t k=0; k<x_net_weight.size(); ++k) {
+                    REQUIRE( x_net_weight.weight[k] > 0 );
                 }
 
-                for(NetWeight::iterator it=y_net_weight.begin(); it!=y_net_weight.end(); ++it) {
-                    REQUIRE( it->second > 0 );
+                for(size_t k=0; k<y_net_weight.size(); ++k) {
+                    REQUIRE( y_net_weight.weight[k] > 0 );
                 }
             }
         }
@@ -219,12 +345,12 @@ SCENARIO("bigblue3", "[bigblue3]") {
                 REQUIRE( x_net_weight.size() != 0);
                 REQUIRE( y_net_weight.size() != 0);
 
-                for(NetWeight::iterator it=x_net_weight.begin(); it!=x_net_weight.end(); ++it) {
-                    REQUIRE( it->second > 0 );
+                for(size_t k=0; k<x_net_weight.size(); ++k) {
+                    REQUIRE( x_net_weight.weight[k] > 0 );
                 }
 
-                for(NetWeight::iterator it=y_net_weight.begin(); it!=y_net_weight.end(); ++it) {
-                    REQUIRE( it->second > 0 );
+                for(size_t k=0; k<y_net_weight.size(); ++k) {
+                    REQUIRE( y_net_weight.weight[k] > 0 );
                 }
             }
         }
@@ -249,12 +375,12 @@ SCENARIO("bigblue4", "[bigblue4]") {
                 REQUIRE( x_net_weight.size() != 0);
                 REQUIRE( y_net_weight.size() != 0);
 
-                for(NetWeight::iterator it=x_net_weight.begin(); it!=x_net_weight.end(); ++it) {
-                    REQUIRE( it->second > 0 );
+                for(size_t k=0; k<x_net_weight.size(); ++k) {
+                    REQUIRE( x_net_weight.weight[k] > 0 );
                 }
 
-                for(NetWeight::iterator it=y_net_weight.begin(); it!=y_net_weight.end(); ++it) {
-                    REQUIRE( it->second > 0 );
+                for(size_t k=0; k<y_net_weight.size(); ++k) {
+                    REQUIRE( y_net_weight.weight[k] > 0 );
                 }
             }
         }
@@ -10,12 +10,128 @@
 #include "utils.h"
 #include "tpl_db.h"
 #include "tpl_standard_thermal_force_model.h"
+#include "test_utils.h"
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 
 using namespace std;
 using namespace tpl;
 
+//! Require the heat flux of method to be the sequential one with every thread count, up to the summation order.
+static void check_heat_flux_threads(TplStandardThermalForceModel &tfmodel, HeatFluxMethod method, bool report)
+{
+    unsigned int num_free = TplDB::db().modules.num_free();
+    VectorXd expected_xhf(num_free), expected_yhf(num_free);
+    tfmodel.set_heat_flux_method(method);
+    tfmodel.set_num_threads(1);
+    tfmodel.compute_heat_flux_vector(expected_xhf, expected_yhf);
+
+    VectorXd xhf(num_free), yhf(num_free);
+    sweep_threads(!report ? nullptr : method == HeatFluxMethod::FFT ? "fft heat flux" : "stencil heat flux",
+                  [&](unsigned int num_threads) { tfmodel.set_num_threads(num_threads); },
+                  [&]() { tfmodel.compute_heat_flux_vector(xhf, yhf); },
+                  [&](unsigned int) {
+                      //the parts of the power density are summed up in another order
+                      REQUIRE( (xhf - expected_xhf).cwiseAbs().maxCoeff() <= 1e-12 * expected_xhf.cwiseAbs().maxCoeff() );
+                      REQUIRE( (yhf - expected_yhf).cwiseAbs().maxCoeff() <= 1e-12 * expected_yhf.cwiseAbs().maxCoeff() );
+                  });
+}
+
+//! Print the time of every heat flux method on the current placement, and the one picked automatically.
+static void report_heat_flux_methods(TplStandardThermalForceModel &tfmodel)
+{
+    unsigned int num_free = TplDB::db().modules.num_free();
+    VectorXd xhf(num_free), yhf(num_free);
+
+    const pair<HeatFluxMethod, const char *> methods[] = {
+        {HeatFluxMethod::Direct, "direct"}, {HeatFluxMethod::FFT, "fft"}, {HeatFluxMethod::Stencil, "stencil"}
+    };
+    for (const auto &method : methods) {
+        tfmodel.set_heat_flux_method(method.first);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        tfmodel.compute_heat_flux_vector(xhf, yhf);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("%s heat flux, took %.4lf seconds\n", method.second, seconds);
+    }
+    printf("auto heat flux method is %s\n", tfmodel.choose_heat_flux_method() == HeatFluxMethod::FFT ? "fft" : "stencil");
+}
+
+//! Thermal force model exposing its power density grid.
+class TplThermalForceModelProbe : public TplStandardThermalForceModel {
+public:
+    using TplStandardThermalForceModel::generate_power_density;
+
+    //! Power held by the power density grid, every grid point standing for one bin.
+    double deposited_power() const {
+        double power = 0;
+        for (int i=0; i<_power_density.width(); ++i) {
+            for (int j=0; j<_power_density.height(); ++j) {
+                power += _power_density(i, j);
+            }
+        }
+        return power * BIN_WIDTH * BIN_HEIGHT;
+    }
+
+    //! Largest difference between this power density grid and other's.
+    double max_difference(const TplThermalForceModelProbe &other) const {
+        double difference = 0;
+        for (int i=0; i<_power_density.width(); ++i) {
+            for (int j=0; j<_power_density.height(); ++j) {
+                difference = std::max(difference, std::abs(_power_density(i, j) - other._power_density(i, j)));
+            }
+        }
+        return difference;
+    }
+
+    //! Heat flux of free module k by the original bilinear weights, with its center clamped to the chip.
+    void reference_heat_flux(size_t k, double &xhf, double &yhf) const {
+        const TplModuleGeometry &g = TplDB::db().modules.geometry();
+        double x = std::min(std::max(g.x[k] + g.width[k]  / 2.0, 0.0), _gw_num * BIN_WIDTH);
+        double y = std::min(std::max(g.y[k] + g.height[k] / 2.0, 0.0), _gh_num * BIN_HEIGHT);
+
+        int idx_x = std::min(static_cast<int>(floor(x / BIN_WIDTH)),  _gw_num-1);
+        int idx_y = std::min(static_cast<int>(floor(y / BIN_HEIGHT)), _gh_num-1);
+        double x1 = idx_x * BIN_WIDTH,  x2 = x1 + BIN_WIDTH;
+        double y1 = idx_y * BIN_HEIGHT, y2 = y1 + BIN_HEIGHT;
+
+        xhf = (_xhf_grid(idx_x, idx_y) * (x2 - x) * (y2 - y) + _xhf_grid(idx_x + 1, idx_y) * (x - x1) * (y2 - y) +
+               _xhf_grid(idx_x, idx_y + 1) * (x2 - x) * (y - y1) + _xhf_grid(idx_x + 1, idx_y + 1) * (x - x1) * (y - y1))
+              / (BIN_WIDTH * BIN_HEIGHT);
+        yhf = (_yhf_grid(idx_x, idx_y) * (x2 - x) * (y2 - y) + _yhf_grid(idx_x + 1, idx_y) * (x - x1) * (y2 - y) +
+               _yhf_grid(idx_x, idx_y + 1) * (x2 - x) * (y - y1) + _yhf_grid(idx_x + 1, idx_y + 1) * (x - x1) * (y - y1))
+              / (BIN_WIDTH * BIN_HEIGHT);
+    }
+
+    //! Largest value of the power density grid.
+    double max_density() const {
+        double density = 0;
+        for (int i=0; i<_power_density.width(); ++i) {
+            for (int j=0; j<_power_density.height(); ++j) {
+                density = std::max(density, std::abs(_power_density(i, j)));
+            }
+        }
+        return density;
+    }
+};
+
+//! Power of the modules, clipped to the chip.
+static double module_power()
+{
+    const TplModuleGeometry &g = TplDB::db().modules.geometry();
+    const double chip_width  = TplDB::db().modules.chip_width();
+    const double chip_height = TplDB::db().modules.chip_height();
+
+    double power = 0;
+    for (size_t k=0; k<TplDB::db().modules.size(); ++k) {
+        double width  = std::min(g.x[k] + g.width[k],  chip_width)  - std::max(g.x[k], 0.0);
+        double height = std::min(g.y[k] + g.height[k], chip_height) - std::max(g.y[k], 0.0);
+        if (width > 0 && height > 0) power += width * height * g.power_density[k];
+    }
+    return power;
+}
+
 SCENARIO("adaptec1", "[adaptec1]") {
 
     GIVEN("A circuit adaptec1") {
@@ -43,5 +159,280 @@ SCENARIO("adaptec1", "[adaptec1]") {
             elapsed_seconds = end - start;
             cout << "total time " << elapsed_seconds.count() << " seconds" << endl;
         }
+
+        WHEN("We compute the heat flux with every method") {
+            TplDB::db().modules.set_random_position();
+
+            VectorXd direct_xhf(num_free), direct_yhf(num_free);
+            tfmodel.set_heat_flux_method(HeatFluxMethod::Direct);
+            tfmodel.compute_heat_flux_vector(direct_xhf, direct_yhf);
+
+            tfmodel.set_heat_flux_method(HeatFluxMethod::FFT);
+            tfmodel.compute_heat_flux_vector(xhf, yhf);
+
+            VectorXd stencil_xhf(num_free), stencil_yhf(num_free);
+            tfmodel.set_heat_flux_method(HeatFluxMethod::Stencil);
+            tfmodel.compute_heat_flux_vector(stencil_xhf, stencil_yhf);
+
+            THEN("The results match") {
+                REQUIRE( direct_xhf.cwiseAbs().maxCoeff() > 0 );
+                REQUIRE( (xhf - direct_xhf).cwiseAbs().maxCoeff() <= 1e-9 * direct_xhf.cwiseAbs().maxCoeff() );
+                REQUIRE( (yhf - direct_yhf).cwiseAbs().maxCoeff() <= 1e-9 * direct_yhf.cwiseAbs().maxCoeff() );
+                REQUIRE( (stencil_xhf - direct_xhf).cwiseAbs().maxCoeff() <= 1e-9 * direct_xhf.cwiseAbs().maxCoeff() );
+                REQUIRE( (stencil_yhf - direct_yhf).cwiseAbs().maxCoeff() <= 1e-9 * direct_yhf.cwiseAbs().maxCoeff() );
+            }
+        }
+
+        WHEN("We compute the heat flux with 1 to 32 threads") {
+            TplDB::db().modules.set_random_position();
+
+            THEN("Every thread count gets the sequential result") {
+                check_heat_flux_threads(tfmodel, HeatFluxMethod::Stencil, false);
+                check_heat_flux_threads(tfmodel, HeatFluxMethod::FFT, false);
+            }
+        }
+
+        WHEN("We rasterize the power density by area") {
+            TplDB::db().modules.set_random_position();
+
+            TplThermalForceModelProbe probe;
+            double expected = module_power();
+
+            //switching from point to area rasterizes the layers again
+            probe.set_power_density_method(PowerDensityMethod::Point);
+            probe.generate_power_density();
+
+            probe.set_power_density_method(PowerDensityMethod::Area);
+            probe.generate_power_density();
+            double area = probe.deposited_power();
+
+            THEN("The grid holds the modules' power") {
+                REQUIRE( expected > 0 );
+                REQUIRE( std::abs(area - expected) <= 1e-9 * expected );
+
+                for (unsigned int num_threads=2; num_threads<=8; num_threads*=2) {
+                    probe.set_num_threads(num_threads);
+                    probe.generate_power_density();
+                    REQUIRE( std::abs(probe.deposited_power() - expected) <= 1e-9 * expected );
+                }
+            }
+        }
+
+        WHEN("We interpolate the heat flux with some modules over the chip edge") {
+            TplDB::db().modules.set_random_position();
+            const TplModuleGeometry &g = TplDB::db().modules.geometry();
+
+            //module centers, a few of them on or past every edge of the chip
+            double chip_width  = TplDB::db().modules.chip_width();
+            double chip_height = TplDB::db().modules.chip_height();
+            vector<double> xs(num_free), ys(num_free);
+            for (size_t i=0; i<num_free; ++i) {
+                xs[i] = g.x[i] + g.width[i]  / 2.0;
+                ys[i] = g.y[i] + g.height[i] / 2.0;
+            }
+            const double edge_x[] = {-50, 0, chip_width, chip_width + 50, chip_width / 3};
+            const double edge_y[] = {chip_height / 3, -50, chip_height + 50, 0, chip_height};
+            for (size_t i=0; i<5 && i<num_free; ++i) {
+                xs[i] = edge_x[i];
+                ys[i] = edge_y[i];
+            }
+            TplDB::db().modules.set_free_module_coordinates(xs, ys);
+
+            TplThermalForceModelProbe probe;
+            probe.compute_heat_flux_vector(xhf, yhf);
+
+            THEN("Every module gets the heat flux of its clamped center") {
+                double scale = std::max(xhf.cwiseAbs().maxCoeff(), yhf.cwiseAbs().maxCoeff());
+                REQUIRE( scale > 0 );
+                for (size_t i=0; i<num_free; ++i) {
+                    double expected_xhf = 0, expected_yhf = 0;
+                    probe.reference_heat_flux(i, expected_xhf, expected_yhf);
+                    REQUIRE( std::abs(xhf(i) - expected_xhf) <= 1e-12 * scale );
+                    REQUIRE( std::abs(yhf(i) - expected_yhf) <= 1e-12 * scale );
+                }
+            }
+        }
+
+        WHEN("We measure the density overflow") {
+            TplDB::db().modules.set_random_position();
+
+            double none  = tfmodel.density_overflow(0);
+            double half  = tfmodel.density_overflow(0.5);
+            double full  = tfmodel.density_overflow(1);
+            double loose = tfmodel.density_overflow(1e9);
+
+            THEN("It falls from 1 to 0 as the target density rises") {
+                REQUIRE( std::abs(none - 1) <= 1e-12 );
+                REQUIRE( half <= none );
+                REQUIRE( full <= half );
+                REQUIRE( full > 0 );
+                REQUIRE( loose == 0 );
+            }
+        }
+
+        WHEN("We move a few modules between two power densities") {
+            TplDB::db().modules.set_random_position();
+            const TplModuleGeometry &g = TplDB::db().modules.geometry();
+
+            THEN("The incremental update matches the power density rasterized from scratch") {
+                for (PowerDensityMethod method : {PowerDensityMethod::Area, PowerDensityMethod::Point}) {
+                    TplThermalForceModelProbe incremental;
+                    incremental.set_power_density_method(method);
+                    incremental.generate_power_density();
+
+                    for (int round=0; round<3; ++round) {
+                        //module centers, one in ten moved by up to 3 bins
+                        vector<double> xs(num_free), ys(num_free);
+                        for (size_t i=0; i<num_free; ++i) {
+                            xs[i] = g.x[i] + g.width[i]  / 2.0;
+                            ys[i] = g.y[i] + g.height[i] / 2.0;
+                            if (i % 10 == size_t(round)) {
+                                xs[i] += (i % 7) * 3.7 - 10;
+                                ys[i] += (i % 5) * 5.3 - 10;
+                            }
+                        }
+                        TplDB::db().modules.set_free_module_coordinates(xs, ys);
+
+                        incremental.generate_power_density();
+                        TplThermalForceModelProbe scratch;
+                        scratch.set_power_density_method(method);
+                        scratch.generate_power_density();
+
+                        REQUIRE( incremental.max_difference(scratch) <= 1e-9 * scratch.max_density() );
+                    }
+                }
+            }
+        }
+
+        WHEN("We resize a few modules in place") {
+            TplDB::db().modules.set_random_position();
+            const TplModuleGeometry &g = TplDB::db().modules.geometry();
+
+            THEN("The incremental update takes them out at their old size") {
+                for (PowerDensityMethod method : {PowerDensityMethod::Area, PowerDensityMethod::Point}) {
+                    TplThermalForceModelProbe incremental;
+                    incremental.set_power_density_method(method);
+                    incremental.generate_power_density();
+
+                    //one in ten modules grows by up to 3 bins, its lower left corner kept
+                    for (size_t i=0; i<num_free; i+=10) {
+                        TplDB::db().modules.set_size(i, g.width[i] + (i % 7) * 3.7, g.height[i] + (i % 5) * 5.3);
+                    }
+
+                    incremental.generate_power_density();
+                    TplThermalForceModelProbe scratch;
+                    scratch.set_power_density_method(method);
+                    scratch.generate_power_density();
+
+                    REQUIRE( incremental.max_difference(scratch) <= 1e-9 * scratch.max_density() );
+                }
+            }
+        }
+
+        WHEN("We move every module by less than the area tolerance, then beyond it") {
+            TplDB::db().modules.set_random_position();
+            const TplModuleGeometry &g = TplDB::db().modules.geometry();
+
+            //moves the module centers by d, the bins of config.json are 8 wide, the tolerance 1/32 bin
+            auto shift = [&](double d) {
+                vector<double> xs(num_free), ys(num_free);
+                for (size_t i=0; i<num_free; ++i) {
+                    xs[i] = g.x[i] + g.width[i]  / 2.0 + d;
+                    ys[i] = g.y[i] + g.height[i] / 2.0 + d;
+                }
+                TplDB::db().modules.set_free_module_coordinates(xs, ys);
+            };
+
+            TplThermalForceModelProbe incremental, unmoved;
+            incremental.set_power_density_method(PowerDensityMethod::Area);
+            unmoved.set_power_density_method(PowerDensityMethod::Area);
+            incremental.generate_power_density();
+            unmoved.generate_power_density();
+
+            shift(0.1);
+            incremental.generate_power_density();
+            TplThermalForceModelProbe near;
+            near.set_power_density_method(PowerDensityMethod::Area);
+            near.generate_power_density();
+            const double near_difference = incremental.max_difference(unmoved);
+            const double near_error      = incremental.max_difference(near);
+
+            shift(0.2);
+            incremental.generate_power_density();
+            TplThermalForceModelProbe far;
+            far.set_power_density_method(PowerDensityMethod::Area);
+            far.generate_power_density();
+
+            THEN("The small move is skipped with a bounded error, the larger one is rasterized") {
+                REQUIRE( near_difference == 0 );
+                REQUIRE( near_error <= 0.02 * near.max_density() );
+                REQUIRE( incremental.max_difference(far) <= 1e-9 * far.max_density() );
+            }
+        }
+    }
+}//end SCENARIO
+
+SCENARIO("density overflow", "[overflow]") {
+
+    GIVEN("Two 8x8 cells stacked off the grid and a fixed 8x8 macro in the corner of a 64x64 chip") {
+        //8x8 bins, the bin of grid point (i,j) is centered on (8i,8j)
+        vector<TplModule> data;
+        data.emplace_back("a", 6, 4, 8, 8, false, 1.0);
+        data.emplace_back("b", 6, 4, 8, 8, false, 1.0);
+        data.emplace_back("m", 56, 56, 8, 8, true, 1.0);
+        TplDB::db().modules = std::move( TplModules(std::move(data), 2) );
+
+        WHEN("We measure the density overflow by point and by area") {
+            TplStandardThermalForceModel tfmodel;
+
+            THEN("It is the overflow of the covered area fractions") {
+                //the cells cover 3/4 of bin (1,1) and 1/4 of bin (2,1) twice, the macro a quarter of
+                //bins (7,7), (7,8), (8,7) and (8,8), of which (7,8) and (8,7) are half inside the chip
+                //and (8,8) a quarter, 3 bins of area in all
+                //over 1,   bin (1,1) holds 1.5 - 1, the others are under their target
+                //over 0.5, bin (1,1) holds 1.5 - 0.5 and bin (8,8) 0.25 - 0.125
+                for (PowerDensityMethod method : {PowerDensityMethod::Point, PowerDensityMethod::Area}) {
+                    tfmodel.set_power_density_method(method);
+                    REQUIRE( std::abs(tfmodel.density_overflow(1)   - 0.5 / 3)   <= 1e-12 );
+                    REQUIRE( std::abs(tfmodel.density_overflow(0.5) - 1.125 / 3) <= 1e-12 );
+                }
+            }
+        }
+    }
+}//end SCENARIO
+
+SCENARIO("heat flux scaling", "[benchmark][.]") {
+
+    for (const string &circuit : SWEEP_CIRCUITS) {
+        GIVEN("A circuit " + circuit) {
+            load_benchmark(circuit);
+
+            TplStandardThermalForceModel tfmodel;
+
+            WHEN("We compute the heat flux with 1 to 32 threads") {
+                TplDB::db().modules.set_random_position();
+
+                THEN("Every thread count gets the sequential result") {
+                    check_heat_flux_threads(tfmodel, HeatFluxMethod::Stencil, true);
+                    check_heat_flux_threads(tfmodel, HeatFluxMethod::FFT, true);
+                }
+            }
+        }
+    }
+}//end SCENARIO
+
+SCENARIO("heat flux methods", "[benchmark][.]") {
+
+    for (const string &circuit : SWEEP_CIRCUITS) {
+        GIVEN("A circuit " + circuit) {
+            load_benchmark(circuit);
+            TplDB::db().modules.set_random_position();
+
+            TplStandardThermalForceModel tfmodel;
+
+            THEN("Every heat flux method is timed") {
+                report_heat_flux_methods(tfmodel);
+            }
+        }
     }
 }//end SCENARIO
@@ -0,0 +1,177 @@
+/*!
+ * \file test_tpl_trace.cpp
+ * \brief Placement trace unittest.
+ */
+
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include "tpl_trace.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+using namespace std;
+using namespace tpl;
+
+//! Reads the fields of a trace file in order.
+struct TraceReader {
+    vector<char> bytes;
+    size_t offset = 0;
+
+    explicit TraceReader(const string &path)
+    {
+        ifstream in(path, ios::binary);
+        bytes.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+
+    template<typename T>
+    T read()
+    {
+        T value;
+        REQUIRE( offset + sizeof(T) <= bytes.size() );
+        memcpy(&value, &bytes[offset], sizeof(T));
+        offset += sizeof(T);
+        return value;
+    }
+
+    string read_string(size_t n)
+    {
+        REQUIRE( offset + n <= bytes.size() );
+        string s(&bytes[offset], n);
+        offset += n;
+        return s;
+    }
+
+    vector<double> read_doubles(size_t n)
+    {
+        REQUIRE( offset + n * sizeof(double) <= bytes.size() );
+        vector<double> values(n);
+        memcpy(values.data(), &bytes[offset], n * sizeof(double));
+        offset += n * sizeof(double);
+        return values;
+    }
+};
+
+SCENARIO("trace records", "[trace]") {
+
+    GIVEN("A trace sampling every other iteration") {
+        TplTraceSettings settings;
+        settings.enabled  = true;
+        settings.path     = "test_tpl_trace.bin";
+        settings.interval = 2;
+
+        SpMat A(3, 3);
+        A.insert(0, 0) = 4;
+        A.insert(2, 0) = -1;
+        A.insert(1, 1) = 2.5;
+        A.insert(0, 2) = -1;
+        VectorXd v(4);
+        v << 1, -2, 3.5, 0;
+
+        WHEN("We record a matrix and a vector of the sampled iterations") {
+            {
+                TplTrace trace(settings);
+                REQUIRE( trace.enabled() );
+                for (int iteration=0; iteration<4; ++iteration) {
+                    if (!trace.sampled(iteration)) continue;
+                    trace.record("A", iteration, A);
+                    trace.record("v", iteration, v);
+                }
+            }
+
+            THEN("The file holds them in order, in the trace format") {
+                TraceReader reader(settings.path);
+                REQUIRE( reader.read_string(8) == "TPLTRACE" );
+                REQUIRE( reader.read<uint32_t>() == 1 );
+
+                SpMat C(A);
+                C.makeCompressed();
+                for (int iteration=0; iteration<4; iteration+=2) {
+                    REQUIRE( reader.read<uint32_t>() == 2 );
+                    REQUIRE( reader.read<int32_t>() == iteration );
+                    REQUIRE( reader.read_string(reader.read<uint32_t>()) == "A" );
+                    REQUIRE( reader.read<int64_t>() == 3 );
+                    REQUIRE( reader.read<int64_t>() == 3 );
+                    REQUIRE( reader.read<int64_t>() == 4 );
+                    for (int k=0; k<=3; ++k) REQUIRE( reader.read<int32_t>() == C.outerIndexPtr()[k] );
+                    for (int k=0; k<4; ++k)  REQUIRE( reader.read<int32_t>() == C.innerIndexPtr()[k] );
+                    for (int k=0; k<4; ++k)  REQUIRE( reader.read<double>() == C.valuePtr()[k] );
+
+                    REQUIRE( reader.read<uint32_t>() == 1 );
+                    REQUIRE( reader.read<int32_t>() == iteration );
+                    REQUIRE( reader.read_string(reader.read<uint32_t>()) == "v" );
+                    REQUIRE( reader.read<uint64_t>() == 4 );
+                    for (int k=0; k<4; ++k)  REQUIRE( reader.read<double>() == v(k) );
+                }
+                REQUIRE( reader.offset == reader.bytes.size() );
+                remove(settings.path.c_str());
+            }
+        }
+    }
+
+    GIVEN("A trace of more records than the writer's queue holds") {
+        TplTraceSettings settings;
+        settings.enabled = true;
+        settings.path    = "test_tpl_trace_queue.bin";
+
+        //about 47 MB, past BUFFER_BYTES * (MAX_PENDING + 1) = 36 MiB, so the placement thread
+        //waits on the writer, and of sizes a buffer holds no whole number of
+        const int num_iterations = 48;
+        auto size = [](int iteration) { return size_t(100003 + 1000 * iteration); };
+        auto value = [](int iteration, size_t k) { return iteration + k * 1e-6; };
+
+        WHEN("We record a large vector every iteration") {
+            size_t bytes = 0;
+            {
+                TplTrace trace(settings);
+                REQUIRE( trace.enabled() );
+                for (int iteration=0; iteration<num_iterations; ++iteration) {
+                    VectorXd v(size(iteration));
+                    for (size_t k=0; k<size(iteration); ++k) v(k) = value(iteration, k);
+                    trace.record("v", iteration, v);
+                    bytes += size(iteration) * sizeof(double);
+                }
+            }
+            REQUIRE( bytes > (size_t(1) << 22) * 9 );
+
+            THEN("Every record reads back in order") {
+                TraceReader reader(settings.path);
+                REQUIRE( reader.read_string(8) == "TPLTRACE" );
+                REQUIRE( reader.read<uint32_t>() == 1 );
+
+                for (int iteration=0; iteration<num_iterations; ++iteration) {
+                    REQUIRE( reader.read<uint32_t>() == 1 );
+                    REQUIRE( reader.read<int32_t>() == iteration );
+                    REQUIRE( reader.read_string(reader.read<uint32_t>()) == "v" );
+                    REQUIRE( reader.read<uint64_t>() == size(iteration) );
+
+                    vector<double> values = reader.read_doubles(size(iteration));
+                    size_t mismatches = 0;
+                    for (size_t k=0; k<values.size(); ++k) {
+                        if (values[k] != value(iteration, k)) ++mismatches;
+                    }
+                    REQUIRE( mismatches == 0 );
+                }
+                REQUIRE( reader.offset == reader.bytes.size() );
+                remove(settings.path.c_str());
+            }
+        }
+    }
+
+    GIVEN("A disabled trace") {
+        TplTraceSettings settings;
+        settings.path = "test_tpl_trace_disabled.bin";
+        TplTrace trace(settings);
+
+        THEN("No iteration is sampled and no file is written") {
+            REQUIRE( !trace.enabled() );
+            REQUIRE( !trace.sampled(0) );
+            trace.record("v", 0, VectorXd::Ones(3));
+            trace.flush();
+            REQUIRE( !ifstream(settings.path) );
+        }
+    }
+}//end SCENARIO
@@ -0,0 +1,87 @@
+/*!
+ * \file test_utils.h
+ * \brief Helpers shared by the tpl unittests.
+ */
+
+#ifndef TPL_TEST_UTILS_H
+#define TPL_TEST_UTILS_H
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "tpl_db.h"
+
+namespace tpl {
+
+    //! Circuits of the hidden [benchmark] scenarios, a small one and the largest one.
+    static const std::vector<std::string> SWEEP_CIRCUITS = {"adaptec1", "bigblue4"};
+
+    //! Load the ispd2005 circuit name from the BENCHMARK directory into TplDB.
+    inline void load_benchmark(const std::string &name)
+    {
+        std::string path(getenv("BENCHMARK"));
+        path += "/ispd2005/" + name;
+        TplDB::db().load_circuit(path);
+    }
+
+    //! A net of num_pins input pins at the centers of the modules 0, ..., num_pins-1.
+    /*!
+     * The degree is num_pins unless given, shred() for one keeps a macro net's degree.
+     */
+    inline TplNet make_net(unsigned int num_pins, unsigned int degree = 0)
+    {
+        TplPin pin;
+        pin.io = IOType::Input;
+        pin.dx = 0;
+        pin.dy = 0;
+
+        TplNet net;
+        net.degree = degree > 0 ? degree : num_pins;
+        net.pins.assign(num_pins, pin);
+        for (unsigned int i=0; i<num_pins; ++i) net.pins[i].module_index = i;
+        return net;
+    }
+
+    //! Put the modules, all free, and the nets into TplDB.
+    inline void load_netlist(std::vector<TplModule> modules, const std::vector<TplNet> &nets)
+    {
+        const unsigned int num_free = modules.size();
+        TplDB::db().modules = TplModules(std::move(modules), num_free);
+        TplDB::db().nets.assign(nets);
+    }
+
+    //! Sweep a parallel computation over thread counts and check every result.
+    /*!
+     * For every count in threads, setup(count) prepares the computation, run() is timed,
+     * averaged over repetitions calls, and check(count) compares its result with the
+     * sequential one. With label set, every count's time is printed after it, and so is
+     * the bandwidth if one run reads bytes bytes.
+     */
+    template<typename Setup, typename Run, typename Check>
+    void sweep_threads(const char *label, Setup setup, Run run, Check check,
+                       const std::vector<unsigned int> &threads = {1, 2, 4, 8, 16, 32},
+                       int repetitions = 1, double bytes = 0)
+    {
+        for (unsigned int num_threads : threads) {
+            setup(num_threads);
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (int r=0; r<repetitions; ++r) run();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / repetitions;
+
+            if (label != nullptr) {
+                printf("%s, %2u threads, %8.3lf ms", label, num_threads, seconds * 1e3);
+                if (bytes > 0) printf(", %6.2lf MB read, %6.2lf GB/s", bytes / 1e6, bytes / seconds / 1e9);
+                printf("\n");
+            }
+
+            check(num_threads);
+        }
+    }
+
+}//end namespace tpl
+
+#endif //TPL_TEST_UTILS_H